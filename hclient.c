@@ -9,8 +9,8 @@
 #include <string.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
-#include <netinet/tcp.h>
 #include "hcomm.h"
 
 int client_disconnect(hclient_t *cli, int error_code)
@@ -22,141 +22,148 @@ int client_disconnect(hclient_t *cli, int error_code)
   {
     cli->disconnected_callback(cli);
   }
+  // Try again once the delay is over, client_poll() sleeps until then
+  uint32_t delay_ms = cli->reconnect_delay_ms ? cli->reconnect_delay_ms : CLIENT_DEFAULT_RECONNECT_DELAY_MS;
+  htimer_add(&cli->loop.timers, &cli->reconnect_timer, delay_ms, 0);
   return 0;
 }
 
-int client_connect(hclient_t *cli)
+/* Create a non-blocking socket for endpoint and start connecting it to address:port, or to the unix
+   socket at address when that is a path starting with '/'.
+   On failure the caller deletes the endpoint, which closes whatever socket was created. */
+int client_open_endpoint(endpoint_t *endpoint, const char *address, uint16_t port)
 {
-  switch (cli->connection_state)
+  struct sockaddr_un unix_sockaddr;
+  bool is_unix = address[0] == '/';
+  if (is_unix)
   {
-  case CONNECTION_STATE_DISCONNECTED:
-    create_endpoint(&cli->server_endpoint);
-    // Create socket
-    cli->server_endpoint.socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (cli->server_endpoint.socket < 0)
+    memset(&unix_sockaddr, 0, sizeof(unix_sockaddr));
+    unix_sockaddr.sun_family = AF_UNIX;
+    if (strlen(address) >= sizeof(unix_sockaddr.sun_path))
     {
-#ifdef HCOMM_DEBUG_ERROR
-      printf("Error, Failed to create socket: %d\n", errno);
-#endif
-      client_disconnect(cli, errno);
+      HLOG_ERROR("Error, unix socket path %s is too long\n", address);
       return -1;
     }
-    // Allow IP address reuse
-    int reuseAddr = 1;
-    int result = setsockopt(cli->server_endpoint.socket, SOL_SOCKET, SO_REUSEADDR, &reuseAddr, sizeof(reuseAddr));
-    if (result == -1)
-    {
-#ifdef HCOMM_DEBUG_ERROR
-      printf("Error, ConnectNode setsockopt SOL_SOCKET SO_RESUSEADDR failure %d", errno);
-#endif      
-      client_disconnect(cli, errno);
-      return result;
-    }
-    // Set non-blocking
-    int flags = fcntl(cli->server_endpoint.socket, F_GETFL, 0);
-    if (flags == -1)
-    {
-#ifdef HCOMM_DEBUG_ERROR
-      printf("Error, ConnectNode fcntl F_GETFL failure %d", errno);
-#endif
-      client_disconnect(cli, errno);
-      return flags;
-    }
-    flags |= O_NONBLOCK;
-    result = fcntl(cli->server_endpoint.socket, F_SETFL, flags);
-    if (result == -1)
+    strcpy(unix_sockaddr.sun_path, address);
+  }
+  // Create socket
+  endpoint->socket = socket(is_unix ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+  if (endpoint->socket < 0)
+  {
+    HLOG_ERROR("Error, Failed to create socket: %d\n", errno);
+    return -1;
+  }
+  // Allow IP address reuse
+  int reuseAddr = 1;
+  int result = setsockopt(endpoint->socket, SOL_SOCKET, SO_REUSEADDR, &reuseAddr, sizeof(reuseAddr));
+  if (result == -1)
+  {
+    HLOG_ERROR("Error, ConnectNode setsockopt SOL_SOCKET SO_RESUSEADDR failure %d", errno);
+    return result;
+  }
+  // Set non-blocking
+  int flags = fcntl(endpoint->socket, F_GETFL, 0);
+  if (flags == -1)
+  {
+    HLOG_ERROR("Error, ConnectNode fcntl F_GETFL failure %d", errno);
+    return flags;
+  }
+  flags |= O_NONBLOCK;
+  result = fcntl(endpoint->socket, F_SETFL, flags);
+  if (result == -1)
+  {
+    HLOG_ERROR("Error, ConnectNode fcntl F_SETFL failure %d", errno);
+    return result;
+  }
+  if (is_unix)
+  {
+    // Only the family tells it apart, unix peers have no address to show
+    memset(&endpoint->address, 0, sizeof(endpoint->address));
+    endpoint->address.sin_family = AF_UNIX;
+    // A full backlog fails with EAGAIN instead of completing later, the next attempt retries
+    result = connect(endpoint->socket, (struct sockaddr *)&unix_sockaddr, sizeof(unix_sockaddr));
+    if (result < 0 && errno != EINPROGRESS)
     {
-#ifdef HCOMM_DEBUG_ERROR
-      printf("Error, ConnectNode fcntl F_SETFL failure %d", errno);
-#endif
-      client_disconnect(cli, errno);
+      HLOG_ERROR("Error, client_connect to %s failure %d\n", address, errno);
       return result;
     }
-    // Set up address
-    struct sockaddr_in server_sockaddr;
-    memset(&server_sockaddr, 0, sizeof(server_sockaddr));
-    server_sockaddr.sin_family = AF_INET;
-    server_sockaddr.sin_addr.s_addr = inet_addr(cli->server_address);
-    server_sockaddr.sin_port = htons(cli->server_port);
-    cli->server_endpoint.address = server_sockaddr;
+    return 0;
+  }
+  // Set up address
+  struct sockaddr_in server_sockaddr;
+  memset(&server_sockaddr, 0, sizeof(server_sockaddr));
+  server_sockaddr.sin_family = AF_INET;
+  server_sockaddr.sin_addr.s_addr = inet_addr(address);
+  server_sockaddr.sin_port = htons(port);
+  endpoint->address = server_sockaddr;
+
+  result = connect(endpoint->socket, (struct sockaddr *)&endpoint->address, sizeof(struct sockaddr));
+  if (result < 0 && errno != EINPROGRESS)
+  {
+    HLOG_ERROR("Error, client_connect failure %d\n", errno);
+    return result;
+  }
+  return 0;
+}
 
-    result = connect(cli->server_endpoint.socket, (struct sockaddr *)&cli->server_endpoint.address, sizeof(struct sockaddr));
+/* The socket of endpoint reported writable while connecting, check how the connect went. */
+int client_check_endpoint(endpoint_t *endpoint)
+{
+  int valopt = 0;
+  socklen_t lon = sizeof(int);
+  if (getsockopt(endpoint->socket, SOL_SOCKET, SO_ERROR, (void*)(&valopt), &lon) < 0)
+  {
+      HLOG_ERROR("Error, in getsockopt() %d - %s\n", errno, strerror(errno));
+      return -2;
+  }
+  // Check the value returned...
+  if (valopt)
+  {
+      HLOG_ERROR("Error, in delayed connection() %d - %s\n", valopt, strerror(valopt));
+      return -3;
+  }
+
+  if (endpoint_set_profile(endpoint, endpoint->profile) != 0)
+    return -1;
+  // Carries on over the socket when no shared memory could be set up
+  if (endpoint->shared_memory && endpoint->address.sin_family == AF_UNIX && endpoint_offer_shm(endpoint) != 0)
+    return -1;
+  return 0;
+}
+
+int client_connect(hclient_t *cli)
+{
+  switch (cli->connection_state)
+  {
+  case CONNECTION_STATE_DISCONNECTED:
+    create_endpoint(&cli->server_endpoint);
+    if (cli->measure_rtt)
+      endpoint_measure_rtt(&cli->server_endpoint, true);
+    endpoint_set_watermarks(&cli->server_endpoint, cli->send_high_watermark, cli->send_low_watermark, cli->throttle_reads);
+    endpoint_set_compression(&cli->server_endpoint, cli->compress, cli->compress_threshold, cli->compress_dict);
+    cli->server_endpoint.profile = cli->socket_profile;
+    cli->server_endpoint.shared_memory = cli->shared_memory;
+    int result = client_open_endpoint(&cli->server_endpoint, cli->server_address, cli->server_port);
     if (result < 0)
     {
-      if (errno == EINPROGRESS)
-      {
-        cli->connection_state = CONNECTION_STATE_INPROGRESS;
-      }
-      else
-      {
-#ifdef HCOMM_DEBUG_ERROR
-        printf("Error, client_connect failure %d\n", errno);
-#endif
-        client_disconnect(cli, errno);
-      }
+      client_disconnect(cli, errno);
       return result;
     }
+    cli->connection_state = CONNECTION_STATE_INPROGRESS;
     // Intentional fallthrough
-    break;
   case CONNECTION_STATE_INPROGRESS:
   {
-    struct timeval tv = { .tv_sec = 0, .tv_usec = 0 };
-    fd_set connect_fd_set; 
-    FD_ZERO(&connect_fd_set); 
-    FD_SET(cli->server_endpoint.socket, &connect_fd_set); 
-    int result = select(cli->server_endpoint.socket + 1, NULL, &connect_fd_set, NULL, &tv);
-    if (result < 0 && errno != EINTR) 
-    { 
-        printf("Error, select for connecting %d - %s\n", errno, strerror(errno)); 
-        client_disconnect(cli, errno);
-        return result;
-    } 
-    else if (result > 0)
+    // Wait for the socket to become writable, client_finish_connect() completes it
+    uint32_t events = HEVENT_WRITE;
+    if (cli->server_endpoint.loop == NULL)
     {
-        // Socket selected for write 
-        int valopt = 0;
-        socklen_t lon = sizeof(int); 
-        valopt = 0;
-        if (getsockopt(cli->server_endpoint.socket, SOL_SOCKET, SO_ERROR, (void*)(&valopt), &lon) < 0) 
-        { 
-            printf("Error, in getsockopt() %d - %s\n", errno, strerror(errno)); 
-            client_disconnect(cli, errno);
-            return -2;
-        } 
-        // Check the value returned... 
-        if (valopt) 
-        { 
-            printf("Error, in delayed connection() %d - %s\n", valopt, strerror(valopt)); 
-            client_disconnect(cli, errno);
-            return -3;
-        }
-        else
-        {
-          int option = 0;
-          result = setsockopt(cli->server_endpoint.socket, SOL_TCP, TCP_NODELAY, &option, sizeof(option));
-          if (result == -1)
-          {
-      #ifdef HCOMM_DEBUG_ERROR
-            printf("Error, client_connect setsockopt TCP_NODELAY failure %d", errno);
-      #endif
-            client_disconnect(cli, errno);
-            return result;
-          }
-          option = 1;
-          result = setsockopt(cli->server_endpoint.socket, SOL_TCP, TCP_QUICKACK, &option, sizeof(option));
-          if (result == -1)
-          {
-      #ifdef HCOMM_DEBUG_ERROR
-            printf("Error, client_connect setsockopt TCP_QUICKACK failure %d", errno);
-      #endif
-            client_disconnect(cli, errno);
-            return result;
-          }
-
-          printf("Connected to %s:%d.\n", cli->server_address, cli->server_port);
-          cli->connection_state = CONNECTION_STATE_CONNECTED;
-          cli->connected_callback(cli);          
-        }
+      if (event_loop_add(&cli->loop, cli->server_endpoint.socket, events, &cli->server_endpoint) != 0)
+      {
+        client_disconnect(cli, errno);
+        return -1;
+      }
+      cli->server_endpoint.loop = &cli->loop;
+      cli->server_endpoint.registered_events = events;
     }
   }
   break;
@@ -166,76 +173,80 @@ int client_connect(hclient_t *cli)
   return 0;
 }
 
-int client_build_fd_sets(hclient_t *cli)
+/* The socket reported writable while connecting, check how the connect went. */
+int client_finish_connect(hclient_t *cli)
 {
-  FD_ZERO(&cli->read_fds);
-  FD_SET(cli->server_endpoint.socket, &cli->read_fds);
-
-  FD_ZERO(&cli->write_fds);
-  // If there is smth to send, set up write_fd for server_endpoint socket
-  if (&cli->server_endpoint.send_queue.index > 0)
-    FD_SET(cli->server_endpoint.socket, &cli->write_fds);
+  int result = client_check_endpoint(&cli->server_endpoint);
+  if (result < 0)
+  {
+    client_disconnect(cli, errno);
+    return result;
+  }
 
-  FD_ZERO(&cli->error_fds);
-  FD_SET(cli->server_endpoint.socket, &cli->error_fds);
+  HLOG_INFO("Connected to %s:%d.\n", cli->server_address, cli->server_port);
+  cli->connection_state = CONNECTION_STATE_CONNECTED;
+  cli->connected_callback(cli);
+  // From now on read interest is permanent and write interest follows the send queue
+  return endpoint_update_events(&cli->server_endpoint);
+}
 
+static int client_reconnect(htimer_t *timer)
+{
+  hclient_t *cli = timer->data;
+  if (cli->connection_state == CONNECTION_STATE_DISCONNECTED)
+    client_connect(cli);
   return 0;
 }
 
 int client_init(hclient_t *cli)
 {
+  if (event_loop_init(&cli->loop, cli->event_backend) != 0)
+    return -1;
+  htimer_init(&cli->reconnect_timer, client_reconnect, cli);
   client_connect(cli);
   return 0;
 }
 
-int client_periodic(hclient_t *cli)
+/* Wait up to timeout_ms for socket events (-1 blocks) and service them. */
+int client_poll(hclient_t *cli, int timeout_ms)
 {
-  // If not connected, try to connect
-  if (cli->connection_state != CONNECTION_STATE_CONNECTED)
-  {
+  // If not connected and no retry is scheduled, try to connect
+  if (cli->connection_state == CONNECTION_STATE_DISCONNECTED && !htimer_active(&cli->reconnect_timer))
     client_connect(cli);
-    return -1;
-  }
-  int maxfd = cli->server_endpoint.socket;
-  // Select updates fd_set's, so we need to build fd_set's before each select()call.
-  client_build_fd_sets(cli);
-  // Don't wait on the select just read it
-  struct timeval select_timeout = {.tv_sec = 0, .tv_usec = 0};
-  int result = select(maxfd + 1, &cli->read_fds, &cli->write_fds, &cli->error_fds, &select_timeout);
-  if (result == -1)
+
+  int count = event_loop_wait(&cli->loop, timeout_ms);
+  if (count < 0)
   {
-#ifdef HCOMM_DEBUG_ERROR
-    printf("Error, select failed: %d\n", errno);
-#endif
     client_disconnect(cli, errno);
+    return -1;
   }
-  else if (result > 0)
+
+  for (int n = 0; n < count; ++n)
   {
-    if (FD_ISSET(cli->server_endpoint.socket, &cli->read_fds))
+    uint32_t events = cli->loop.events[n].events;
+    if (cli->connection_state == CONNECTION_STATE_INPROGRESS)
     {
-      if (cli->connection_state == CONNECTION_STATE_CONNECTED)
-      {
-        if((result = receive_from_endpoint(&cli->server_endpoint)) < 0)
-            client_disconnect(cli, result);
-      }
-    }
-
-    if (FD_ISSET(cli->server_endpoint.socket, &cli->write_fds))
-    {
-      if (cli->connection_state == CONNECTION_STATE_CONNECTED)
-      {
-        if ((result = send_to_endpoint(&cli->server_endpoint)) < 0)
-            client_disconnect(cli, result);
-      }
+      if (client_finish_connect(cli) != 0)
+        return -1;
+      // Flush whatever the connected callback queued
+      events |= HEVENT_WRITE;
     }
+    if (cli->connection_state != CONNECTION_STATE_CONNECTED)
+      return -1;
 
-    if (FD_ISSET(cli->server_endpoint.socket, &cli->error_fds))
+    hevent_t ev = cli->loop.events[n];
+    ev.events = events;
+    int result = endpoint_handle_event(&cli->server_endpoint, &ev);
+    if (result < 0)
     {
-#ifdef HCOMM_DEBUG_ERROR
-      printf("Error, error_fds for server_endpoint.\n");
-#endif
-      client_disconnect(cli, errno);
+      client_disconnect(cli, result);
+      return -1;
     }
   }
-  return 0;
+  return count;
+}
+
+int client_periodic(hclient_t *cli)
+{
+  return client_poll(cli, 0);
 }
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <signal.h>
@@ -9,330 +10,1955 @@
 #include <string.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+// Zero-copy sends need the completion records of the socket error queue (Linux 4.14+)
+#if defined(__has_include)
+#if __has_include(<linux/errqueue.h>)
+#include <linux/errqueue.h>
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HCOMM_HAVE_ZEROCOPY
+#endif
+#endif
+#endif
+#endif
 
 #include "hcomm.h"
 
-int prepare_packet(char *sender, char *data, hp_packet_t *packet)
+/* Count n into field of the endpoint and of the totals it adds to. */
+#define ENDPOINT_COUNT(endpoint, field, n) \
+    do \
+    { \
+        HP_STAT_ADD(&(endpoint)->stats, field, n); \
+        if ((endpoint)->stats_total != NULL) \
+            HP_STAT_ADD((endpoint)->stats_total, field, n); \
+    } while (0)
+
+int prepare_packet(char *sender, char *data, hp_packet_t *packet)
+{
+    packet->header.message_size = snprintf((char *)packet->message, HP_MESSAGE_MAX_SIZE, "%s", data);
+    return 0;
+}
+
+int print_packet(hp_packet_t *packet)
+{
+    printf("Message: \"%s\"\n", packet->message);
+    return 0;
+}
+
+static size_t packet_length(const hp_packet_t *packet)
+{
+    if ((packet->header.version & HP_PACKET_VERSION_MASK) == HP_PACKET_VERSION_LARGE)
+        return HP_LARGE_HEADER_SIZE + ((const hp_large_header *)packet->raw)->message_length;
+    return sizeof(packet->header) + packet->header.message_size;
+}
+
+/* Pooled packet with room for length bytes of frame, the caller holds the first reference. */
+static hp_shared_packet_t *shared_packet_alloc(size_t length)
+{
+    size_t size = hp_pool_size(offsetof(hp_shared_packet_t, packet) + length);
+    hp_shared_packet_t *shared = hp_pool_alloc(size);
+    if (shared == NULL)
+        return NULL;
+    shared->refcount = 1;
+    shared->capacity = size - offsetof(hp_shared_packet_t, packet);
+    return shared;
+}
+
+/* Copy packet into a shared buffer sized to its used length. */
+hp_shared_packet_t *shared_packet_create(const hp_packet_t *packet)
+{
+    size_t length = packet_length(packet);
+    if (length > sizeof(*packet))
+        return NULL;
+    hp_shared_packet_t *shared = shared_packet_alloc(length);
+    if (shared == NULL)
+        return NULL;
+    memcpy(shared->packet.raw, packet->raw, length);
+    return shared;
+}
+
+/* Build a HP_PACKET_VERSION_LARGE frame around length bytes of message. */
+hp_shared_packet_t *shared_packet_create_large(uint8_t message_type, const void *message, uint32_t length)
+{
+    hp_shared_packet_t *shared = shared_packet_alloc(HP_LARGE_HEADER_SIZE + (size_t)length);
+    if (shared == NULL)
+        return NULL;
+    hp_large_header *header = (hp_large_header *)shared->packet.raw;
+    memset(header->raw, 0, sizeof(*header));
+    header->header.version = HP_PACKET_VERSION_LARGE;
+    header->header.message_type = message_type;
+    header->message_length = length;
+    if (message != NULL)
+        memcpy(shared->packet.raw + HP_LARGE_HEADER_SIZE, message, length);
+    return shared;
+}
+
+void shared_packet_retain(hp_shared_packet_t *shared)
+{
+    __atomic_add_fetch(&shared->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void shared_packet_release(hp_shared_packet_t *shared)
+{
+    if (shared != NULL && __atomic_sub_fetch(&shared->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+        hp_pool_free(shared, offsetof(hp_shared_packet_t, packet) + shared->capacity);
+}
+
+/* Keep the receive buffer of view alive past the callback, one release per retain. */
+void packet_view_retain(hp_packet_view_t *view)
+{
+    shared_packet_retain(view->buffer);
+}
+
+void packet_view_release(hp_packet_view_t *view)
+{
+    shared_packet_release(view->buffer);
+    view->buffer = NULL;
+}
+
+/* Body of a frame sent straight from memory the caller owns or from a file, see endpoint_send_buffer(). */
+typedef struct hp_bulk_t
+{
+    struct hp_bulk_t *next;             /*!< Next bulk waiting for its zero-copy completion. */
+    endpoint_t *endpoint;
+    const uint8_t *data;                /*!< Body in memory or the mapped file region, NULL sends from fd. */
+    uint32_t length;
+    int fd;
+    off_t file_offset;
+    void *map;                          /*!< Mapping of the file region for backends sending from memory. */
+    size_t map_length;
+    uint32_t zerocopy_seq;              /*!< Last MSG_ZEROCOPY send covering part of the body. */
+    bool zerocopy_used;
+    bool sent;                          /*!< Every byte left the queue. */
+    bulk_complete_callback_t callback;
+    void *user_data;
+} hp_bulk_t;
+
+static hp_bulk_t *bulk_create(endpoint_t *endpoint, uint32_t length, bulk_complete_callback_t callback, void *user_data)
+{
+    hp_bulk_t *bulk = calloc(1, sizeof(hp_bulk_t));
+    if (bulk == NULL)
+        return NULL;
+    bulk->endpoint = endpoint;
+    bulk->length = length;
+    bulk->fd = -1;
+    bulk->callback = callback;
+    bulk->user_data = user_data;
+    return bulk;
+}
+
+/* Map the file region of bulk for sending it from memory. */
+static int bulk_map(hp_bulk_t *bulk)
+{
+    off_t start = bulk->file_offset - bulk->file_offset % sysconf(_SC_PAGESIZE);
+    bulk->map_length = bulk->file_offset - start + bulk->length;
+    void *map = mmap(NULL, bulk->map_length, PROT_READ, MAP_SHARED, bulk->fd, start);
+    if (map == MAP_FAILED)
+    {
+        HLOG_ERROR("Error, Failed to map %u bytes of file %d: %d\n", bulk->length, bulk->fd, errno);
+        return -1;
+    }
+    bulk->map = map;
+    bulk->data = (uint8_t *)map + (bulk->file_offset - start);
+    return 0;
+}
+
+/* Tell the owner its body is done with, status 0 once sent or -HP_EIO when the connection went first. */
+static void bulk_finish(hp_bulk_t *bulk, int status)
+{
+    if (bulk->map != NULL)
+        munmap(bulk->map, bulk->map_length);
+    if (bulk->callback)
+        bulk->callback(bulk->endpoint, bulk->user_data, status);
+    free(bulk);
+}
+
+/* The send queue let go of bulk, a zero-copy body waits until the kernel let go of its pages too. */
+static void bulk_release(hp_bulk_t *bulk)
+{
+    endpoint_t *endpoint = bulk->endpoint;
+    if (bulk->sent && bulk->zerocopy_used && (int32_t)(endpoint->zerocopy_done - bulk->zerocopy_seq) <= 0)
+    {
+        bulk->next = NULL;
+        if (endpoint->zerocopy_pending_tail != NULL)
+            endpoint->zerocopy_pending_tail->next = bulk;
+        else
+            endpoint->zerocopy_pending = bulk;
+        endpoint->zerocopy_pending_tail = bulk;
+        return;
+    }
+    bulk_finish(bulk, bulk->sent ? 0 : -HP_EIO);
+}
+
+/* Finish the zero-copy bulks from the oldest on whose completion arrived, or all of them with status. */
+static void endpoint_finish_zerocopy(endpoint_t *endpoint, bool all, int status)
+{
+    while (endpoint->zerocopy_pending != NULL)
+    {
+        hp_bulk_t *bulk = endpoint->zerocopy_pending;
+        if (!all && (int32_t)(endpoint->zerocopy_done - bulk->zerocopy_seq) <= 0)
+            break;
+        endpoint->zerocopy_pending = bulk->next;
+        if (endpoint->zerocopy_pending == NULL)
+            endpoint->zerocopy_pending_tail = NULL;
+        bulk_finish(bulk, status);
+    }
+}
+
+/* FIFO ring of packets, queue_size is rounded up to a power of two and doubled whenever it fills up.
+   The ring is only borrowed from the pool while packets are queued, idle connections don't pay for it. */
+int create_packet_queue(packet_queue_t *queue, int queue_size)
+{
+    uint32_t size = 1;
+    while (size < (uint32_t)queue_size)
+        size <<= 1;
+    queue->slots = NULL;
+    queue->reserved = NULL;
+    queue->size = size;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->bytes = 0;
+    queue->bulk_bytes = 0;
+
+    return 0;
+}
+
+static void packet_queue_release_ring(packet_queue_t *queue)
+{
+    hp_pool_free(queue->slots, queue->size * sizeof(packet_queue_entry_t));
+    queue->slots = NULL;
+}
+
+void delete_packet_queue(packet_queue_t *queue)
+{
+    dequeue_all(queue);
+    shared_packet_release(queue->reserved);
+    queue->reserved = NULL;
+    packet_queue_release_ring(queue);
+    queue->head = 0;
+    queue->tail = 0;
+    queue->bytes = 0;
+    queue->bulk_bytes = 0;
+}
+
+uint32_t packet_queue_count(packet_queue_t *queue)
+{
+    return queue->tail - queue->head;
+}
+
+/* Make sure the ring exists and has a free slot, a full one is replaced by one twice its size. */
+static int packet_queue_alloc_ring(packet_queue_t *queue)
+{
+    if (queue->slots == NULL)
+    {
+        queue->slots = hp_pool_alloc(queue->size * sizeof(packet_queue_entry_t));
+        return queue->slots == NULL ? -1 : 0;
+    }
+    uint32_t count = packet_queue_count(queue);
+    if (count < queue->size)
+        return 0;
+
+    packet_queue_entry_t *slots = hp_pool_alloc(2 * queue->size * sizeof(packet_queue_entry_t));
+    if (slots == NULL)
+        return -1;
+    // Positions relative to the head are all anyone keeps, in flight sends included
+    for (uint32_t i = 0; i < count; ++i)
+        slots[i] = queue->slots[(queue->head + i) & (queue->size - 1)];
+    hp_pool_free(queue->slots, queue->size * sizeof(packet_queue_entry_t));
+    queue->slots = slots;
+    queue->size *= 2;
+    queue->head = 0;
+    queue->tail = count;
+    return 0;
+}
+
+static packet_queue_entry_t *packet_queue_entry(packet_queue_t *queue, uint32_t n)
+{
+    return &queue->slots[(queue->head + n) & (queue->size - 1)];
+}
+
+/* Frame bytes of entry n behind the head. */
+static uint8_t *packet_queue_data(packet_queue_t *queue, uint32_t n)
+{
+    packet_queue_entry_t *entry = packet_queue_entry(queue, n);
+    if (entry->offset == PACKET_QUEUE_BULK)
+        return (uint8_t *)entry->bulk->data;
+    return entry->shared->packet.raw + entry->offset;
+}
+
+static uint32_t packet_queue_length(packet_queue_t *queue, uint32_t n)
+{
+    return packet_queue_entry(queue, n)->length;
+}
+
+/* Packet n behind the head, valid for n < packet_queue_count(). A queued view may be unaligned. */
+hp_packet_t *packet_queue_at(packet_queue_t *queue, uint32_t n)
+{
+    return (hp_packet_t *)packet_queue_data(queue, n);
+}
+
+/* Append a reference to length bytes of shared starting at offset, the ring already has room. */
+static void packet_queue_append(packet_queue_t *queue, hp_shared_packet_t *shared, uint32_t offset, uint32_t length)
+{
+    packet_queue_entry_t *entry = &queue->slots[queue->tail & (queue->size - 1)];
+    entry->shared = shared;
+    entry->offset = offset;
+    entry->length = length;
+    queue->bytes += length;
+    queue->tail++;
+}
+
+/* Packet with room for length bytes to build in place, NULL when out of memory.
+   Reserving again before the commit hands out the same packet while it is large enough. */
+hp_packet_t *packet_queue_reserve(packet_queue_t *queue, size_t length)
+{
+    // The ring is taken and grown now so the commit can't fail
+    if (packet_queue_alloc_ring(queue) != 0)
+        return NULL;
+    if (queue->reserved != NULL && queue->reserved->capacity < length)
+    {
+        shared_packet_release(queue->reserved);
+        queue->reserved = NULL;
+    }
+    if (queue->reserved == NULL)
+        queue->reserved = shared_packet_alloc(length);
+    return queue->reserved ? &queue->reserved->packet : NULL;
+}
+
+void packet_queue_commit(packet_queue_t *queue)
+{
+    packet_queue_append(queue, queue->reserved, 0, packet_length(&queue->reserved->packet));
+    queue->reserved = NULL;
+}
+
+/* Queue another reference to shared instead of a copy. */
+int packet_queue_push_shared(packet_queue_t *queue, hp_shared_packet_t *shared)
+{
+    if (packet_queue_alloc_ring(queue) != 0)
+        return -1;
+    shared_packet_retain(shared);
+    packet_queue_append(queue, shared, 0, packet_length(&shared->packet));
+    return 0;
+}
+
+/* Queue the frame of view straight from the receive buffer it lives in, retaining that buffer. */
+int packet_queue_push_view(packet_queue_t *queue, const hp_packet_view_t *view)
+{
+    if (packet_queue_alloc_ring(queue) != 0)
+        return -1;
+    shared_packet_retain(view->buffer);
+    packet_queue_append(queue, view->buffer, view->data - view->buffer->packet.raw, view->length);
+    return 0;
+}
+
+/* Queue the large header in shared followed by the body entry of bulk, both or neither. */
+static int packet_queue_push_bulk(packet_queue_t *queue, hp_shared_packet_t *shared, hp_bulk_t *bulk)
+{
+    if (packet_queue_alloc_ring(queue) != 0)
+        return -1;
+    packet_queue_append(queue, shared, 0, HP_LARGE_HEADER_SIZE);
+    if (packet_queue_alloc_ring(queue) != 0)
+    {
+        queue->tail--;
+        queue->bytes -= HP_LARGE_HEADER_SIZE;
+        return -1;
+    }
+    shared_packet_retain(shared);
+    packet_queue_entry_t *entry = &queue->slots[queue->tail & (queue->size - 1)];
+    entry->bulk = bulk;
+    entry->offset = PACKET_QUEUE_BULK;
+    entry->length = bulk->length;
+    queue->bytes += bulk->length;
+    queue->bulk_bytes += bulk->length;
+    queue->tail++;
+    return 0;
+}
+
+void packet_queue_pop(packet_queue_t *queue)
+{
+    if (queue->head == queue->tail)
+        return;
+    packet_queue_entry_t *entry = packet_queue_entry(queue, 0);
+    hp_bulk_t *bulk = entry->offset == PACKET_QUEUE_BULK ? entry->bulk : NULL;
+    queue->bytes -= entry->length;
+    if (bulk != NULL)
+        queue->bulk_bytes -= entry->length;
+    else
+        shared_packet_release(entry->shared);
+    queue->head++;
+    if (queue->head == queue->tail && queue->reserved == NULL)
+        packet_queue_release_ring(queue);
+    // Last, its callback may queue again
+    if (bulk != NULL)
+        bulk_release(bulk);
+}
+
+int enqueue(packet_queue_t *queue, hp_packet_t *packet)
+{
+    size_t length = packet_length(packet);
+    if (length > sizeof(*packet))
+        return -1;
+    hp_packet_t *slot = packet_queue_reserve(queue, length);
+    if (slot == NULL)
+        return -1;
+
+    // Only the used part of the packet is copied
+    memcpy(slot, packet, length);
+    packet_queue_commit(queue);
+
+    return 0;
+}
+
+int dequeue(packet_queue_t *queue, hp_packet_t *packet)
+{
+    if (packet_queue_count(queue) == 0)
+        return -1;
+
+    uint32_t length = packet_queue_length(queue, 0);
+    uint8_t *data = packet_queue_data(queue, 0);
+    if (length > sizeof(*packet) || data == NULL)
+        return -1;
+    memcpy(packet, data, length);
+    packet_queue_pop(queue);
+
+    return 0;
+}
+
+int dequeue_all(packet_queue_t *queue)
+{
+    while (packet_queue_count(queue) > 0)
+        packet_queue_pop(queue);
+    return 0;
+}
+
+/* Follow the send queue with the queued bytes gauges and their high water marks. */
+static void endpoint_count_queued(endpoint_t *endpoint)
+{
+    uint64_t queued = endpoint->send_queue.bytes;
+    uint64_t previous = endpoint->stats.queued_bytes;
+    if (queued == previous)
+        return;
+    HP_STAT_SET(&endpoint->stats, queued_bytes, queued);
+    if (queued > endpoint->stats.queued_high)
+        HP_STAT_SET(&endpoint->stats, queued_high, queued);
+    hp_stats_t *total = endpoint->stats_total;
+    if (total == NULL)
+        return;
+    HP_STAT_SET(total, queued_bytes, total->queued_bytes + queued - previous);
+    if (total->queued_bytes > total->queued_high)
+        HP_STAT_SET(total, queued_high, total->queued_bytes);
+}
+
+static bool endpoint_uses_uring(endpoint_t *endpoint)
+{
+    return endpoint->loop != NULL && endpoint->loop->backend == HEVENT_BACKEND_URING;
+}
+
+static void endpoint_release_held_queue(void *arg)
+{
+    packet_queue_t *queue = arg;
+    delete_packet_queue(queue);
+    free(queue);
+}
+
+/* io_uring sends in flight read the queued packets until they complete, hand the send queue over to
+   the ring until then. Owners of bulk bodies hear of them once the kernel let go, without endpoint. */
+static void endpoint_hold_send_queue(endpoint_t *endpoint)
+{
+    packet_queue_t *held = malloc(sizeof(packet_queue_t));
+    if (held == NULL)
+    {
+        HLOG_ERROR("Error, out of memory holding the sends in flight to %s\n", get_endpoint_address_str(endpoint));
+        return;
+    }
+    *held = endpoint->send_queue;
+    for (uint32_t i = 0; i < packet_queue_count(held); ++i)
+    {
+        packet_queue_entry_t *entry = packet_queue_entry(held, i);
+        if (entry->offset == PACKET_QUEUE_BULK)
+            entry->bulk->endpoint = NULL;
+    }
+    if (uring_release_after_sends(endpoint->loop, endpoint->socket, endpoint_release_held_queue, held) != 0)
+    {
+        for (uint32_t i = 0; i < packet_queue_count(held); ++i)
+        {
+            packet_queue_entry_t *entry = packet_queue_entry(held, i);
+            if (entry->offset == PACKET_QUEUE_BULK)
+                entry->bulk->endpoint = endpoint;
+        }
+        free(held);
+        return;
+    }
+    endpoint->send_queue.slots = NULL;
+    endpoint->send_queue.reserved = NULL;
+    endpoint->send_queue.head = 0;
+    endpoint->send_queue.tail = 0;
+    endpoint->send_queue.bytes = 0;
+    endpoint->send_queue.bulk_bytes = 0;
+    endpoint->send_batch_count = 0;
+    endpoint->send_batch_pending = 0;
+}
+
+int delete_endpoint(endpoint_t *endpoint)
+{
+    if (endpoint_uses_uring(endpoint) && endpoint->send_batch_pending > 0 && endpoint->socket != NO_SOCKET)
+        endpoint_hold_send_queue(endpoint);
+    endpoint_unregister(endpoint);
+    close(endpoint->socket);
+    endpoint->socket = NO_SOCKET;
+    hshm_close(endpoint);
+    // Unsent bodies are failed with the queue, sent zero-copy ones can't be confirmed anymore
+    delete_packet_queue(&endpoint->send_queue);
+    endpoint_count_queued(endpoint);
+    endpoint_finish_zerocopy(endpoint, true, -HP_EIO);
+    endpoint_rpc_fail_all(endpoint, -HP_EIO);
+    shared_packet_release(endpoint->rx_block);
+    endpoint->rx_block = NULL;
+    endpoint->rx_buffer = NULL;
+    free(endpoint->rx_large_buffer);
+    endpoint->rx_large_buffer = NULL;
+    endpoint->rx_large_active = false;
+    free(endpoint->rtt);
+    endpoint->rtt = NULL;
+    return 0;
+}
+
+/* The oldest held packet waited long enough, flush whatever is queued. */
+static int endpoint_coalesce_expired(htimer_t *timer)
+{
+    endpoint_t *endpoint = timer->data;
+    endpoint->coalesce_flush = true;
+    endpoint_update_events(endpoint);
+    return 0;
+}
+
+static uint32_t endpoint_sessions;
+
+int create_endpoint(endpoint_t *endpoint)
+{
+    create_packet_queue(&endpoint->send_queue, PACKET_QUEUE_SIZE);
+
+    endpoint->send_packet_index = 0;
+    endpoint->profile = HP_PROFILE_DEFAULT;
+    endpoint->coalesce_bytes = 0;
+    endpoint->coalesce_us = 0;
+    endpoint->coalesce_flush = false;
+    htimer_init(&endpoint->coalesce_timer, endpoint_coalesce_expired, endpoint);
+    endpoint->send_high_watermark = 0;
+    endpoint->send_low_watermark = 0;
+    endpoint->send_queue_limit = 0;
+    endpoint->throttle_reads = false;
+    endpoint->unwritable = false;
+    endpoint->writable_callback = NULL;
+    endpoint->unwritable_callback = NULL;
+    endpoint->rx_block = NULL;
+    endpoint->rx_buffer = NULL;
+    endpoint->rx_start = 0;
+    endpoint->rx_end = 0;
+    endpoint->packet_view_callback = NULL;
+    endpoint->receive_error = HP_ENOERR;
+    endpoint->rx_large_buffer = NULL;
+    endpoint->rx_large_received = 0;
+    endpoint->rx_large_active = false;
+    endpoint->rx_large_intercepted = false;
+    endpoint->rtt = NULL;
+    endpoint->rtt_total = NULL;
+    endpoint->compress = false;
+    endpoint->compress_threshold = 0;
+    endpoint->compress_dict = NULL;
+    endpoint->peer_accepts = 0;
+    endpoint->request_callback = NULL;
+    endpoint->topic_callback = NULL;
+    endpoint->topic_context = NULL;
+    endpoint->subscriptions = NULL;
+    endpoint->subscription_count = 0;
+    endpoint->topic_mark = 0;
+    endpoint->shared_memory = false;
+    endpoint->shm = NULL;
+    memset(&endpoint->stats, 0, sizeof(endpoint->stats));
+    endpoint->stats_total = NULL;
+    endpoint->address_str[0] = '\0';
+    endpoint->rpc_calls = NULL;
+    endpoint->rpc_capacity = 0;
+    endpoint->rpc_in_flight = 0;
+    endpoint->rpc_next_id = 0;
+    endpoint->rpc_session = __atomic_add_fetch(&endpoint_sessions, 1, __ATOMIC_RELAXED);
+    endpoint->loop = NULL;
+    endpoint->registered_events = 0;
+    endpoint->zerocopy = 0;
+    endpoint->zerocopy_next = 0;
+    endpoint->zerocopy_done = 0;
+    endpoint->zerocopy_pending = NULL;
+    endpoint->zerocopy_pending_tail = NULL;
+    endpoint->send_batch_count = 0;
+    endpoint->send_batch_pending = 0;
+    endpoint->send_batch_broken = false;
+
+    return 0;
+}
+
+bool endpoint_has_pending_send(endpoint_t *endpoint)
+{
+    return packet_queue_count(&endpoint->send_queue) > 0;
+}
+
+/* Queued bytes above which the endpoint turns unwritable and at which it is writable again. */
+void endpoint_set_watermarks(endpoint_t *endpoint, size_t high, size_t low, bool throttle_reads)
+{
+    endpoint->send_high_watermark = high;
+    endpoint->send_low_watermark = low;
+    endpoint->throttle_reads = throttle_reads;
+}
+
+bool endpoint_is_writable(endpoint_t *endpoint)
+{
+    return !endpoint->unwritable;
+}
+
+static int endpoint_setsockopt(endpoint_t *endpoint, int level, int name, int value, const char *name_str)
+{
+    if (setsockopt(endpoint->socket, level, name, &value, sizeof(value)) == 0)
+        return 0;
+    HLOG_ERROR("Error, setsockopt %s of %s failure %d\n", name_str, get_endpoint_address_str(endpoint), errno);
+    return -1;
+}
+
+/* Tune the socket for profile, at any time while connected. Low latency sends every packet at once,
+   polls the device briefly before sleeping where that is permitted and keeps little unsent data in
+   the kernel, so it piles up in the send queue where the watermarks see it. Throughput enlarges
+   the socket buffers for good and coalesces. The sizes set stay when switching away. */
+int endpoint_set_profile(endpoint_t *endpoint, hp_socket_profile_t profile)
+{
+    endpoint->profile = profile;
+    endpoint->coalesce_flush = false;
+    // Unix sockets have no TCP options, their buffers still count
+    if (endpoint->socket != NO_SOCKET && endpoint->address.sin_family != AF_UNIX)
+    {
+        if (endpoint_setsockopt(endpoint, SOL_TCP, TCP_NODELAY, profile != HP_PROFILE_DEFAULT, "TCP_NODELAY") != 0 ||
+            endpoint_setsockopt(endpoint, SOL_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK") != 0)
+            return -1;
+#ifdef TCP_NOTSENT_LOWAT
+        // Zero goes back to the system default
+        setsockopt(endpoint->socket, SOL_TCP, TCP_NOTSENT_LOWAT, &(int){ profile == HP_PROFILE_LOW_LATENCY ? HP_NOTSENT_LOWAT : 0 }, sizeof(int));
+#endif
+    }
+    if (endpoint->socket != NO_SOCKET)
+    {
+#ifdef SO_BUSY_POLL
+        // Needs CAP_NET_ADMIN beyond net.core.busy_read, without it the profile just doesn't poll
+        setsockopt(endpoint->socket, SOL_SOCKET, SO_BUSY_POLL, &(int){ profile == HP_PROFILE_LOW_LATENCY ? HP_BUSY_POLL_US : 0 }, sizeof(int));
+#endif
+        if (profile == HP_PROFILE_THROUGHPUT)
+        {
+            // Capped by net.core.wmem_max and rmem_max
+            setsockopt(endpoint->socket, SOL_SOCKET, SO_SNDBUF, &(int){ HP_THROUGHPUT_BUFFER_SIZE }, sizeof(int));
+            setsockopt(endpoint->socket, SOL_SOCKET, SO_RCVBUF, &(int){ HP_THROUGHPUT_BUFFER_SIZE }, sizeof(int));
+        }
+    }
+    return endpoint_update_events(endpoint);
+}
+
+/* Flush a coalescing endpoint once bytes are queued or the oldest packet waited us microseconds. */
+void endpoint_set_coalescing(endpoint_t *endpoint, uint32_t bytes, uint32_t us)
+{
+    endpoint->coalesce_bytes = bytes;
+    endpoint->coalesce_us = us;
+    endpoint_update_events(endpoint);
+}
+
+/* Compress packets from threshold message bytes on once the peer takes them, both may prime the
+   codec with the same dict. Received compressed packets are restored either way. */
+void endpoint_set_compression(endpoint_t *endpoint, bool compress, uint16_t threshold, const hlz_dict_t *dict)
+{
+    endpoint->compress = compress;
+    endpoint->compress_threshold = threshold;
+    endpoint->compress_dict = dict;
+}
+
+/* Flip the writability once the queued bytes cross a watermark and tell the producer. */
+static void endpoint_check_writable(endpoint_t *endpoint)
+{
+    size_t queued = endpoint->send_queue.bytes;
+    if (!endpoint->unwritable)
+    {
+        size_t high = endpoint->send_high_watermark ? endpoint->send_high_watermark : HP_SEND_HIGH_WATERMARK;
+        if (queued <= high)
+            return;
+        endpoint->unwritable = true;
+        HLOG_VERBOSE("Info, %s unwritable with %zu bytes queued.\n", get_endpoint_address_str(endpoint), queued);
+        if (endpoint->unwritable_callback)
+            endpoint->unwritable_callback(endpoint);
+    }
+    else
+    {
+        size_t low = endpoint->send_low_watermark ? endpoint->send_low_watermark : HP_SEND_LOW_WATERMARK;
+        if (queued > low)
+            return;
+        endpoint->unwritable = false;
+        HLOG_VERBOSE("Info, %s writable again with %zu bytes queued.\n", get_endpoint_address_str(endpoint), queued);
+        if (endpoint->writable_callback)
+            endpoint->writable_callback(endpoint);
+    }
+}
+
+static bool endpoint_reads_paused(endpoint_t *endpoint)
+{
+    return endpoint->throttle_reads && endpoint->unwritable;
+}
+
+/* Start flushing a coalescing endpoint once enough is queued, or arm the timer that does so once
+   the oldest packet waited coalesce_us, rounded up to the millisecond of the timer wheel. */
+static void endpoint_check_coalesce(endpoint_t *endpoint)
+{
+    if (endpoint->profile != HP_PROFILE_THROUGHPUT)
+        return;
+    if (!endpoint_has_pending_send(endpoint) || endpoint->loop == NULL)
+    {
+        // Without a loop there is no timer to flush later
+        endpoint->coalesce_flush = endpoint->loop == NULL;
+        if (endpoint->loop != NULL)
+            htimer_cancel(&endpoint->loop->timers, &endpoint->coalesce_timer);
+        return;
+    }
+    if (endpoint->coalesce_flush)
+        return;
+    size_t bytes = endpoint->coalesce_bytes ? endpoint->coalesce_bytes : HP_COALESCE_BYTES;
+    if (endpoint->send_queue.bytes >= bytes)
+    {
+        endpoint->coalesce_flush = true;
+        htimer_cancel(&endpoint->loop->timers, &endpoint->coalesce_timer);
+    }
+    else if (!htimer_active(&endpoint->coalesce_timer))
+    {
+        uint32_t us = endpoint->coalesce_us ? endpoint->coalesce_us : HP_COALESCE_US;
+        htimer_add(&endpoint->loop->timers, &endpoint->coalesce_timer, (us + 999) / 1000, 0);
+    }
+}
+
+/* Read interest unless throttled, write interest while something is queued and not held back. On
+   shared memory the doorbell is always read, it also tells when the ring has room again. */
+static uint32_t endpoint_wanted_events(endpoint_t *endpoint)
+{
+    uint32_t events = endpoint_reads_paused(endpoint) ? 0 : HEVENT_READ;
+    hshm_t *shm = endpoint->shm;
+    if (shm != NULL && shm->state == HSHM_ACTIVE)
+    {
+        events = HEVENT_READ;
+        if (shm->tx_full)
+            return events;
+    }
+    // Sends wait for the answer to an offer
+    else if (shm != NULL && shm->state == HSHM_OFFERED)
+    {
+        return events;
+    }
+    if (endpoint_has_pending_send(endpoint) && (endpoint->profile != HP_PROFILE_THROUGHPUT || endpoint->coalesce_flush))
+        events |= HEVENT_WRITE;
+    return events;
+}
+
+/* Refuse length more bytes once the queue holds send_queue_limit, an empty queue takes anything.
+   Bulk bodies live in the caller's memory and aren't held against the limit. */
+static int endpoint_check_send_room(endpoint_t *endpoint, size_t length)
+{
+    size_t limit = endpoint->send_queue_limit ? endpoint->send_queue_limit : HP_SEND_QUEUE_LIMIT;
+    size_t held = endpoint->send_queue.bytes - endpoint->send_queue.bulk_bytes;
+    if (held == 0 || held + length <= limit)
+        return 0;
+    ENDPOINT_COUNT(endpoint, send_drops, 1);
+    HLOG_ERROR("Error, Send queue of %s holds %zu bytes, refusing %zu more\n", get_endpoint_address_str(endpoint), held, length);
+    return -1;
+}
+
+/* Register the endpoint socket once, write interest follows the send queue. */
+int endpoint_register(endpoint_t *endpoint, hevent_loop_t *loop)
+{
+    uint32_t events = endpoint_wanted_events(endpoint);
+    if (event_loop_add(loop, endpoint->socket, events, endpoint) != 0)
+        return -1;
+    endpoint->loop = loop;
+    endpoint->registered_events = events;
+    return 0;
+}
+
+int endpoint_unregister(endpoint_t *endpoint)
+{
+    if (endpoint->loop == NULL)
+        return 0;
+    event_loop_remove(endpoint->loop, endpoint->socket);
+    if (endpoint->shm != NULL)
+        hshm_unregister(endpoint);
+    htimer_cancel(&endpoint->loop->timers, &endpoint->coalesce_timer);
+    endpoint->loop = NULL;
+    endpoint->registered_events = 0;
+    // Whatever was in flight got cancelled with the registration
+    endpoint->send_batch_count = 0;
+    endpoint->send_batch_pending = 0;
+    endpoint->send_batch_broken = false;
+    return 0;
+}
+
+/* Turn write interest on while something is queued and off once the queue drained, read interest
+   off while a throttled endpoint is unwritable. Called after every change of the send queue. */
+int endpoint_update_events(endpoint_t *endpoint)
+{
+    endpoint_count_queued(endpoint);
+    endpoint_check_writable(endpoint);
+    endpoint_check_coalesce(endpoint);
+    if (endpoint->shm != NULL)
+        hshm_set_reads_paused(endpoint, endpoint_reads_paused(endpoint));
+    if (endpoint->loop == NULL)
+        return 0;
+    uint32_t events = endpoint_wanted_events(endpoint);
+    if (events == endpoint->registered_events)
+        return 0;
+    // Write interest lives on the doorbell once sends go through shared memory
+    int fd = endpoint->shm != NULL && endpoint->shm->state == HSHM_ACTIVE ? endpoint->shm->doorbell : endpoint->socket;
+    if (event_loop_modify(endpoint->loop, fd, events, endpoint) != 0)
+        return -1;
+    endpoint->registered_events = events;
+    return 0;
+}
+
+/* Formatted the first time it is asked for and kept with the endpoint, not again per log line. */
+char *get_endpoint_address_str(endpoint_t *endpoint)
+{
+    char *ret = endpoint->address_str;
+    if (ret[0] != '\0')
+        return ret;
+    if (endpoint->address.sin_family == AF_UNIX)
+    {
+        sprintf(ret, "unix:%d", endpoint->socket);
+        return ret;
+    }
+    char endpoint_ipv4_str[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &endpoint->address.sin_addr, endpoint_ipv4_str, INET_ADDRSTRLEN);
+    sprintf(ret, "%s:%d", endpoint_ipv4_str, endpoint->address.sin_port);
+    return ret;
+}
+
+char* get_address_str(struct sockaddr_in* addr)
+{
+    static __thread char ret[INET_ADDRSTRLEN + 10];
+    if (addr->sin_family == AF_UNIX)
+        return strcpy(ret, "unix");
+    char endpoint_ipv4_str[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr->sin_addr, endpoint_ipv4_str, INET_ADDRSTRLEN);
+    sprintf(ret, "%s:%d", endpoint_ipv4_str, addr->sin_port);
+    return ret;
+}
+
+/* Stamp a CMD about to be queued with the send time, its HP_MSG_REPLY brings the stamp back. */
+static void endpoint_stamp(endpoint_t *endpoint, hp_packet_header *header)
+{
+    if (endpoint->rtt == NULL || header->message_type != HP_MSG_CMD || header->stamp != 0)
+        return;
+    uint32_t now = hhist_now_us();
+    header->stamp = now ? now : 1;
+}
+
+/* Start or stop collecting round trip times, the histogram is only allocated here. */
+int endpoint_measure_rtt(endpoint_t *endpoint, bool enable)
+{
+    if (!enable)
+    {
+        free(endpoint->rtt);
+        endpoint->rtt = NULL;
+        return 0;
+    }
+    if (endpoint->rtt != NULL)
+        return 0;
+    endpoint->rtt = malloc(sizeof(hhist_t));
+    if (endpoint->rtt == NULL)
+        return -1;
+    hhist_reset(endpoint->rtt);
+    return 0;
+}
+
+/* Round trip percentiles in microseconds, -1 when the endpoint doesn't measure them. */
+int endpoint_rtt_summary(endpoint_t *endpoint, hhist_summary_t *summary)
+{
+    if (endpoint->rtt == NULL)
+        return -1;
+    hhist_summarize(endpoint->rtt, summary);
+    return 0;
+}
+
+/* Tell the peer what this endpoint takes in the version flags of a packet about to be queued. */
+static void endpoint_announce(endpoint_t *endpoint, hp_packet_header *header)
+{
+    header->version |= HP_VERSION_ACCEPTS_COMPRESSED;
+    if (endpoint->compress_dict != NULL)
+        header->version |= HP_VERSION_ACCEPTS_DICTIONARY;
+}
+
+/* Compress the message of packet into out when the peer takes it and that makes it shorter. */
+static bool endpoint_compress(endpoint_t *endpoint, const hp_packet_t *packet, hp_packet_t *out)
+{
+    uint32_t length = packet->header.message_size;
+    uint16_t threshold = endpoint->compress_threshold ? endpoint->compress_threshold : HP_COMPRESS_THRESHOLD;
+    if (!(endpoint->peer_accepts & HP_VERSION_ACCEPTS_COMPRESSED) || length < threshold ||
+        (packet->header.version & HP_PACKET_VERSION_MASK) == HP_PACKET_VERSION_LARGE)
+        return false;
+
+    const hlz_dict_t *dict = (endpoint->peer_accepts & HP_VERSION_ACCEPTS_DICTIONARY) ? endpoint->compress_dict : NULL;
+    uint16_t original_size = length;
+    // Shorter by at least a byte with the original size in front, or not at all
+    int compressed = hlz_compress(dict, packet->message, length, out->message + sizeof(original_size), length - sizeof(original_size) - 1);
+    if (compressed < 0)
+        return false;
+    memcpy(out->message, &original_size, sizeof(original_size));
+    out->header = packet->header;
+    out->header.version = (packet->header.version & HP_PACKET_VERSION_MASK) | HP_VERSION_COMPRESSED | (dict ? HP_VERSION_DICTIONARY : 0);
+    out->header.message_size = sizeof(original_size) + compressed;
+    return true;
+}
+
+int endpoint_queue_send(endpoint_t *endpoint, hp_packet_t *packet)
+{
+    hp_packet_t compressed;
+    if (endpoint->compress && endpoint_compress(endpoint, packet, &compressed))
+        packet = &compressed;
+    if (endpoint_check_send_room(endpoint, packet_length(packet)) != 0)
+        return -1;
+    if (enqueue(&endpoint->send_queue, packet) != 0)
+        return -1;
+    hp_packet_t *queued = packet_queue_at(&endpoint->send_queue, packet_queue_count(&endpoint->send_queue) - 1);
+    if (endpoint->rtt != NULL)
+        endpoint_stamp(endpoint, &queued->header);
+    if (endpoint->compress && (queued->header.version & HP_PACKET_VERSION_MASK) != HP_PACKET_VERSION_LARGE)
+        endpoint_announce(endpoint, &queued->header);
+    return endpoint_update_events(endpoint);
+}
+
+/* Forward a received frame without copying it, the receive buffer stays alive until it is sent. */
+int endpoint_queue_view(endpoint_t *endpoint, const hp_packet_view_t *view)
+{
+    if (endpoint_check_send_room(endpoint, view->length) != 0)
+        return -1;
+    if (packet_queue_push_view(&endpoint->send_queue, view) != 0)
+        return -1;
+    return endpoint_update_events(endpoint);
+}
+
+int endpoint_queue_shared(endpoint_t *endpoint, hp_shared_packet_t *shared)
+{
+    if (endpoint_check_send_room(endpoint, packet_length(&shared->packet)) != 0)
+        return -1;
+    if (packet_queue_push_shared(&endpoint->send_queue, shared) != 0)
+        return -1;
+    return endpoint_update_events(endpoint);
+}
+
+/* Reserve a packet directly in the send queue, fill message and header.message_size then commit it.
+   Returns NULL when the queue is at its limit or max_message_size doesn't fit into a packet. */
+hp_packet_t *endpoint_reserve_send(endpoint_t *endpoint, size_t max_message_size)
+{
+    if (max_message_size > HP_MESSAGE_MAX_SIZE)
+        return NULL;
+    if (endpoint_check_send_room(endpoint, HP_PACKET_HEADER_SIZE + max_message_size) != 0)
+        return NULL;
+    hp_packet_t *packet = packet_queue_reserve(&endpoint->send_queue, HP_PACKET_HEADER_SIZE + max_message_size);
+    if (packet == NULL)
+        return NULL;
+    memset(packet->header.raw, 0, sizeof(packet->header));
+    return packet;
+}
+
+int endpoint_commit_send(endpoint_t *endpoint, hp_packet_t *packet)
+{
+    hp_shared_packet_t *reserved = endpoint->send_queue.reserved;
+    if (reserved == NULL || packet != &reserved->packet)
+        return -1;
+    if (packet_length(packet) > reserved->capacity)
+    {
+        HLOG_ERROR("Error, committed packet of %zu bytes exceeds the %u reserved\n", packet_length(packet), reserved->capacity);
+        return -1;
+    }
+    endpoint_stamp(endpoint, &packet->header);
+    if (endpoint->compress && (packet->header.version & HP_PACKET_VERSION_MASK) != HP_PACKET_VERSION_LARGE)
+    {
+        hp_packet_t compressed;
+        if (endpoint_compress(endpoint, packet, &compressed))
+            memcpy(packet->raw, compressed.raw, packet_length(&compressed));
+        endpoint_announce(endpoint, &packet->header);
+    }
+    packet_queue_commit(&endpoint->send_queue);
+    return endpoint_update_events(endpoint);
+}
+
+/* Queue length bytes of message, a message too long for a packet goes out as one large frame. */
+int endpoint_send_message(endpoint_t *endpoint, uint8_t message_type, const void *message, uint32_t length)
+{
+    if (length <= HP_MESSAGE_MAX_SIZE)
+    {
+        hp_packet_t *packet = endpoint_reserve_send(endpoint, length);
+        if (packet == NULL)
+            return -1;
+        packet->header.message_type = message_type;
+        packet->header.message_size = length;
+        memcpy(packet->message, message, length);
+        return endpoint_commit_send(endpoint, packet);
+    }
+
+    hp_shared_packet_t *shared = shared_packet_create_large(message_type, message, length);
+    if (shared == NULL)
+    {
+        HLOG_ERROR("Error, Failed to allocate a message of %u bytes\n", length);
+        return -1;
+    }
+    // Not shared with anyone yet, so it may still be stamped
+    endpoint_stamp(endpoint, &shared->packet.header);
+    int result = endpoint_queue_shared(endpoint, shared);
+    shared_packet_release(shared);
+    return result;
+}
+
+/* Queue a large header for bulk and the body behind it, which counts towards the watermarks. */
+static int endpoint_queue_bulk(endpoint_t *endpoint, uint8_t message_type, hp_bulk_t *bulk)
+{
+    if (endpoint_check_send_room(endpoint, HP_LARGE_HEADER_SIZE) != 0)
+        return -1;
+    hp_shared_packet_t *shared = shared_packet_alloc(HP_LARGE_HEADER_SIZE);
+    if (shared == NULL)
+        return -1;
+    hp_large_header *header = (hp_large_header *)shared->packet.raw;
+    memset(header->raw, 0, sizeof(*header));
+    header->header.version = HP_PACKET_VERSION_LARGE;
+    header->header.message_type = message_type;
+    header->message_length = bulk->length;
+    endpoint_stamp(endpoint, &header->header);
+
+    int result;
+    if (bulk->length == 0)
+        result = packet_queue_push_shared(&endpoint->send_queue, shared);
+    else
+        result = packet_queue_push_bulk(&endpoint->send_queue, shared, bulk);
+    shared_packet_release(shared);
+    if (result != 0)
+        return -1;
+    // Nothing to keep for an empty body
+    if (bulk->length == 0)
+    {
+        bulk->sent = true;
+        bulk_release(bulk);
+    }
+    return endpoint_update_events(endpoint);
+}
+
+/* Queue a large frame whose body of length bytes is sent straight from data, with MSG_ZEROCOPY
+   where the kernel supports it. data must stay untouched until callback reports status 0, or a
+   negative status when the connection went away first. When it went while io_uring was still
+   sending the body, callback comes once the kernel let go of it, with peer NULL. Fails without
+   calling callback. */
+int endpoint_send_buffer(endpoint_t *endpoint, uint8_t message_type, const void *data, uint32_t length, bulk_complete_callback_t callback, void *user_data)
+{
+    hp_bulk_t *bulk = bulk_create(endpoint, length, callback, user_data);
+    if (bulk == NULL)
+        return -1;
+    bulk->data = data;
+    if (endpoint_queue_bulk(endpoint, message_type, bulk) != 0)
+    {
+        free(bulk);
+        return -1;
+    }
+    return 0;
+}
+
+/* Queue a large frame whose body is length bytes of the file fd from offset, sent with sendfile()
+   by the readiness backends and mapped for the others. fd must stay open until callback. */
+int endpoint_send_file(endpoint_t *endpoint, uint8_t message_type, int fd, off_t offset, uint32_t length, bulk_complete_callback_t callback, void *user_data)
+{
+    hp_bulk_t *bulk = bulk_create(endpoint, length, callback, user_data);
+    if (bulk == NULL)
+        return -1;
+    bulk->fd = fd;
+    bulk->file_offset = offset;
+    if (endpoint_queue_bulk(endpoint, message_type, bulk) != 0)
+    {
+        free(bulk);
+        return -1;
+    }
+    return 0;
+}
+
+static bool endpoint_is_topic_message(uint8_t message_type)
+{
+    return message_type == HP_MSG_SUBSCRIBE || message_type == HP_MSG_UNSUBSCRIBE || message_type == HP_MSG_PUBLISH;
+}
+
+/* Whether frames of message_type go to the shared memory handshake, the RPC layer or topic_callback
+   instead of the packet callbacks. */
+static bool endpoint_intercepts(endpoint_t *endpoint, uint8_t message_type)
+{
+    if (message_type == HP_MSG_SHM)
+        return true;
+    if (endpoint_is_topic_message(message_type))
+        return endpoint->topic_callback != NULL;
+    return endpoint_rpc_takes(endpoint, message_type);
+}
+
+static void endpoint_intercept(endpoint_t *endpoint, hp_packet_header *header, uint8_t *message, uint32_t length)
+{
+    if (header->message_type == HP_MSG_SHM)
+        hshm_dispatch(endpoint, message, length);
+    else if (endpoint_is_topic_message(header->message_type))
+        endpoint->topic_callback(endpoint, header, message, length);
+    else
+        endpoint_rpc_dispatch(endpoint, header->message_type, message, length);
+}
+
+/* Hand a complete large message to whichever callback wants it. */
+static void endpoint_deliver_message(endpoint_t *endpoint, hp_packet_header *header, uint8_t *message, uint32_t length)
 {
-    packet->header.message_size = snprintf((char *)packet->message, HP_MESSAGE_MAX_SIZE, "%s", data);
-    return 0;
+    HLOG_VERBOSE("Info, Received large message of %u bytes from %s\n", length, get_endpoint_address_str(endpoint));
+    if (endpoint_intercepts(endpoint, header->message_type))
+        endpoint_intercept(endpoint, header, message, length);
+    else if (endpoint->message_chunk_callback)
+        endpoint->message_chunk_callback(endpoint, header, 0, message, length, length);
+    else if (endpoint->message_received_callback)
+        endpoint->message_received_callback(endpoint, header, message, length);
 }
 
-int print_packet(hp_packet_t *packet)
+/* Sample the round trip of a measured reply, once its whole frame arrived. */
+static void endpoint_record_rtt(endpoint_t *endpoint, const hp_packet_header *header, uint32_t *now_us)
 {
-    printf("Message: \"%s\"\n", packet->message);
-    return 0;
+    if (endpoint->rtt == NULL || header->message_type != HP_MSG_REPLY || header->stamp == 0)
+        return;
+    // One clock read covers every reply parsed from the same read
+    if (*now_us == 0)
+        *now_us = hhist_now_us();
+    hhist_record(endpoint->rtt, *now_us - header->stamp);
+    if (endpoint->rtt_total != NULL)
+        hhist_shared_record(endpoint->rtt_total, *now_us - header->stamp);
 }
 
-int create_packet_queue(packet_queue_t *queue, int queue_size)
+/* Account count more bytes of the large message in progress, delivering it once complete. */
+static void endpoint_large_advance(endpoint_t *endpoint, uint32_t count)
+{
+    endpoint->rx_large_received += count;
+    if (endpoint->rx_large_received < endpoint->rx_large_header.message_length)
+        return;
+    endpoint->rx_large_active = false;
+    uint32_t now_us = 0;
+    endpoint_record_rtt(endpoint, &endpoint->rx_large_header.header, &now_us);
+    if (endpoint->rx_large_buffer != NULL)
+    {
+        hp_packet_header *header = &endpoint->rx_large_header.header;
+        if (endpoint->rx_large_intercepted)
+            endpoint_intercept(endpoint, header, endpoint->rx_large_buffer, endpoint->rx_large_header.message_length);
+        else
+            endpoint->message_received_callback(endpoint, header, endpoint->rx_large_buffer, endpoint->rx_large_header.message_length);
+        free(endpoint->rx_large_buffer);
+        endpoint->rx_large_buffer = NULL;
+    }
+}
+
+/* Feed bytes into the large message in progress, returns how many belonged to it. */
+static size_t endpoint_large_consume(endpoint_t *endpoint, uint8_t *data, size_t length)
 {
-    queue->data = calloc(queue_size, sizeof(hp_packet_t));
-    queue->size = queue_size;
-    queue->index = 0;
+    uint32_t remaining = endpoint->rx_large_header.message_length - endpoint->rx_large_received;
+    uint32_t count = length < remaining ? length : remaining;
+    if (endpoint->message_chunk_callback && !endpoint->rx_large_intercepted)
+        endpoint->message_chunk_callback(endpoint, &endpoint->rx_large_header.header, endpoint->rx_large_received,
+            data, count, endpoint->rx_large_header.message_length);
+    else if (endpoint->rx_large_buffer != NULL)
+        memcpy(endpoint->rx_large_buffer + endpoint->rx_large_received, data, count);
+    endpoint_large_advance(endpoint, count);
+    return count;
+}
 
+/* A large header arrived without its whole message, buffer or stream the rest as it comes. */
+static int endpoint_large_begin(endpoint_t *endpoint, hp_large_header *header)
+{
+    endpoint->rx_large_header = *header;
+    endpoint->rx_large_received = 0;
+    endpoint->rx_large_active = true;
+    // Requests, responses and topic frames are always assembled, whatever the callbacks
+    endpoint->rx_large_intercepted = endpoint_intercepts(endpoint, header->header.message_type);
+    if (endpoint->rx_large_intercepted || (endpoint->message_chunk_callback == NULL && endpoint->message_received_callback != NULL))
+    {
+        endpoint->rx_large_buffer = malloc(header->message_length);
+        if (endpoint->rx_large_buffer == NULL)
+        {
+            HLOG_ERROR("Error, out of memory for a message of %u bytes from %s\n", header->message_length, get_endpoint_address_str(endpoint));
+            endpoint->receive_error = HP_ENORES;
+            return -HP_ENORES;
+        }
+    }
     return 0;
 }
 
-void delete_packet_queue(packet_queue_t *queue)
+/* Hand the complete frame at data, which lies in buffer, to packet_view_callback. */
+static void endpoint_deliver_view(endpoint_t *endpoint, hp_shared_packet_t *buffer, hp_packet_header *header, uint8_t *data, uint32_t length)
 {
-    free(queue->data);
-    queue->data = NULL;
+    hp_packet_view_t view;
+    view.buffer = buffer;
+    view.data = data;
+    view.length = length;
+    view.header = *header;
+    endpoint->packet_view_callback(endpoint, &view);
 }
 
-int enqueue(packet_queue_t *queue, hp_packet_t *packet)
+/* Restore the message of a compressed packet and hand the packet on like any other, a view gets a
+   buffer of its own. */
+static int endpoint_deliver_compressed(endpoint_t *endpoint, hp_packet_header *header, uint8_t flags, const uint8_t *message)
 {
-    if (queue->index == queue->size)
-        return -1;
+    const hlz_dict_t *dict = (flags & HP_VERSION_DICTIONARY) ? endpoint->compress_dict : NULL;
+    uint16_t original_size = 0;
+    if (header->message_size >= sizeof(original_size))
+        memcpy(&original_size, message, sizeof(original_size));
+    if (header->message_size < sizeof(original_size) || original_size > HP_MESSAGE_MAX_SIZE ||
+        ((flags & HP_VERSION_DICTIONARY) && dict == NULL))
+    {
+        HLOG_ERROR("Error, Received a compressed packet from %s that can't be restored\n", get_endpoint_address_str(endpoint));
+        endpoint->receive_error = HP_EINVAL;
+        return -HP_EINVAL;
+    }
 
-    memcpy(&queue->data[queue->index], packet, sizeof(hp_packet_t));
-    queue->index++;
+    hp_packet_t aligned_packet;
+    hp_packet_t *packet = &aligned_packet;
+    hp_shared_packet_t *shared = NULL;
+    if (endpoint->packet_view_callback && !endpoint_intercepts(endpoint, header->message_type))
+    {
+        if ((shared = shared_packet_alloc(HP_PACKET_HEADER_SIZE + original_size)) == NULL)
+        {
+            endpoint->receive_error = HP_ENORES;
+            return -HP_ENORES;
+        }
+        packet = &shared->packet;
+    }
+    int length = hlz_decompress(dict, message + sizeof(original_size), header->message_size - sizeof(original_size), packet->message, original_size);
+    if (length != original_size)
+    {
+        HLOG_ERROR("Error, Received a corrupt compressed packet from %s\n", get_endpoint_address_str(endpoint));
+        shared_packet_release(shared);
+        endpoint->receive_error = HP_EINVAL;
+        return -HP_EINVAL;
+    }
+    packet->header = *header;
+    packet->header.message_size = original_size;
 
+    if (endpoint_intercepts(endpoint, header->message_type))
+        endpoint_intercept(endpoint, header, packet->message, original_size);
+    else if (shared != NULL)
+    {
+        endpoint_deliver_view(endpoint, shared, &packet->header, packet->raw, HP_PACKET_HEADER_SIZE + original_size);
+        shared_packet_release(shared);
+    }
+    else if (endpoint->packet_received_callback)
+    {
+        endpoint->packet_received_callback(endpoint, packet);
+    }
     return 0;
 }
 
-int dequeue(packet_queue_t *queue, hp_packet_t *packet)
+/* Hand every complete packet in data to the callbacks, returns the bytes consumed or a negative error. */
+static int endpoint_dispatch_packets(endpoint_t *endpoint, uint8_t *data, size_t length)
 {
-    if (queue->index == 0)
-        return -1;
+    hp_packet_t aligned_packet;
+    uint32_t now_us = 0;
+    size_t offset = 0;
+    while (offset < length)
+    {
+        if (endpoint->rx_large_active)
+        {
+            offset += endpoint_large_consume(endpoint, data + offset, length - offset);
+            continue;
+        }
+        if (length - offset < HP_PACKET_HEADER_SIZE)
+            break;
+
+        hp_packet_header header;
+        memcpy(&header, data + offset, sizeof(header));
+        uint8_t flags = header.version & ~HP_PACKET_VERSION_MASK;
+        header.version &= HP_PACKET_VERSION_MASK;
+        if (header.version == HP_PACKET_VERSION_LARGE)
+        {
+            if (length - offset < HP_LARGE_HEADER_SIZE)
+                break;
+            hp_large_header large;
+            memcpy(&large, data + offset, sizeof(large));
+            uint32_t max_length = endpoint->max_message_length ? endpoint->max_message_length : HP_LARGE_MESSAGE_MAX_SIZE;
+            if (large.message_length > max_length)
+            {
+                HLOG_ERROR("Error, Received a large header with invalid message length of %u bytes from %s \n",
+                    large.message_length,
+                    get_endpoint_address_str(endpoint));
+                endpoint->receive_error = HP_EMSGSIZE;
+                return -HP_EMSGSIZE;
+            }
+            ENDPOINT_COUNT(endpoint, frames_received, 1);
+            offset += HP_LARGE_HEADER_SIZE;
+            // Already complete in the buffer, no copy needed
+            if (length - offset >= large.message_length)
+            {
+                endpoint_record_rtt(endpoint, &header, &now_us);
+                if (endpoint->packet_view_callback && !endpoint_intercepts(endpoint, header.message_type))
+                    endpoint_deliver_view(endpoint, endpoint->rx_block, &large.header, data + offset - HP_LARGE_HEADER_SIZE, HP_LARGE_HEADER_SIZE + large.message_length);
+                else
+                    endpoint_deliver_message(endpoint, &large.header, data + offset, large.message_length);
+                offset += large.message_length;
+                continue;
+            }
+            int result = endpoint_large_begin(endpoint, &large);
+            if (result < 0)
+                return result;
+            continue;
+        }
 
-    memcpy(packet, &queue->data[queue->index - 1], sizeof(hp_packet_t));
-    queue->index--;
+        if (header.message_size > HP_MESSAGE_MAX_SIZE)
+        {
+            HLOG_ERROR("Error, Received a header with invalid message size of %d bytes from %s \n",
+                header.message_size,
+                get_endpoint_address_str(endpoint));
+            endpoint->receive_error = HP_EMSGSIZE;
+            return -HP_EMSGSIZE;
+        }
+        size_t frame_length = HP_PACKET_HEADER_SIZE + header.message_size;
+        if (length - offset < frame_length)
+            break;
+        ENDPOINT_COUNT(endpoint, frames_received, 1);
+        endpoint_record_rtt(endpoint, &header, &now_us);
+        if (flags != 0)
+        {
+            endpoint->peer_accepts |= flags & (HP_VERSION_ACCEPTS_COMPRESSED | HP_VERSION_ACCEPTS_DICTIONARY);
+            // Handed on without the flags, they only concern this connection
+            data[offset] = header.version;
+            if (flags & HP_VERSION_COMPRESSED)
+            {
+                int result = endpoint_deliver_compressed(endpoint, &header, flags, data + offset + HP_PACKET_HEADER_SIZE);
+                if (result < 0)
+                    return result;
+                offset += frame_length;
+                continue;
+            }
+        }
+        if (endpoint_intercepts(endpoint, header.message_type))
+        {
+            endpoint_intercept(endpoint, &header, data + offset + HP_PACKET_HEADER_SIZE, header.message_size);
+            offset += frame_length;
+            continue;
+        }
+        if (endpoint->packet_view_callback)
+        {
+            endpoint_deliver_view(endpoint, endpoint->rx_block, &header, data + offset, frame_length);
+            offset += frame_length;
+            continue;
+        }
 
-    return 0;
+        // Packets are handed out in place, only a misaligned one is copied first
+        hp_packet_t *packet = (hp_packet_t *)(data + offset);
+        if (((uintptr_t)packet & (__alignof__(hp_packet_t) - 1)) != 0)
+        {
+            memcpy(aligned_packet.raw, data + offset, frame_length);
+            packet = &aligned_packet;
+        }
+        HLOG_VERBOSE("Info, Received message of %d bytes from %s\n", header.message_size, get_endpoint_address_str(endpoint));
+        if (endpoint->packet_received_callback)
+            endpoint->packet_received_callback(endpoint, packet);
+        offset += frame_length;
+    }
+    return offset;
 }
 
-int dequeue_all(packet_queue_t *queue)
+static int endpoint_alloc_rx_buffer(endpoint_t *endpoint)
 {
-    queue->index = 0;
+    if (endpoint->rx_block != NULL)
+        return 0;
+    endpoint->rx_block = shared_packet_alloc(HP_RECEIVE_BUFFER_SIZE);
+    if (endpoint->rx_block == NULL)
+    {
+        HLOG_ERROR("Error, out of memory for the receive buffer of %s\n", get_endpoint_address_str(endpoint));
+        return -HP_ENORES;
+    }
+    endpoint->rx_buffer = endpoint->rx_block->packet.raw;
+    endpoint->rx_start = 0;
+    endpoint->rx_end = 0;
     return 0;
 }
 
-int delete_endpoint(endpoint_t *endpoint)
+/* Views retained the receive buffer, so the bytes before rx_end must stay. Move the unparsed rest
+   to a buffer of its own, the old one is freed with the last view. */
+static int endpoint_detach_rx_buffer(endpoint_t *endpoint)
 {
-    close(endpoint->socket);
-    endpoint->socket = NO_SOCKET;
-    delete_packet_queue(&endpoint->send_queue);
-    return 0;
+    hp_shared_packet_t *retained = endpoint->rx_block;
+    uint8_t *rest = endpoint->rx_buffer + endpoint->rx_start;
+    uint32_t rest_length = endpoint->rx_end - endpoint->rx_start;
+    endpoint->rx_block = NULL;
+    int result = endpoint_alloc_rx_buffer(endpoint);
+    if (result == 0)
+    {
+        memcpy(endpoint->rx_buffer, rest, rest_length);
+        endpoint->rx_end = rest_length;
+    }
+    shared_packet_release(retained);
+    return result;
 }
 
-int create_endpoint(endpoint_t *endpoint)
+/* Parse the buffered bytes, then keep the partial packet left over where it is unless the room
+   behind it got too small for a whole packet. */
+static int endpoint_dispatch_buffered(endpoint_t *endpoint)
 {
-    create_packet_queue(&endpoint->send_queue, PACKET_QUEUE_SIZE);
-
-    endpoint->send_packet_index = -1;
-    endpoint->receive_packet_index = 0;
-
+    int consumed = endpoint_dispatch_packets(endpoint, endpoint->rx_buffer + endpoint->rx_start, endpoint->rx_end - endpoint->rx_start);
+    if (consumed < 0)
+        return consumed;
+    endpoint->rx_start += consumed;
+    // Appending behind rx_end is fine, rewinding or compacting a retained buffer is not
+    bool rewind = endpoint->rx_start == endpoint->rx_end || HP_RECEIVE_BUFFER_SIZE - endpoint->rx_end < HP_MAX_PACKET_SIZE;
+    if (rewind && __atomic_load_n(&endpoint->rx_block->refcount, __ATOMIC_ACQUIRE) > 1)
+        return endpoint_detach_rx_buffer(endpoint);
+    if (endpoint->rx_start == endpoint->rx_end)
+    {
+        endpoint->rx_start = 0;
+        endpoint->rx_end = 0;
+    }
+    else if (HP_RECEIVE_BUFFER_SIZE - endpoint->rx_end < HP_MAX_PACKET_SIZE)
+    {
+        endpoint->rx_end -= endpoint->rx_start;
+        memmove(endpoint->rx_buffer, endpoint->rx_buffer + endpoint->rx_start, endpoint->rx_end);
+        endpoint->rx_start = 0;
+    }
     return 0;
 }
 
-char *get_endpoint_address_str(endpoint_t *endpoint)
+/* Give the receive buffer back to the pool once nothing waits in it, or leave it to the views. */
+static void endpoint_release_rx_buffer(endpoint_t *endpoint)
 {
-    static char ret[INET_ADDRSTRLEN + 10];
-    char endpoint_ipv4_str[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &endpoint->address.sin_addr, endpoint_ipv4_str, INET_ADDRSTRLEN);
-    sprintf(ret, "%s:%d", endpoint_ipv4_str, endpoint->address.sin_port);
-    return ret;
+    if (endpoint->rx_block == NULL || endpoint->rx_start != endpoint->rx_end)
+        return;
+    shared_packet_release(endpoint->rx_block);
+    endpoint->rx_block = NULL;
+    endpoint->rx_buffer = NULL;
+    endpoint->rx_start = 0;
+    endpoint->rx_end = 0;
 }
 
-char* get_address_str(struct sockaddr_in* addr)
+/* Bytes received by other means, e.g. by a completion backend straight into data. Complete packets
+   are parsed from there, only what doesn't finish a packet is copied into the receive buffer.
+   Views need a buffer they can retain, so with packet_view_callback everything is copied. */
+int endpoint_receive_bytes(endpoint_t *endpoint, uint8_t *data, size_t length)
 {
-    static char ret[INET_ADDRSTRLEN + 10];
-    char endpoint_ipv4_str[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &addr->sin_addr, endpoint_ipv4_str, INET_ADDRSTRLEN);
-    sprintf(ret, "%s:%d", endpoint_ipv4_str, addr->sin_port);
-    return ret;
+    int result;
+    if (endpoint->rx_start == endpoint->rx_end && endpoint->packet_view_callback == NULL)
+    {
+        if ((result = endpoint_dispatch_packets(endpoint, data, length)) < 0)
+            return result;
+        data += result;
+        length -= result;
+    }
+    while (length > 0)
+    {
+        if ((result = endpoint_alloc_rx_buffer(endpoint)) < 0)
+            return result;
+        size_t room = HP_RECEIVE_BUFFER_SIZE - endpoint->rx_end;
+        size_t count = length < room ? length : room;
+        memcpy(endpoint->rx_buffer + endpoint->rx_end, data, count);
+        endpoint->rx_end += count;
+        data += count;
+        length -= count;
+        if ((result = endpoint_dispatch_buffered(endpoint)) < 0)
+            return result;
+    }
+    endpoint_release_rx_buffer(endpoint);
+    return 0;
 }
 
-int endpoint_queue_send(endpoint_t *endpoint, hp_packet_t *packet)
+/* recv() from the socket, or from the ring once the peer switched to shared memory. */
+static ssize_t endpoint_recv(endpoint_t *endpoint, void *buffer, size_t length)
 {
-    return enqueue(&endpoint->send_queue, packet);
+    ENDPOINT_COUNT(endpoint, recv_calls, 1);
+    if (endpoint->shm != NULL && (endpoint->shm->state == HSHM_SWITCHING || endpoint->shm->state == HSHM_ACTIVE))
+        return hshm_recv(endpoint, buffer, length);
+    // An offer brings its descriptors along
+    if (endpoint->shared_memory && endpoint->shm == NULL && endpoint->address.sin_family == AF_UNIX)
+        return hshm_recvmsg(endpoint, buffer, length);
+    return recv(endpoint->socket, buffer, length, MSG_DONTWAIT);
 }
 
-int receive_bytes_from_endpoint(endpoint_t *endpoint)
+/* Receive whatever the socket holds with as few recv() calls as the buffer allows and hand every
+   complete packet to packet_received_callback. Returns the bytes received or a negative error. */
+int receive_from_endpoint(endpoint_t *endpoint)
 {
-    // printf("Info, Ready to receive %d bytes from %s.\n", sizeof(endpoint->received_packet.header), get_endpoint_address_str(endpoint));
+    int result;
+    if (endpoint->shm != NULL && (result = hshm_poll(endpoint)) < 0)
+        return result;
+    if ((result = endpoint_alloc_rx_buffer(endpoint)) < 0)
+        return result;
 
-    ssize_t received_count = 0;
     size_t received_total = 0;
-    do
+    // A throttled endpoint stops as soon as its replies pile up, the rest waits in the socket
+    while (!endpoint_reads_paused(endpoint))
     {
-        // If the header was completely received move onto receiving the actual message payload 
-        if (endpoint->receive_packet_index == endpoint->bytes_expected_to_receive)
-        {
-            return endpoint->bytes_expected_to_receive;
-        }
-
-        // Count bytes left to receive
-        size_t left_to_receive = endpoint->bytes_expected_to_receive - endpoint->receive_packet_index;
-        if (left_to_receive > HP_MAX_PACKET_SIZE - endpoint->receive_packet_index)
+        // The rest of a large message being assembled is received straight into its own buffer
+        bool direct = endpoint->rx_large_buffer != NULL && endpoint->rx_start == endpoint->rx_end;
+        uint8_t *target = endpoint->rx_buffer + endpoint->rx_end;
+        size_t room = HP_RECEIVE_BUFFER_SIZE - endpoint->rx_end;
+        if (direct)
         {
-#ifdef HCOMM_DEBUG_ERROR
-            printf("Error, bytes left to receive %d > %d room left in the packet length truncating message to fit\n",
-                left_to_receive, HP_MAX_PACKET_SIZE - endpoint->receive_packet_index);
-#endif
-            left_to_receive = HP_MAX_PACKET_SIZE - endpoint->receive_packet_index;
+            target = endpoint->rx_large_buffer + endpoint->rx_large_received;
+            room = endpoint->rx_large_header.message_length - endpoint->rx_large_received;
         }
-#ifdef HCOM_DEBUG_VERBOSE
-        printf("Info, Let's try to receive %zd bytes...\n", left_to_receive);
-#endif        
-        received_count = recv(endpoint->socket, (char *)endpoint->received_packet_address + endpoint->receive_packet_index, left_to_receive, MSG_DONTWAIT);
+        ssize_t received_count = endpoint_recv(endpoint, target, room);
         if (received_count < 0)
         {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
             {
-#ifdef HCOM_DEBUG_VERBOSE
-                printf("Info, endpoint is not ready, try again later.\n");
-#endif
-                return 0;
-            }
-            else
-            {
-#ifdef HCOMM_DEBUG_ERROR
-                printf("Error, recv from endpoint error: %d\n", errno);
-#endif
-                return HP_SOCKET_READ_ERROR;
+                ENDPOINT_COUNT(endpoint, recv_eagain, 1);
+                HLOG_VERBOSE("Info, endpoint is not ready, try again later.\n");
+                break;
             }
+            HLOG_ERROR("Error, recv from endpoint error: %d\n", errno);
+            endpoint->receive_error = HP_SOCKET_READ_ERROR;
+            return HP_SOCKET_READ_ERROR;
         }
         else if (received_count == 0)
         {
-#ifdef HCOM_DEBUG_VERBOSE
-            printf("Info, recv 0 bytes. Peer gracefully shutdown.\n");
-#endif
+            HLOG_VERBOSE("Info, recv 0 bytes. Peer gracefully shutdown.\n");
+            endpoint->receive_error = HP_SOCKET_ZERO_READ;
             return HP_SOCKET_ZERO_READ;
         }
+
+        received_total += received_count;
+        ENDPOINT_COUNT(endpoint, bytes_received, received_count);
+        uint64_t started_ns = hmetrics_now_ns();
+        if (direct)
+        {
+            endpoint_large_advance(endpoint, received_count);
+        }
         else
         {
-            endpoint->receive_packet_index += received_count;
-            received_total += received_count;
-#ifdef HCOM_DEBUG_VERBOSE
-            printf("Info, recv %zd bytes\n", received_count);
-#endif
+            endpoint->rx_end += received_count;
+            if ((result = endpoint_dispatch_buffered(endpoint)) < 0)
+                return result;
         }
-    } while (received_count > 0);
-#ifdef HCOM_DEBUG_VERBOSE
-    printf("Info, Total recv %zu bytes.\n", received_total);
-#endif
+        ENDPOINT_COUNT(endpoint, dispatch_ns, hmetrics_now_ns() - started_ns);
+        // A short read drained the socket, edge-triggered backends report the next arrival again
+        if ((size_t)received_count < room)
+            break;
+    }
+    HLOG_VERBOSE("Info, Total recv %zu bytes.\n", received_total);
+    endpoint_release_rx_buffer(endpoint);
     return received_total;
 }
 
-/* Receive packet from endpoint and handle it with packet_handler(). */
-int receive_from_endpoint(endpoint_t *endpoint)
-{    
-    int received_total = 0;
-    switch(endpoint->receiving_state)
-    {
-        case RECEIVING_NONE:
-            endpoint->receiving_state = RECEIVING_HEADER;
-            endpoint->bytes_expected_to_receive = sizeof(endpoint->received_packet.header);
-            endpoint->receive_packet_index = 0;
-            endpoint->received_packet_address = endpoint->received_packet.raw;
-            endpoint->receive_error = HP_ENOERR;
-#ifdef HCOM_DEBUG_VERBOSE
-            printf("Info, Ready to receive header from %s \n", get_endpoint_address_str(endpoint));
+/* Pop the head entry once every byte of it went out. */
+static void endpoint_pop_sent(endpoint_t *endpoint)
+{
+    packet_queue_entry_t *entry = packet_queue_entry(&endpoint->send_queue, 0);
+    // A bulk body finishes the frame its header started
+    if (entry->offset == PACKET_QUEUE_BULK)
+        entry->bulk->sent = true;
+    else
+        ENDPOINT_COUNT(endpoint, frames_sent, 1);
+    packet_queue_pop(&endpoint->send_queue);
+    // The last packet queued before the shared memory answer left, the ring takes the rest
+    if (endpoint->shm != NULL && endpoint->shm->state == HSHM_SWITCHING && --endpoint->shm->socket_backlog == 0)
+        hshm_switch(endpoint);
+}
+
+#ifdef HCOMM_HAVE_ZEROCOPY
+/* Whether sending length bytes of a bulk body should pin its pages, enabling that on first use. */
+static bool endpoint_zerocopy_wanted(endpoint_t *endpoint, size_t length)
+{
+    if (endpoint->zerocopy < 0 || length < HP_ZEROCOPY_MIN_SIZE)
+        return false;
+    if (endpoint->zerocopy == 0)
+    {
+        int one = 1;
+        endpoint->zerocopy = setsockopt(endpoint->socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0 ? 1 : -1;
+    }
+    return endpoint->zerocopy > 0;
+}
+
+/* Drain the completion records of zero-copy sends from the socket error queue and finish the bulks
+   they cover. Each record holds a range of send numbers, TCP reports them in order. */
+static void endpoint_read_zerocopy(endpoint_t *endpoint)
+{
+    char control[128];
+    struct msghdr msg;
+    for (;;)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(endpoint->socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+                continue;
+            struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            if ((int32_t)(err->ee_data + 1 - endpoint->zerocopy_done) > 0)
+                endpoint->zerocopy_done = err->ee_data + 1;
+            // The kernel copied after all, e.g. over loopback, so pinning pages only costs
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                endpoint->zerocopy = -1;
+        }
+    }
+    endpoint_finish_zerocopy(endpoint, false, 0);
+}
 #endif
-            // Note: Intentional fallthrough
-        case RECEIVING_HEADER:
-            received_total = receive_bytes_from_endpoint(endpoint);
-            if (received_total < 0)
-            {
-                endpoint->receiving_state = RECEIVING_DONE;
-                endpoint->receive_error = received_total;            
-            }
-            else if (received_total == sizeof(endpoint->received_packet.header))
-            {
-                if (endpoint->received_packet.header.message_size > HP_MAX_PACKET_SIZE - sizeof(endpoint->received_packet.header))
-                {
-#ifdef HCOMM_DEBUG_ERROR
-                    printf("Error, Received a header with invalid message size of %d bytes from %s \n", 
-                        endpoint->received_packet.header.message_size, 
-                        get_endpoint_address_str(endpoint));
+
+/* An error event is also how the kernel reports zero-copy completions, it only ends the connection
+   when the socket has an error pending. */
+static bool endpoint_socket_failed(endpoint_t *endpoint)
+{
+#ifdef HCOMM_HAVE_ZEROCOPY
+    if (endpoint->zerocopy != 0)
+    {
+        endpoint_read_zerocopy(endpoint);
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(endpoint->socket, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0)
+            return false;
+    }
 #endif
+    return true;
+}
 
-                    endpoint->receive_error = HP_EMSGSIZE;
-                    endpoint->receiving_state = RECEIVING_DONE;
-                }
-                else
-                {
-                    endpoint->receiving_state = RECEIVING_MESSAGE;
-                    endpoint->bytes_expected_to_receive = endpoint->received_packet.header.message_size;
-                    endpoint->received_packet_address += sizeof(endpoint->received_packet.header);
-                    endpoint->receive_packet_index = 0;
-#ifdef HCOM_DEBUG_VERBOSE
-                    printf("Info, Received header from %s next, receiving message of %d bytes\n", 
-                        get_endpoint_address_str(endpoint), 
-                        endpoint->bytes_expected_to_receive);
+/* Submit the unsent part of the current batch as one linked chain, starting at packet first. */
+static int endpoint_submit_send_chain(endpoint_t *endpoint, int first)
+{
+    int count = endpoint->send_batch_count;
+    for (int i = first; i < count; ++i)
+    {
+        uint8_t *data = packet_queue_data(&endpoint->send_queue, i);
+        size_t offset = endpoint->send_batch_sent[i];
+        if (uring_prep_send(endpoint->loop, endpoint->socket, data + offset, packet_queue_length(&endpoint->send_queue, i) - offset, i, i + 1 < count) != 0)
+        {
+            HLOG_ERROR("Error, io_uring send submission failed\n");
+            return HP_SOCKET_WRITE_ERROR;
+        }
+        ENDPOINT_COUNT(endpoint, send_calls, 1);
+        endpoint->send_batch_pending++;
+    }
+    endpoint->send_batch_broken = false;
+    return 0;
+}
+
+/* Completion backends: send up to HURING_SEND_BATCH packets from the queue head as a linked chain.
+   The packets stay in their queue slots until the kernel reports them sent. */
+static int send_batch_to_endpoint(endpoint_t *endpoint)
+{
+    // The chain in flight completes first, its last completion asks for the next one
+    if (endpoint->send_batch_pending > 0)
+        return 0;
+
+    int count = 0;
+    size_t queued_total = 0;
+    while (count < HURING_SEND_BATCH && (uint32_t)count < packet_queue_count(&endpoint->send_queue))
+    {
+        // File bodies go out of a mapping like any other memory
+        packet_queue_entry_t *entry = packet_queue_entry(&endpoint->send_queue, count);
+        if (entry->offset == PACKET_QUEUE_BULK && entry->bulk->data == NULL && bulk_map(entry->bulk) != 0)
+            return HP_SOCKET_WRITE_ERROR;
+        endpoint->send_batch_sent[count] = 0;
+        queued_total += packet_queue_length(&endpoint->send_queue, count);
+        count++;
+    }
+    endpoint->send_batch_count = count;
+    if (count > 0 && endpoint_submit_send_chain(endpoint, 0) != 0)
+        return HP_SOCKET_WRITE_ERROR;
+    HLOG_VERBOSE("Info, Submitted %d packets, %zu bytes.\n", count, queued_total);
+    endpoint_update_events(endpoint);
+    return queued_total;
+}
+
+/* One send of the linked chain completed. */
+static int endpoint_send_completed(endpoint_t *endpoint, int index, int result)
+{
+    if (endpoint->send_batch_pending == 0 || index >= endpoint->send_batch_count)
+        return 0;
+    endpoint->send_batch_pending--;
+
+    if (result == -ECANCELED)
+    {
+        // An earlier short send broke the chain
+        endpoint->send_batch_broken = true;
+    }
+    else if (result < 0)
+    {
+        HLOG_ERROR("Error, send to endpoint error: %d\n", -result);
+        return HP_SOCKET_WRITE_ERROR;
+    }
+    else
+    {
+        ENDPOINT_COUNT(endpoint, bytes_sent, result);
+        endpoint->send_batch_sent[index] += result;
+        if (endpoint->send_batch_sent[index] < packet_queue_length(&endpoint->send_queue, index))
+        {
+            ENDPOINT_COUNT(endpoint, partial_sends, 1);
+            endpoint->send_batch_broken = true;
+        }
+    }
+
+    if (endpoint->send_batch_pending > 0)
+        return 0;
+
+    if (endpoint->send_batch_broken)
+    {
+        for (int i = 0; i < endpoint->send_batch_count; ++i)
+        {
+            if (endpoint->send_batch_sent[i] < packet_queue_length(&endpoint->send_queue, i))
+                return endpoint_submit_send_chain(endpoint, i);
+        }
+    }
+    for (int i = 0; i < endpoint->send_batch_count; ++i)
+        endpoint_pop_sent(endpoint);
+    endpoint->send_batch_count = 0;
+    return send_batch_to_endpoint(endpoint);
+}
+
+/* Service one event reported by the loop for this endpoint, negative means the connection is gone. */
+int endpoint_handle_event(endpoint_t *endpoint, hevent_t *ev)
+{
+    int result;
+    if ((ev->events & HEVENT_ERROR) && endpoint_socket_failed(endpoint))
+    {
+        HLOG_ERROR("Error, error event for %s.\n", get_endpoint_address_str(endpoint));
+        return HP_SOCKET_READ_ERROR;
+    }
+
+#ifdef HCOMM_HAVE_ZEROCOPY
+    // select() reports completions as readability
+    if (endpoint->zerocopy_pending != NULL)
+        endpoint_read_zerocopy(endpoint);
 #endif
-                }
-            }
-            break;
-        case RECEIVING_MESSAGE:
-            received_total = receive_bytes_from_endpoint(endpoint);
-            if (received_total < 0)
+
+    if (ev->events & HEVENT_SENT)
+    {
+        if ((result = endpoint_send_completed(endpoint, ev->index, ev->result)) < 0)
+            return result;
+    }
+
+    if (ev->events & HEVENT_READ)
+    {
+        if (endpoint_uses_uring(endpoint))
+        {
+            if (ev->buffer != NULL && ev->result > 0)
             {
-                endpoint->receiving_state = RECEIVING_DONE;
-                endpoint->receive_error = received_total;            
+                ENDPOINT_COUNT(endpoint, recv_calls, 1);
+                ENDPOINT_COUNT(endpoint, bytes_received, ev->result);
+                uint64_t started_ns = hmetrics_now_ns();
+                if ((result = endpoint_receive_bytes(endpoint, ev->buffer, ev->result)) < 0)
+                    return result;
+                ENDPOINT_COUNT(endpoint, dispatch_ns, hmetrics_now_ns() - started_ns);
             }
-            else if (received_total == endpoint->bytes_expected_to_receive)
-            {
-                endpoint->receiving_state = RECEIVING_DONE;                
-                endpoint->receive_error = HP_ENOERR;
-#ifdef HCOM_DEBUG_VERBOSE
-                printf("Info, Received message of %d bytes from %s\n",                         
-                        endpoint->bytes_expected_to_receive,
-                        get_endpoint_address_str(endpoint));
-#endif
-                endpoint->packet_received_callback(endpoint, &endpoint->received_packet);
+            if (ev->events & HEVENT_HANGUP)
+                return HP_SOCKET_ZERO_READ;
+        }
+        else if ((result = receive_from_endpoint(endpoint)) < 0)
+        {
+            return result;
+        }
+    }
 
-            }
+    if (ev->events & HEVENT_WRITE)
+    {
+        if ((result = send_to_endpoint(endpoint)) < 0)
+            return result;
+    }
+    return 0;
+}
+
+/* Limit the bytes and packets one sendmsg() gathers, zero selects the HP_SEND_* defaults. */
+void endpoint_set_send_budget(endpoint_t *endpoint, int max_iov, size_t max_bytes)
+{
+    endpoint->send_iov_budget = (max_iov <= 0 || max_iov > HP_SEND_IOV_MAX) ? HP_SEND_IOV_MAX : max_iov;
+    endpoint->send_byte_budget = max_bytes ? max_bytes : HP_SEND_BYTES_MAX;
+}
+
+/* Fill iov with queued packets starting at the unsent part of the head packet. */
+static int endpoint_gather_send(endpoint_t *endpoint, struct iovec *iov, size_t *total)
+{
+    int max_iov = endpoint->send_iov_budget ? endpoint->send_iov_budget : HP_SEND_IOV_MAX;
+    size_t max_bytes = endpoint->send_byte_budget ? endpoint->send_byte_budget : HP_SEND_BYTES_MAX;
+    uint32_t count = packet_queue_count(&endpoint->send_queue);
+    size_t offset = endpoint->send_packet_index;
+    int iov_count = 0;
+    // Nothing queued after the shared memory answer goes through the socket
+    if (endpoint->shm != NULL && endpoint->shm->state == HSHM_SWITCHING && count > endpoint->shm->socket_backlog)
+        count = endpoint->shm->socket_backlog;
+
+    *total = 0;
+    for (uint32_t i = 0; i < count && iov_count < max_iov; ++i)
+    {
+        // Bulk bodies are sent on their own
+        if (packet_queue_entry(&endpoint->send_queue, i)->offset == PACKET_QUEUE_BULK)
             break;
-        case RECEIVING_DONE:
-            endpoint->receiving_state = RECEIVING_NONE;
+        size_t length = packet_queue_length(&endpoint->send_queue, i) - offset;
+        // The first packet always goes, the rest only while they fit the byte budget
+        if (iov_count > 0 && *total + length > max_bytes)
             break;
+        iov[iov_count].iov_base = packet_queue_data(&endpoint->send_queue, i) + offset;
+        iov[iov_count].iov_len = length;
+        *total += length;
+        iov_count++;
+        offset = 0;
     }
-    return received_total;
+    return iov_count;
 }
 
-int send_to_endpoint(endpoint_t *endpoint)
+/* Pop the packets covered by sent bytes, a partially sent one stays at the head. */
+static void endpoint_send_advance(endpoint_t *endpoint, size_t sent)
+{
+    while (sent > 0 && packet_queue_count(&endpoint->send_queue) > 0)
+    {
+        size_t remaining = packet_queue_length(&endpoint->send_queue, 0) - endpoint->send_packet_index;
+        if (sent < remaining)
+        {
+            endpoint->send_packet_index += sent;
+            return;
+        }
+        sent -= remaining;
+        endpoint->send_packet_index = 0;
+        endpoint_pop_sent(endpoint);
+    }
+}
+
+static bool endpoint_sends_to_ring(endpoint_t *endpoint)
 {
-#ifdef HCOM_DEBUG_VERBOSE
-    printf("Info, Sending to %s\n", get_endpoint_address_str(endpoint));
+    return endpoint->shm != NULL && endpoint->shm->state == HSHM_ACTIVE;
+}
+
+/* Send the unsent rest of the bulk body at the queue head, from memory with MSG_ZEROCOPY when
+   that pays off or from its file with sendfile(). Into shared memory it is copied from a mapping.
+   Returns like sendmsg(). */
+static ssize_t endpoint_send_bulk(endpoint_t *endpoint, size_t *bytes_to_send)
+{
+    hp_bulk_t *bulk = packet_queue_entry(&endpoint->send_queue, 0)->bulk;
+    size_t offset = endpoint->send_packet_index;
+    *bytes_to_send = bulk->length - offset;
+    if (bulk->data == NULL)
+    {
+#ifdef __linux__
+        if (!endpoint_sends_to_ring(endpoint))
+        {
+            off_t file_offset = bulk->file_offset + offset;
+            return sendfile(endpoint->socket, bulk->fd, &file_offset, *bytes_to_send);
+        }
+#endif
+        if (bulk_map(bulk) != 0)
+            return -1;
+    }
+
+    struct iovec iov;
+    iov.iov_base = (void *)(bulk->data + offset);
+    iov.iov_len = *bytes_to_send;
+    if (endpoint_sends_to_ring(endpoint))
+        return hshm_send(endpoint, &iov, 1);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+#ifdef HCOMM_HAVE_ZEROCOPY
+    if (endpoint_zerocopy_wanted(endpoint, *bytes_to_send))
+    {
+        ssize_t sent_count = sendmsg(endpoint->socket, &msg, MSG_NOSIGNAL | MSG_ZEROCOPY);
+        if (sent_count > 0)
+        {
+            bulk->zerocopy_used = true;
+            bulk->zerocopy_seq = endpoint->zerocopy_next++;
+            return sent_count;
+        }
+        // Out of option memory for the completion records, this part is copied
+        if (sent_count == 0 || errno != ENOBUFS)
+            return sent_count;
+    }
 #endif
+    return sendmsg(endpoint->socket, &msg, MSG_NOSIGNAL);
+}
+
+int send_to_endpoint(endpoint_t *endpoint)
+{
+    if (endpoint_uses_uring(endpoint))
+        return send_batch_to_endpoint(endpoint);
+    // Held until the peer answered the shared memory offer
+    if (endpoint->shm != NULL && endpoint->shm->state == HSHM_OFFERED)
+        return 0;
+
+    HLOG_VERBOSE("Info, Sending to %s\n", get_endpoint_address_str(endpoint));
 
+    struct iovec iov[HP_SEND_IOV_MAX];
     size_t bytes_to_send = 0;
     ssize_t sent_count = 0;
     size_t sent_total = 0;
     do
     {
-        // If the index packet was completely sent and there are packets in queue, send them
-        if (endpoint->send_packet_index < 0 || endpoint->send_packet_index == sizeof(endpoint->send_packet.header) + endpoint->send_packet.header.message_size )
+        if (packet_queue_count(&endpoint->send_queue) == 0)
         {
-#ifdef HCOM_DEBUG_VERBOSE
-            printf("Info, There are no pending packets to send, maybe we can find one in the queue... \n");
-#endif
-            if (dequeue(&endpoint->send_queue, &endpoint->send_packet) != 0)
-            {
-                endpoint->send_packet_index = -1;
-#ifdef HCOM_DEBUG_VERBOSE
-                printf("Info, There is nothing to send anymore.\n");
-#endif
-                break;
-            }
-#ifdef HCOM_DEBUG_VERBOSE
-            printf("Info, popped a packet from the queue and we'll send it.\n");
-#endif
-            endpoint->send_packet_index = 0;
+            HLOG_VERBOSE("Info, There is nothing to send anymore.\n");
+            break;
         }
 
-        // Count bytes to send.
-        bytes_to_send = sizeof(endpoint->send_packet.header) + endpoint->send_packet.header.message_size - endpoint->send_packet_index;
-        if (bytes_to_send > HP_MAX_PACKET_SIZE)
+        if (packet_queue_entry(&endpoint->send_queue, 0)->offset == PACKET_QUEUE_BULK)
         {
-#ifdef HCOMM_DEBUG_ERROR
-            printf("Error, bytes to send %d > max packet length %d, truncating message,\n", bytes_to_send, HP_MAX_PACKET_SIZE);
-#endif
-            bytes_to_send = HP_MAX_PACKET_SIZE;
+            sent_count = endpoint_send_bulk(endpoint, &bytes_to_send);
         }
-#ifdef HCOM_DEBUG_VERBOSE
-        printf("Info, Let's try to send %zd bytes...\n", bytes_to_send);
-#endif
-        sent_count = send(endpoint->socket, (char *)&endpoint->send_packet + endpoint->send_packet_index, bytes_to_send, 0);
+        else
+        {
+            // Gather as many queued packets as the budget allows into one sendmsg()
+            int iov_count = endpoint_gather_send(endpoint, iov, &bytes_to_send);
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iov_count;
+            // Corked while more follows, the kernel sends full segments only
+            int flags = MSG_NOSIGNAL;
+            if (endpoint->profile == HP_PROFILE_THROUGHPUT && (uint32_t)iov_count < packet_queue_count(&endpoint->send_queue))
+                flags |= MSG_MORE;
+            HLOG_VERBOSE("Info, Let's try to send %zd bytes in %d packets...\n", bytes_to_send, iov_count);
+            if (endpoint_sends_to_ring(endpoint))
+                sent_count = hshm_send(endpoint, iov, iov_count);
+            else
+                sent_count = sendmsg(endpoint->socket, &msg, flags);
+        }
+        ENDPOINT_COUNT(endpoint, send_calls, 1);
         if (sent_count < 0)
         {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
             {
-#ifdef HCOM_DEBUG_VERBOSE
-                printf("Info, the endpoint is not ready, try again later.\n");
-#endif
-                return 0;
+                ENDPOINT_COUNT(endpoint, send_eagain, 1);
+                HLOG_VERBOSE("Info, the endpoint is not ready, try again later.\n");
+                break;
             }
             else
             {
-#ifdef HCOMM_DEBUG_ERROR
-                printf("Error, send to endpoint error: %d\n", errno);
-#endif
+                HLOG_ERROR("Error, send to endpoint error: %d\n", errno);
                 return HP_SOCKET_WRITE_ERROR;
             }
         }
         // We have sent as many as possible
         else if (sent_count == 0)
         {
-#ifdef HCOM_DEBUG_VERBOSE
-            printf("Info, sent 0 bytes. Endpoint can't accept data right now. Try again later.\n");
-#endif
+            HLOG_VERBOSE("Info, sent 0 bytes. Endpoint can't accept data right now. Try again later.\n");
             break;
         }
         else
         {
-            endpoint->send_packet_index += sent_count;
+            endpoint_send_advance(endpoint, sent_count);
             sent_total += sent_count;
-#ifdef HCOM_DEBUG_VERBOSE
-            printf("Info, sent %zd bytes.\n", sent_count);
-#endif
+            ENDPOINT_COUNT(endpoint, bytes_sent, sent_count);
+            HLOG_VERBOSE("Info, sent %zd bytes.\n", sent_count);
+            // A short write means the socket buffer is full, the next write event resumes
+            if ((size_t)sent_count < bytes_to_send)
+            {
+                ENDPOINT_COUNT(endpoint, partial_sends, 1);
+                break;
+            }
         }
     } while (sent_count > 0);
-#ifdef HCOM_DEBUG_VERBOSE
-    printf("Info, Total sent %zu bytes.\n", sent_total);
-#endif
+    HLOG_VERBOSE("Info, Total sent %zu bytes.\n", sent_total);
+    endpoint_update_events(endpoint);
     return sent_total;
 }
 
@@ -9,9 +9,8 @@
 #include <string.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <pthread.h>
 
-// #define HCOM_DEBUG_VERBOSE
-#define HCOMM_DEBUG_ERROR
 //#define HCOMM_DEBUG_INFO
 
 typedef enum
@@ -37,13 +36,42 @@ typedef enum
 #define HP_PACKET_HEADER_SIZE        ( 8 )                                        /*!< Size of a packet header.   */
 #define HP_PACKET_PAYLOAD_OFF        ( HP_PACKET_HEADER_SIZE )                    /*!< Offset of payload within the packat. */
 #define HP_MESSAGE_MAX_SIZE          ( HP_MAX_PACKET_SIZE -  HP_PACKET_HEADER_SIZE)   /*!< Maximum size of a packet.  */
+#define HP_PACKET_VERSION_LARGE      ( 2 )                                        /*!< Header version of a frame with a 32 bit message length. */
+#define HP_PACKET_VERSION_MASK       ( 0x0f )                                     /*!< Frame format part of the version, the rest are flags. */
+#define HP_VERSION_COMPRESSED        ( 0x80 )                                     /*!< The message is LZ compressed behind its 16 bit original size. */
+#define HP_VERSION_DICTIONARY        ( 0x40 )                                     /*!< Compressed against the shared dictionary. */
+#define HP_VERSION_ACCEPTS_COMPRESSED ( 0x20 )                                    /*!< The sender takes compressed packets. */
+#define HP_VERSION_ACCEPTS_DICTIONARY ( 0x10 )                                    /*!< The sender holds the shared dictionary too. */
+#define HP_LARGE_HEADER_SIZE         ( HP_PACKET_HEADER_SIZE + 4 )                /*!< Header followed by the 32 bit message length. */
+#define HP_LARGE_MESSAGE_MAX_SIZE    ( 64 * 1024 * 1024 )                         /*!< Default limit of a received large message. */
 
-#define PACKET_QUEUE_SIZE           (100)
+#define PACKET_QUEUE_SIZE           (64)     /*!< Initial send queue slots per endpoint, power of two, doubled as needed. */
+#define HP_SEND_HIGH_WATERMARK      (65536)  /*!< Default queued bytes above which an endpoint turns unwritable. */
+#define HP_SEND_LOW_WATERMARK       (16384)  /*!< Default queued bytes at which it turns writable again. */
+#define HP_SEND_QUEUE_LIMIT         (4 * 1024 * 1024)   /*!< Default queued bytes beyond which sends are refused. */
+#define HP_COMPRESS_THRESHOLD       (64)     /*!< Default message size from which on packets are compressed. */
+#define HP_ZEROCOPY_MIN_SIZE        (16384)  /*!< Smaller sends of a bulk body copy, pinning pages costs more. */
+#define HP_COALESCE_BYTES           (65536)  /*!< Default queued bytes that flush a coalescing endpoint. */
+#define HP_COALESCE_US              (1000)   /*!< Default age of the oldest held packet that flushes it. */
+#define HP_BUSY_POLL_US             (50)     /*!< SO_BUSY_POLL of the low latency profile. */
+#define HP_NOTSENT_LOWAT            (16384)  /*!< TCP_NOTSENT_LOWAT of the low latency profile. */
+#define HP_THROUGHPUT_BUFFER_SIZE   (1024 * 1024)   /*!< SO_SNDBUF and SO_RCVBUF of the throughput profile. */
+#define HP_SEND_IOV_MAX             (64)     /*!< Most packets gathered into one sendmsg(). */
+#define HP_SEND_BYTES_MAX           (65536)  /*!< Default byte budget of one sendmsg(). */
+#define HP_RECEIVE_BUFFER_SIZE      (16384)  /*!< Per endpoint receive buffer, one recv() fills it at most. */
+#define HP_RPC_HEADER_SIZE          (4)      /*!< Request id in front of the message of a HP_MSG_REQUEST or HP_MSG_RESPONSE. */
+#define HP_RPC_TABLE_SIZE           (64)     /*!< Initial in-flight request slots per endpoint, power of two, doubled as needed. */
 
 typedef enum
 {
     HP_MSG_CMD = 0,
-    HP_MSG_REPLY = 1
+    HP_MSG_REPLY = 1,
+    HP_MSG_REQUEST = 2,                 /*!< The message starts with a request id, see endpoint_rpc_call(). */
+    HP_MSG_RESPONSE = 3,                /*!< The message starts with the id of the request it answers. */
+    HP_MSG_SUBSCRIBE = 4,               /*!< The message is a topic pattern, see htopic_subscribe(). */
+    HP_MSG_UNSUBSCRIBE = 5,
+    HP_MSG_PUBLISH = 6,                 /*!< The message is a topic length byte, the topic and the payload. */
+    HP_MSG_SHM = 7                      /*!< Shared memory handshake on unix sockets, see endpoint_offer_shm(). */
 } hp_message_type;
 
 typedef union
@@ -53,11 +81,22 @@ typedef union
 		uint8_t version;
 		uint8_t message_type; // hp_message_type
 		uint16_t message_size;
-		uint32_t stamp;
+		uint32_t stamp; // Microsecond send time of a measured CMD, echoed unchanged by its HP_MSG_REPLY
 	};
     uint8_t raw[HP_PACKET_HEADER_SIZE];
 } hp_packet_header;
 
+/* Header of a HP_PACKET_VERSION_LARGE frame, message_size is unused and the message follows it. */
+typedef union
+{
+	struct
+	{
+		hp_packet_header header;
+		uint32_t message_length;
+	};
+	uint8_t raw[HP_LARGE_HEADER_SIZE];
+} hp_large_header;
+
 typedef union
 {
 	uint8_t raw[HP_MAX_PACKET_SIZE];
@@ -68,87 +107,749 @@ typedef union
 	};
 } hp_packet_t;
 
+// logging -----------------------------------------------------------------------
+
+#define HLOG_RING_SIZE              (65536)   /*!< Bytes of records each logging thread buffers, power of two. */
+#define HLOG_MAX_ARGS               (8)       /*!< Arguments kept of a record, the rest of its line is cut. */
+#define HLOG_STRING_MAX             (128)     /*!< Longest string argument kept, including its terminator. */
+#define HLOG_FLUSH_MS               (10)      /*!< How often the background thread prints what was logged. */
+
+typedef enum
+{
+    HLOG_LEVEL_ERROR = 0,
+    HLOG_LEVEL_INFO,
+    HLOG_LEVEL_VERBOSE
+} hlog_level_t;
+
+/* Levels above this are compiled out, e.g. -DHLOG_MAX_LEVEL=HLOG_LEVEL_ERROR for production. */
+#ifndef HLOG_MAX_LEVEL
+#define HLOG_MAX_LEVEL              HLOG_LEVEL_VERBOSE
+#endif
+
+/* Level printed at runtime, HLOG_LEVEL_INFO unless set with hlog_set_level(). */
+extern hlog_level_t hlog_level;
+
+/* Log a printf() style line. Only the arguments are stored, a background thread formats and prints
+   it later, so the format must be a string literal. */
+#define HLOG(level, ...) \
+    do { \
+        if ((int)(level) <= (int)HLOG_MAX_LEVEL && (int)(level) <= (int)__atomic_load_n(&hlog_level, __ATOMIC_RELAXED)) \
+            hlog_write((level), __VA_ARGS__); \
+    } while (0)
+#define HLOG_ERROR(...)             HLOG(HLOG_LEVEL_ERROR, __VA_ARGS__)
+#define HLOG_INFO(...)              HLOG(HLOG_LEVEL_INFO, __VA_ARGS__)
+#define HLOG_VERBOSE(...)           HLOG(HLOG_LEVEL_VERBOSE, __VA_ARGS__)
+
+void hlog_write(hlog_level_t level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void hlog_set_level(hlog_level_t level);
+hlog_level_t hlog_level_from_str(const char *name);
+void hlog_flush(void);
+
+// buffer pool ---------------------------------------------------------------
+
+#define HP_POOL_CLASS_COUNT         (4)                  /*!< 64 B, 256 B, 1 KB and 16 KB blocks. */
+#define HP_POOL_HEADROOM            (8)                  /*!< Extra bytes per block so a full packet and its shared header fit 1 KB. */
+#define HP_POOL_CACHE_BYTES         (1024 * 1024)        /*!< Idle bytes one class keeps cached per thread. */
+#define HP_POOL_ARENA_SIZE          (2 * 1024 * 1024)    /*!< Huge page arena the blocks are carved from. */
+
+void *hp_pool_alloc(size_t size);
+void hp_pool_free(void *buffer, size_t size);
+size_t hp_pool_size(size_t size);
+int hp_pool_use_hugepages(bool enable);
+void hp_pool_stats(uint32_t *in_use, uint32_t *cached);
+void hp_pool_drain(void);
+
 // packet queue --------------------------------------------------------------
 
+/* Encoded once and queued by reference on any number of endpoints, freed with the last reference. */
 typedef struct
 {
-  int size;
-  hp_packet_t *data;
-  int index;
+  uint32_t refcount;
+  uint32_t capacity;                  /*!< Bytes of packet actually allocated, from the pool. */
+  hp_packet_t packet;
+} hp_shared_packet_t;
+
+hp_shared_packet_t *shared_packet_create(const hp_packet_t *packet);
+hp_shared_packet_t *shared_packet_create_large(uint8_t message_type, const void *message, uint32_t length);
+void shared_packet_retain(hp_shared_packet_t *shared);
+void shared_packet_release(hp_shared_packet_t *shared);
+
+/* Read-only view of a received frame inside the receive buffer, handed to packet_view_callback.
+   Valid during the callback only, unless packet_view_retain() keeps the buffer alive. */
+typedef struct
+{
+  hp_shared_packet_t *buffer;         /*!< Receive buffer holding the frame. */
+  const uint8_t *data;                /*!< Whole frame, header included, not necessarily aligned. */
+  uint32_t length;                    /*!< Frame bytes. */
+  hp_packet_header header;            /*!< Aligned copy of the frame header. */
+} hp_packet_view_t;
+
+void packet_view_retain(hp_packet_view_t *view);
+void packet_view_release(hp_packet_view_t *view);
+
+struct hp_bulk_t;
+
+#define PACKET_QUEUE_BULK           (0xffffffffu)   /*!< Entry offset marking a bulk body. */
+
+/* One queued frame, a whole shared packet or a frame borrowed from a receive buffer, or the body
+   of a frame sent from user memory or a file behind its separately queued header. */
+typedef struct
+{
+  union
+  {
+    hp_shared_packet_t *shared;       /*!< Holds a reference for the entry. */
+    struct hp_bulk_t *bulk;           /*!< Owned by the entry while offset is PACKET_QUEUE_BULK. */
+  };
+  uint32_t offset;                    /*!< Frame start within shared->packet.raw. */
+  uint32_t length;                    /*!< Frame bytes. */
+} packet_queue_entry_t;
+
+typedef struct
+{
+  packet_queue_entry_t *slots;        /*!< Ring of queued frames, borrowed from the pool while not empty. */
+  hp_shared_packet_t *reserved;       /*!< Packet built in place until it is committed. */
+  uint32_t size;                      /*!< Power of two. */
+  uint32_t head;                      /*!< Next packet to send, free running. */
+  uint32_t tail;                      /*!< Next free slot, free running. */
+  size_t bytes;                       /*!< Frame bytes of the queued packets. */
+  size_t bulk_bytes;                  /*!< Part of bytes in bodies borrowed from the caller. */
 } packet_queue_t;
 
+// timers ------------------------------------------------------------------------
+
+#define HTIMER_LEVEL_BITS           (6)
+#define HTIMER_SLOTS                (1 << HTIMER_LEVEL_BITS)   /*!< Slots per wheel level. */
+#define HTIMER_LEVELS               (4)       /*!< 1 ms ticks, so the wheels span about 4.6 hours before a timer re-cascades. */
+
+struct htimer_t;
+typedef int (*htimer_callback_t)(struct htimer_t *timer);
+
+typedef struct htimer_t
+{
+  struct htimer_t *next;
+  struct htimer_t **pprev;            /*!< Link pointing at this timer, NULL while not armed. */
+  uint64_t expires;                   /*!< Due time in wheel milliseconds. */
+  uint32_t period_ms;                 /*!< Rearmed this long after its due time when not 0. */
+  htimer_callback_t callback;
+  void *data;                         /*!< Owner context, untouched by the wheel. */
+} htimer_t;
+
+typedef struct
+{
+  uint64_t now;                       /*!< Last millisecond processed. */
+  uint32_t count;                     /*!< Timers armed. */
+  uint64_t occupied[HTIMER_LEVELS];   /*!< Bit per non empty slot, finds the next expiry without scanning. */
+  htimer_t *slots[HTIMER_LEVELS][HTIMER_SLOTS];
+} htimer_wheel_t;
+
+uint64_t htimer_now_ms(void);
+void htimer_wheel_init(htimer_wheel_t *wheel, uint64_t now_ms);
+void htimer_init(htimer_t *timer, htimer_callback_t callback, void *data);
+int htimer_add(htimer_wheel_t *wheel, htimer_t *timer, uint32_t delay_ms, uint32_t period_ms);
+int htimer_rearm(htimer_wheel_t *wheel, htimer_t *timer, uint32_t delay_ms);
+void htimer_cancel(htimer_wheel_t *wheel, htimer_t *timer);
+bool htimer_active(const htimer_t *timer);
+int htimer_next_timeout(const htimer_wheel_t *wheel);
+int htimer_advance(htimer_wheel_t *wheel, uint64_t now_ms);
+
+// latency histogram -------------------------------------------------------------
+
+#define HHIST_SUB_BUCKET_BITS       (6)
+#define HHIST_SUB_BUCKETS           (1 << HHIST_SUB_BUCKET_BITS)   /*!< Exact buckets below this value, 3% wide ones above. */
+#define HHIST_BUCKET_COUNT          (HHIST_SUB_BUCKETS + (32 - HHIST_SUB_BUCKET_BITS) * HHIST_SUB_BUCKETS / 2)
+
+/* Fixed size log-linear histogram of 32 bit values, microseconds for round trip times. */
+typedef struct
+{
+  uint64_t count;
+  uint64_t sum;
+  uint32_t min;
+  uint32_t max;
+  uint32_t counts[HHIST_BUCKET_COUNT];
+} hhist_t;
+
+typedef struct
+{
+  uint64_t count;
+  uint32_t min;
+  uint32_t mean;
+  uint32_t p50;
+  uint32_t p90;
+  uint32_t p99;
+  uint32_t p999;
+  uint32_t max;
+} hhist_summary_t;
+
+/* Histogram one thread records into while others copy it out with hhist_snapshot(). */
+typedef struct
+{
+  uint32_t sequence;                  /*!< Odd while a value is being recorded. */
+  hhist_t hist;
+} hhist_shared_t;
+
+uint32_t hhist_now_us(void);
+void hhist_reset(hhist_t *hist);
+void hhist_record(hhist_t *hist, uint32_t value);
+void hhist_merge(hhist_t *dst, const hhist_t *src);
+uint32_t hhist_percentile(const hhist_t *hist, double percentile);
+void hhist_summarize(const hhist_t *hist, hhist_summary_t *summary);
+void hhist_shared_record(hhist_shared_t *shared, uint32_t value);
+void hhist_snapshot(const hhist_shared_t *shared, hhist_t *copy);
+
+// LZ codec -----------------------------------------------------------------------
+
+#define HLZ_HASH_BITS               (10)
+#define HLZ_DICT_MAX_SIZE           (32768)  /*!< Longest dictionary, the input may fill the rest of the 64 KB window. */
+
+/* Bytes both peers prime the codec with, e.g. the recurring parts of their messages. */
+typedef struct
+{
+    const uint8_t *data;
+    uint32_t length;
+    uint16_t table[1 << HLZ_HASH_BITS]; /*!< Last position of every hashed 4 byte sequence. */
+} hlz_dict_t;
+
+int hlz_dict_init(hlz_dict_t *dict, const uint8_t *data, uint32_t length);
+int hlz_compress(const hlz_dict_t *dict, const uint8_t *src, uint32_t length, uint8_t *dst, uint32_t capacity);
+int hlz_decompress(const hlz_dict_t *dict, const uint8_t *src, uint32_t length, uint8_t *dst, uint32_t capacity);
+
+// event loop ---------------------------------------------------------------------
+
 typedef enum
 {
-  RECEIVING_NONE = 0,
-  RECEIVING_HEADER = 1,
-  RECEIVING_MESSAGE,  
-  RECEIVING_DONE
-} receiving_state;
+  HEVENT_BACKEND_DEFAULT = 0,         /*!< epoll on Linux, select() elsewhere. */
+  HEVENT_BACKEND_SELECT,              /*!< Portable select() fallback, limited to FD_SETSIZE descriptors. */
+  HEVENT_BACKEND_EPOLL,               /*!< Edge-triggered epoll. */
+  HEVENT_BACKEND_URING                /*!< io_uring completions with batched submissions, Linux 6.0+. */
+} hevent_backend_t;
+
+#define HEVENT_READ                 (0x01)
+#define HEVENT_WRITE                (0x02)
+#define HEVENT_ERROR                (0x04)
+#define HEVENT_ACCEPT               (0x08)    /*!< Interest: listening socket. Event: io_uring accepted the connection in result, or failed with -errno. */
+#define HEVENT_HANGUP               (0x10)    /*!< Event: peer closed the stream (io_uring only). */
+#define HEVENT_SENT                 (0x20)    /*!< Event: io_uring send number index completed with result. */
+#define HEVENT_POLL                 (0x40)    /*!< Interest: readiness only, the owner reads the descriptor itself. */
+#define HEVENT_REGISTERED           (0x80)    /*!< Internal, marks a descriptor known to the select() backend. */
+
+#define HEVENT_MAX_EVENTS           (64)      /*!< Maximum events returned by one event_loop_wait(). */
+
+#define HURING_SQ_ENTRIES           (256)     /*!< io_uring submission queue depth. */
+#define HURING_CQ_ENTRIES           (1024)    /*!< io_uring completion queue depth. */
+#define HURING_BUFFER_COUNT         (128)     /*!< Provided receive buffers, power of two. */
+#define HURING_BUFFER_SIZE          (2048)    /*!< Size of one provided receive buffer. */
+#define HURING_SEND_BATCH           (16)      /*!< Packets per linked send chain. */
+
+typedef struct
+{
+  int fd;                             /*!< Not filled by the epoll backend. */
+  uint32_t events;
+  void *data;
+  // Completion backends only
+  uint8_t *buffer;                    /*!< Received bytes for HEVENT_READ. */
+  int32_t result;                     /*!< Byte count, accepted fd or send result. */
+  uint16_t index;                     /*!< Send index within the chain for HEVENT_SENT. */
+} hevent_t;
+
+struct huring_t;
+
+typedef struct
+{
+  hevent_backend_t backend;
+  int epoll_fd;
+  struct huring_t *uring;
+  // event_loop_wake() makes the descriptor readable, an eventfd or a pipe
+  int wake_fd;
+  int wake_write_fd;
+  // select() backend interest set, indexed by fd
+  void **select_data;
+  uint8_t *select_events;
+  int select_max_fd;
+  htimer_wheel_t timers;              /*!< Run by event_loop_wait(), which sleeps no longer than the next one is due. */
+  hevent_t events[HEVENT_MAX_EVENTS];
+} hevent_loop_t;
+
+int event_loop_init(hevent_loop_t *loop, hevent_backend_t backend);
+void event_loop_close(hevent_loop_t *loop);
+int event_loop_add(hevent_loop_t *loop, int fd, uint32_t events, void *data);
+int event_loop_modify(hevent_loop_t *loop, int fd, uint32_t events, void *data);
+int event_loop_remove(hevent_loop_t *loop, int fd);
+int event_loop_wait(hevent_loop_t *loop, int timeout_ms);
+int event_loop_wake(hevent_loop_t *loop);
+hevent_backend_t event_backend_from_str(const char *name);
+
+int uring_init(hevent_loop_t *loop);
+void uring_close(hevent_loop_t *loop);
+int uring_set(hevent_loop_t *loop, int fd, uint32_t events, void *data);
+int uring_remove(hevent_loop_t *loop, int fd);
+int uring_wait(hevent_loop_t *loop, int timeout_ms);
+int uring_prep_send(hevent_loop_t *loop, int fd, const void *buffer, size_t length, int index, bool link);
+int uring_release_after_sends(hevent_loop_t *loop, int fd, void (*release)(void *arg), void *arg);
+
+// cross thread submission --------------------------------------------------------
+
+/* Intrusive multi-producer single-consumer queue, pushing is one atomic exchange. */
+typedef struct hmpsc_node_t
+{
+  struct hmpsc_node_t *next;
+} hmpsc_node_t;
+
+typedef struct
+{
+  hmpsc_node_t *head;                 /*!< Last pushed, producers only. */
+  hmpsc_node_t *tail;                 /*!< Next to pop, consumer only. */
+  hmpsc_node_t stub;
+} hmpsc_queue_t;
+
+void hmpsc_init(hmpsc_queue_t *queue);
+void hmpsc_push(hmpsc_queue_t *queue, hmpsc_node_t *node);
+hmpsc_node_t *hmpsc_pop(hmpsc_queue_t *queue);
+
+// metrics ------------------------------------------------------------------------
+
+#define HMETRICS_BUFFER_SIZE        (16384)   /*!< Initial text buffer of the metrics listener, doubled as needed. */
+#define HMETRICS_TIMEOUT_MS         (1000)    /*!< Longest a scraper may take to send its request or read the answer. */
+
+/* Traffic counters of an endpoint, and summed over its clients of a server. Only the thread running
+   the endpoint writes them, with relaxed stores other threads may read them at any time. */
+typedef struct
+{
+  uint64_t bytes_received;
+  uint64_t bytes_sent;
+  uint64_t frames_received;
+  uint64_t frames_sent;
+  uint64_t recv_calls;                /*!< recv() calls and reads of a shared memory ring. */
+  uint64_t send_calls;                /*!< sendmsg(), sendfile() and io_uring sends, writes of a ring. */
+  uint64_t recv_eagain;               /*!< Receives that found nothing. */
+  uint64_t send_eagain;               /*!< Sends that found no room. */
+  uint64_t partial_sends;             /*!< Sends that took less than they were offered. */
+  uint64_t send_drops;                /*!< Sends refused at the send queue limit. */
+  uint64_t dispatch_ns;               /*!< Spent parsing received frames and in the callbacks they went to. */
+  uint64_t queued_bytes;              /*!< Gauge, bytes waiting in the send queue. */
+  uint64_t queued_high;               /*!< Gauge, most bytes that ever waited there at once. */
+} hp_stats_t;
+
+/* Why a server closed a client connection. */
+typedef enum
+{
+  HP_DISCONNECT_PEER_CLOSED = 0,      /*!< The client shut the connection down. */
+  HP_DISCONNECT_READ_ERROR,
+  HP_DISCONNECT_WRITE_ERROR,
+  HP_DISCONNECT_PROTOCOL_ERROR,       /*!< The client sent a frame that can't be taken. */
+  HP_DISCONNECT_IDLE,                 /*!< Silent for longer than idle_timeout_ms. */
+  HP_DISCONNECT_CLOSED,               /*!< server_close_client_connection() by the application. */
+  HP_DISCONNECT_SHUTDOWN,             /*!< The server shut down. */
+  HP_DISCONNECT_REASON_COUNT
+} hp_disconnect_reason_t;
+
+/* Counters of a server or one of its shards, uint64_t only so snapshots can copy them word by word. */
+typedef struct
+{
+  hp_stats_t traffic;                 /*!< Of every client, closed ones included. */
+  uint64_t accepts;
+  uint64_t rejects;                   /*!< Accepted connections turned away, e.g. at max_clients. */
+  uint64_t connections;               /*!< Gauge, clients connected. */
+  uint64_t disconnects[HP_DISCONNECT_REASON_COUNT];
+} hserver_stats_t;
+
+/* Counter updates by the only thread writing them, a plain add that never tears for readers. */
+#define HP_STAT_ADD(stats, field, n)    __atomic_store_n(&(stats)->field, (stats)->field + (n), __ATOMIC_RELAXED)
+#define HP_STAT_SET(stats, field, n)    __atomic_store_n(&(stats)->field, (n), __ATOMIC_RELAXED)
+
+uint64_t hmetrics_now_ns(void);
 
 // endpoint -----------------------------------------------------------------------
 struct endpoint_t;
 typedef struct endpoint_t endpoint_t;
+typedef uint64_t conn_id_t;                   /*!< Shard in the top 8, generation in the next 24, table slot in the lower 32 bits. */
+#define CONN_ID_NONE                (0)
+/* How the socket of an endpoint is tuned, see endpoint_set_profile(). */
+typedef enum
+{
+  HP_PROFILE_DEFAULT = 0,             /*!< Nagle's algorithm with quick acks. */
+  HP_PROFILE_LOW_LATENCY,             /*!< Every packet leaves at once, little is left unsent in the kernel. */
+  HP_PROFILE_THROUGHPUT               /*!< Large buffers, packets held back and sent in full segments. */
+} hp_socket_profile_t;
+
 typedef int (*packet_received_callback_t)(endpoint_t* peer, hp_packet_t *);
+typedef int (*endpoint_callback_t)(endpoint_t* peer);
+typedef int (*packet_view_callback_t)(endpoint_t* peer, hp_packet_view_t *view);
+typedef int (*bulk_complete_callback_t)(endpoint_t* peer, void *user_data, int status);
+typedef int (*message_received_callback_t)(endpoint_t* peer, hp_packet_header *header, uint8_t *message, uint32_t length);
+typedef int (*message_chunk_callback_t)(endpoint_t* peer, hp_packet_header *header, uint32_t offset, uint8_t *chunk, uint32_t chunk_length, uint32_t length);
+
+/* A received request, answered with endpoint_rpc_respond() from the callback or, copied, any time later. */
+typedef struct
+{
+  endpoint_t *endpoint;
+  uint32_t session;                   /*!< Connection of the endpoint the request came in on. */
+  uint32_t id;
+} hp_rpc_request_t;
+
+typedef int (*rpc_request_callback_t)(endpoint_t* peer, hp_rpc_request_t *request, uint8_t *message, uint32_t length);
+typedef int (*rpc_response_callback_t)(endpoint_t* peer, void *user_data, int status, uint8_t *message, uint32_t length);
 
 struct endpoint_t
 {
   int socket;
+  // Connection table bookkeeping
+  conn_id_t id;
+  uint32_t generation;
+  uint32_t table_slot;
+  int32_t live_index;
   struct sockaddr_in address;
-  // Packets waiting to be sent
+  char address_str[INET_ADDRSTRLEN + 10];  /*!< Formatted by get_endpoint_address_str() once, for logging. */
+  // Packets waiting to be sent, oldest first.
+  // In case we doesn't send whole packet per one call send() send_packet_index is the part
+  // of the head packet that was already sent.
   packet_queue_t send_queue;
-  // Buffered sending packet. In case we doesn't send whole packet per one call send().
-  // And sending_index is a pointer to the part of data that will be send next call.
-  hp_packet_t send_packet;
   int send_packet_index;
-  // The same for the receiving packet.
-  hp_packet_t received_packet;
-  uint8_t* received_packet_address;
-  int receive_packet_index;
+  // Budget of one vectored send, zero means the HP_SEND_* defaults.
+  int send_iov_budget;
+  size_t send_byte_budget;
+  // The throughput profile coalesces: queued packets are held until coalesce_bytes are queued or
+  // the oldest waited coalesce_us, then everything is flushed. Zero means the HP_COALESCE_* defaults.
+  hp_socket_profile_t profile;
+  uint32_t coalesce_bytes;
+  uint32_t coalesce_us;
+  bool coalesce_flush;                /*!< Flushing until the queue drained. */
+  htimer_t coalesce_timer;
+  // Backpressure: once more than send_high_watermark bytes are queued the endpoint is unwritable
+  // until they drained to send_low_watermark, the callbacks tell the producers when to pause and
+  // resume. With throttle_reads nothing is read from the peer meanwhile either. Sends beyond
+  // send_queue_limit are refused. Zero means the HP_SEND_* defaults.
+  size_t send_high_watermark;
+  size_t send_low_watermark;
+  size_t send_queue_limit;
+  bool throttle_reads;
+  bool unwritable;
+  endpoint_callback_t writable_callback;
+  endpoint_callback_t unwritable_callback;
+  // Received bytes not parsed yet are rx_buffer[rx_start..rx_end), a partial packet waits there
+  // for the rest. The buffer is borrowed from the pool only while it holds something, and is
+  // refcounted through rx_block so retained views keep it alive after the endpoint moved on.
+  hp_shared_packet_t *rx_block;
+  uint8_t *rx_buffer;
+  uint32_t rx_start;
+  uint32_t rx_end;
   packet_received_callback_t packet_received_callback;
-  receiving_state receiving_state;
+  packet_view_callback_t packet_view_callback;   /*!< Set instead of packet_received_callback to get every frame as a view. */
   HP_ERROR receive_error;
-  uint16_t bytes_expected_to_receive;
+  // Large messages are either assembled in a buffer of their own size and handed to
+  // message_received_callback, or passed to message_chunk_callback piece by piece as they arrive.
+  message_received_callback_t message_received_callback;
+  message_chunk_callback_t message_chunk_callback;
+  uint32_t max_message_length;        /*!< Zero means HP_LARGE_MESSAGE_MAX_SIZE. */
+  hp_large_header rx_large_header;
+  uint8_t *rx_large_buffer;
+  uint32_t rx_large_received;
+  bool rx_large_active;
+  bool rx_large_intercepted;          /*!< The large message in progress is assembled for the RPC layer or topic_callback. */
+  htimer_t idle_timer;                /*!< Armed by servers with an idle timeout. */
+  hhist_t *rtt;                       /*!< Round trips of stamped CMDs in microseconds, NULL while not measured. */
+  hhist_shared_t *rtt_total;          /*!< Also gets every round trip when set, e.g. by the server. */
+  // Compression of packets: with compress set every packet sent tells the peer so in its version
+  // flags, and once the peer did the same messages from compress_threshold bytes on go out
+  // compressed whenever that makes them shorter. Both may prime the codec with the same compress_dict.
+  bool compress;
+  uint16_t compress_threshold;        /*!< Zero means HP_COMPRESS_THRESHOLD. */
+  const hlz_dict_t *compress_dict;
+  uint8_t peer_accepts;               /*!< HP_VERSION_ACCEPTS_* flags the peer announced. */
+  // Pipelined requests: every HP_MSG_REQUEST sent gets the next rpc_next_id and waits in rpc_calls,
+  // indexed by the low bits of its id, until the HP_MSG_RESPONSE with the same id or its deadline.
+  // Received requests go to request_callback, responses are only taken once a request was sent.
+  rpc_request_callback_t request_callback;
+  struct hp_rpc_call_t **rpc_calls;
+  uint32_t rpc_capacity;
+  uint32_t rpc_in_flight;
+  uint32_t rpc_next_id;
+  uint32_t rpc_session;               /*!< Different for every connection, deferred responses to an older one are dropped. */
+  // Topics: topic_callback takes the subscribe, unsubscribe and publish frames when set, servers
+  // keep the subscriptions made through it in their topic index.
+  message_received_callback_t topic_callback;
+  void *topic_context;                /*!< Owner of topic_callback, e.g. the server the endpoint belongs to. */
+  struct htopic_sub_t *subscriptions;
+  uint32_t subscription_count;
+  uint32_t topic_mark;                /*!< Match the endpoint was last visited by, visits each one once per publish. */
+  // Shared memory: on a unix socket with shared_memory set clients offer, and servers take, a ring
+  // pair mapped by both processes. Once switched frames go through the rings and the socket only
+  // tells when the peer is gone.
+  bool shared_memory;
+  struct hshm_t *shm;
+  // Traffic counters of this connection, also added to stats_total when set, e.g. by the server.
+  hp_stats_t stats;
+  hp_stats_t *stats_total;
+  // Event loop the socket is registered with and the interest currently set there.
+  hevent_loop_t *loop;
+  uint32_t registered_events;
+  // Bulk bodies sent with MSG_ZEROCOPY wait in zerocopy_pending until the error queue reports that
+  // the kernel let go of their memory. Every zero-copy sendmsg() gets the next sequence number.
+  int8_t zerocopy;                    /*!< 0 untried, 1 enabled on the socket, -1 unavailable or not worth it. */
+  uint32_t zerocopy_next;
+  uint32_t zerocopy_done;             /*!< Every zero-copy send below it completed. */
+  struct hp_bulk_t *zerocopy_pending;
+  struct hp_bulk_t *zerocopy_pending_tail;
+  // Linked send chain in flight on a completion backend, the first send_batch_count queued packets.
+  uint32_t send_batch_sent[HURING_SEND_BATCH];
+  uint16_t send_batch_count;
+  uint16_t send_batch_pending;
+  bool send_batch_broken;
 };
 
 int delete_endpoint(endpoint_t *endpoint);
 int create_endpoint(endpoint_t *endpoint);
 int print_packet(hp_packet_t *packet);
 int receive_from_endpoint(endpoint_t *endpoint);
+int endpoint_receive_bytes(endpoint_t *endpoint, uint8_t *data, size_t length);
 int send_to_endpoint(endpoint_t *endpoint);
 char *get_endpoint_address_str(endpoint_t *endpoint);
 char* get_address_str(struct sockaddr_in* addr);
+int create_packet_queue(packet_queue_t *queue, int queue_size);
+void delete_packet_queue(packet_queue_t *queue);
+int enqueue(packet_queue_t *queue, hp_packet_t *packet);
+int dequeue(packet_queue_t *queue, hp_packet_t *packet);
 int dequeue_all(packet_queue_t *queue);
+uint32_t packet_queue_count(packet_queue_t *queue);
+hp_packet_t *packet_queue_at(packet_queue_t *queue, uint32_t n);
+hp_packet_t *packet_queue_reserve(packet_queue_t *queue, size_t length);
+void packet_queue_commit(packet_queue_t *queue);
+void packet_queue_pop(packet_queue_t *queue);
+int packet_queue_push_shared(packet_queue_t *queue, hp_shared_packet_t *shared);
+int packet_queue_push_view(packet_queue_t *queue, const hp_packet_view_t *view);
 int endpoint_queue_send(endpoint_t *endpoint, hp_packet_t *packet);
+int endpoint_queue_shared(endpoint_t *endpoint, hp_shared_packet_t *shared);
+int endpoint_queue_view(endpoint_t *endpoint, const hp_packet_view_t *view);
+hp_packet_t *endpoint_reserve_send(endpoint_t *endpoint, size_t max_message_size);
+int endpoint_commit_send(endpoint_t *endpoint, hp_packet_t *packet);
+int endpoint_send_message(endpoint_t *endpoint, uint8_t message_type, const void *message, uint32_t length);
+int endpoint_send_buffer(endpoint_t *endpoint, uint8_t message_type, const void *data, uint32_t length, bulk_complete_callback_t callback, void *user_data);
+int endpoint_send_file(endpoint_t *endpoint, uint8_t message_type, int fd, off_t offset, uint32_t length, bulk_complete_callback_t callback, void *user_data);
+void endpoint_set_send_budget(endpoint_t *endpoint, int max_iov, size_t max_bytes);
+void endpoint_set_watermarks(endpoint_t *endpoint, size_t high, size_t low, bool throttle_reads);
+bool endpoint_is_writable(endpoint_t *endpoint);
+int endpoint_set_profile(endpoint_t *endpoint, hp_socket_profile_t profile);
+void endpoint_set_coalescing(endpoint_t *endpoint, uint32_t bytes, uint32_t us);
+void endpoint_set_compression(endpoint_t *endpoint, bool compress, uint16_t threshold, const hlz_dict_t *dict);
+int endpoint_measure_rtt(endpoint_t *endpoint, bool enable);
+int endpoint_rtt_summary(endpoint_t *endpoint, hhist_summary_t *summary);
 int prepare_packet(char *sender, char *data, hp_packet_t *packet);
 int read_from_stdin(char *read_buffer, size_t max_len);
+bool endpoint_has_pending_send(endpoint_t *endpoint);
+int endpoint_register(endpoint_t *endpoint, hevent_loop_t *loop);
+int endpoint_unregister(endpoint_t *endpoint);
+int endpoint_update_events(endpoint_t *endpoint);
+int endpoint_handle_event(endpoint_t *endpoint, hevent_t *ev);
+void endpoint_stats(endpoint_t *endpoint, hp_stats_t *stats);
+
+// rpc ----------------------------------------------------------------------------
+
+int endpoint_rpc_call(endpoint_t *endpoint, const void *message, uint32_t length, uint32_t timeout_ms, rpc_response_callback_t callback, void *user_data);
+int endpoint_rpc_respond(const hp_rpc_request_t *request, const void *message, uint32_t length);
+bool endpoint_rpc_takes(endpoint_t *endpoint, uint8_t message_type);
+int endpoint_rpc_dispatch(endpoint_t *endpoint, uint8_t message_type, uint8_t *message, uint32_t length);
+void endpoint_rpc_fail_all(endpoint_t *endpoint, int status);
+
+// topics -------------------------------------------------------------------------
+
+#define HTOPIC_MAX_LENGTH           (255)    /*!< Longest topic or pattern, a publish carries its length in a byte. */
+#define HTOPIC_MAX_SUBSCRIPTIONS    (1024)   /*!< Patterns one endpoint may be subscribed to. */
+#define HTOPIC_SEPARATOR            ('/')    /*!< Between the levels of a topic. */
+#define HTOPIC_ANY_LEVEL            ('+')    /*!< Pattern level matching any one level. */
+#define HTOPIC_ALL_LEVELS           ('#')    /*!< Last pattern level, matching the level above and all below it. */
+
+typedef struct
+{
+  struct htopic_node_t *root;
+  uint32_t subscription_count;
+  uint32_t match_seq;                 /*!< Counts the matches, endpoints remember the last one that visited them. */
+} htopic_index_t;
+
+typedef int (*htopic_visit_t)(endpoint_t *subscriber, void *context);
+
+void htopic_index_init(htopic_index_t *index);
+void htopic_index_destroy(htopic_index_t *index);
+int htopic_subscribe(htopic_index_t *index, endpoint_t *subscriber, const char *pattern, uint32_t length);
+int htopic_unsubscribe(htopic_index_t *index, endpoint_t *subscriber, const char *pattern, uint32_t length);
+void htopic_unsubscribe_all(htopic_index_t *index, endpoint_t *subscriber);
+int htopic_match(htopic_index_t *index, const char *topic, uint32_t length, htopic_visit_t visit, void *context);
+hp_shared_packet_t *topic_packet_create(const char *topic, const void *message, uint32_t length);
+int topic_packet_parse(const uint8_t *message, uint32_t length, const char **topic, uint32_t *topic_length, const uint8_t **payload, uint32_t *payload_length);
+int endpoint_subscribe(endpoint_t *endpoint, const char *pattern);
+int endpoint_unsubscribe(endpoint_t *endpoint, const char *pattern);
+int endpoint_publish(endpoint_t *endpoint, const char *topic, const void *message, uint32_t length);
+
+// shared memory ------------------------------------------------------------------
+
+#define HSHM_RING_SIZE              (1024 * 1024)       /*!< Bytes of each direction offered, a power of two. */
+#define HSHM_RING_MIN_SIZE          (4096)              /*!< Smallest ring taken from a peer. */
+#define HSHM_RING_MAX_SIZE          (64 * 1024 * 1024)  /*!< Largest ring taken from a peer. */
+
+typedef enum
+{
+  HSHM_OFFERED = 0,                   /*!< Offer sent, sends wait for the answer. */
+  HSHM_RECEIVED,                      /*!< The descriptors of an offer arrived, its frame not parsed yet. */
+  HSHM_SWITCHING,                     /*!< Receiving from the ring, the packets queued before still go through the socket. */
+  HSHM_ACTIVE                         /*!< Both directions go through the rings. */
+} hshm_state_t;
+
+/* Ring pair of an endpoint and where each side stands in it. */
+typedef struct hshm_t
+{
+  hshm_state_t state;
+  int fds[3];                         /*!< Region, own and peer doorbell as received, until attached. */
+  int doorbell;                       /*!< Rung by the peer, registered with the loop of the endpoint. */
+  int peer_doorbell;
+  bool doorbell_registered;
+  void *region;
+  size_t region_size;
+  uint32_t ring_size;
+  struct hshm_ring_t *rx;
+  struct hshm_ring_t *tx;
+  uint8_t *rx_data;
+  uint8_t *tx_data;
+  uint32_t rx_tail;                   /*!< Own copies of the positions only this side moves. */
+  uint32_t tx_head;
+  uint32_t socket_backlog;            /*!< Queue entries still sent through the socket while switching. */
+  bool tx_full;                       /*!< Waiting for the peer to free room in the ring. */
+  bool reads_paused;
+  bool peer_closed;
+} hshm_t;
+
+int endpoint_offer_shm(endpoint_t *endpoint);
+int hshm_dispatch(endpoint_t *endpoint, uint8_t *message, uint32_t length);
+ssize_t hshm_recvmsg(endpoint_t *endpoint, void *buffer, size_t length);
+ssize_t hshm_recv(endpoint_t *endpoint, void *buffer, size_t length);
+ssize_t hshm_send(endpoint_t *endpoint, const struct iovec *iov, int iov_count);
+int hshm_poll(endpoint_t *endpoint);
+int hshm_switch(endpoint_t *endpoint);
+void hshm_set_reads_paused(endpoint_t *endpoint, bool paused);
+void hshm_unregister(endpoint_t *endpoint);
+void hshm_close(endpoint_t *endpoint);
 
-#define MAX_CLIENTS 10
 #define NO_SOCKET -1
 #define LISTEN_MAX 32
+#define SERVER_ACCEPT_RETRY_MS      (100)     /*!< Accepting again this long after running out of descriptors or memory. */
+
+// connection table ---------------------------------------------------------------
+
+#define CONN_TABLE_SLAB_SIZE        (256)     /*!< Endpoints allocated at once when the table grows. */
+#define SERVER_DEFAULT_MAX_CLIENTS  (1024)    /*!< Used when hserver_t.max_clients is left at zero. */
+
+typedef struct
+{
+  endpoint_t **slabs;
+  uint32_t capacity;
+  uint32_t max_connections;
+  uint32_t *free_slots;
+  uint32_t free_count;
+  endpoint_t **live;                  /*!< Dense array of live connections, live[0..live_count). */
+  uint32_t live_count;
+  endpoint_t **by_fd;
+  int fd_map_size;
+  conn_id_t id_tag;                   /*!< OR-ed into every id handed out, the shard number. */
+} conn_table_t;
+
+int conn_table_init(conn_table_t *table, uint32_t max_connections);
+void conn_table_destroy(conn_table_t *table);
+endpoint_t *conn_table_insert(conn_table_t *table, int fd);
+void conn_table_remove(conn_table_t *table, endpoint_t *endpoint);
+endpoint_t *conn_table_find_fd(conn_table_t *table, int fd);
+endpoint_t *conn_table_find_id(conn_table_t *table, conn_id_t id);
 
 // Forward declarations
 struct hserver_t;
 typedef struct hserver_t hserver_t;
 
-typedef int (*client_callback_t)(hserver_t* svr, int i);
+typedef int (*client_callback_t)(hserver_t* svr, endpoint_t* client);
 
 struct hserver_t
 { 
   int listen_sock; 
+  // Out of file descriptors a pending connection stays in the backlog, and the edge-triggered listener
+  // isn't told about it again. The reserve descriptor is given up for a moment to accept and drop it,
+  // when that fails too accepting resumes on accept_retry.
+  int reserve_fd;
+  htimer_t accept_retry;
   uint16_t listen_port;
+  const char *unix_path;              /*!< Listen on this unix socket instead of listen_port. */
+  bool shared_memory;                 /*!< Take the shared memory offers of unix socket clients. */
   struct sockaddr_in svr_addr;
-  endpoint_t client_list[MAX_CLIENTS];
-  fd_set read_fds;
-  fd_set write_fds;
-  fd_set error_fds;
+  uint32_t max_clients;               /*!< Connection limit applied by server_init(). */
+  conn_table_t clients;
+  hevent_backend_t event_backend;
+  hevent_loop_t loop;
   bool initialized;
   client_callback_t client_connected_callback;
   client_callback_t client_disconnected_callback;
+  uint32_t idle_timeout_ms;           /*!< Close clients silent for this long, zero never does. */
+  bool measure_rtt;                   /*!< Stamp the CMDs sent to every client and time their replies. */
+  hhist_shared_t rtt;                 /*!< Round trips of every client of this shard, closed ones included. */
+  // Watermarks of every client send queue, zero means the HP_SEND_* defaults. With throttle_reads
+  // a client whose replies pile up above the high watermark isn't read until they drained.
+  size_t send_high_watermark;
+  size_t send_low_watermark;
+  bool throttle_reads;
+  hp_socket_profile_t socket_profile; /*!< Of every accepted client, switchable per client later. */
+  // Compression of the packets sent to clients that take it, see endpoint_set_compression().
+  bool compress;
+  uint16_t compress_threshold;
+  const hlz_dict_t *compress_dict;
+  // Topics clients subscribed to, with relay_publishes what clients publish goes out to the
+  // subscribers too. Every shard has an index of its own clients.
+  htopic_index_t topics;
+  bool relay_publishes;
+  // Reactor per core: server_init() prepares shard_count copies of this server, each with its own
+  // SO_REUSEPORT listener, event loop and connection table, server_start() runs every one in a thread
+  // of its own. The callbacks get the shard they run on. Zero keeps everything on server_poll().
+  uint32_t shard_count;
+  bool pin_shards;                    /*!< Pin shard n to CPU n modulo the online CPUs. */
+  bool hugepages;                     /*!< Shard threads back their buffer pools with huge pages, without shards the polling thread calls hp_pool_use_hugepages(). */
+  bool reuse_port;                    /*!< SO_REUSEPORT on the listening socket, set for every shard. */
+  uint32_t shard_id;
+  hserver_t *shards;
+  hserver_t *parent;                  /*!< Server the shard was copied from, NULL otherwise. */
+  pthread_t thread;
+  bool running;
+  // Packets other threads submitted, drained by the thread polling this server.
+  hmpsc_queue_t submissions;
+  bool submission_pending;
+  // Metrics: every shard counts into its own stats, server_stats() sums them. With metrics_port set
+  // a thread of its own answers HTTP requests with server_metrics_text(), never touching the loops.
+  hserver_stats_t stats;
+  uint16_t metrics_port;              /*!< Zero serves no metrics. */
+  const char *metrics_address;        /*!< IPv4 address the metrics port is bound to, NULL means 127.0.0.1. */
+  int metrics_sock;
+  pthread_t metrics_thread;
+  bool metrics_running;
 };
 
+typedef struct
+{
+  hmpsc_node_t node;
+  conn_id_t id;                       /*!< CONN_ID_NONE sends to every client. */
+  hp_shared_packet_t *packet;
+  bool publish;                       /*!< Only to the subscribers of the HP_MSG_PUBLISH topic. */
+} hserver_submission_t;
+
 int server_init(hserver_t* svr);
+int server_start(hserver_t* svr);
+void server_stop(hserver_t* svr);
+int server_submit_packet(hserver_t* svr, conn_id_t id, hp_packet_t* packet);
+int server_submit_shared(hserver_t* svr, conn_id_t id, hp_shared_packet_t* shared);
 int server_periodic(hserver_t* svr);
+int server_poll(hserver_t* svr, int timeout_ms);
 int server_queue_send_packet(hserver_t* svr, hp_packet_t* new_packet);
+int server_queue_send_shared(hserver_t* svr, hp_shared_packet_t* shared);
+int server_publish(hserver_t* svr, const char* topic, const void* message, uint32_t length);
+int server_publish_shared(hserver_t* svr, hp_shared_packet_t* shared);
+int server_submit_publish(hserver_t* svr, const char* topic, const void* message, uint32_t length);
+endpoint_t* server_find_client(hserver_t* svr, conn_id_t id);
+int server_rtt_summary(hserver_t* svr, hhist_summary_t* summary);
+int server_close_client_connection(hserver_t* svr, endpoint_t *client);
+void server_stats(hserver_t* svr, hserver_stats_t* stats);
+int server_metrics_text(hserver_t* svr, char* buffer, size_t capacity);
+int server_metrics_start(hserver_t* svr);
+void server_metrics_stop(hserver_t* svr);
 
 typedef enum
 {
@@ -157,23 +858,105 @@ typedef enum
 	CONNECTION_STATE_CONNECTED
 } connection_state_t;
 
+#define CLIENT_DEFAULT_RECONNECT_DELAY_MS   (1000)  /*!< Used when hclient_t.reconnect_delay_ms is left at zero. */
+
 struct hclient_t;
 typedef struct hclient_t hclient_t;
 typedef int (*connection_callback_t)(hclient_t* cli);
 
 struct hclient_t
 {
-  char* server_address;
+  char* server_address;               /*!< IPv4 address, or the path of a unix socket starting with '/'. */
   uint16_t server_port;  
   endpoint_t server_endpoint;  
   connection_state_t connection_state;
-  fd_set read_fds;
-  fd_set write_fds;
-  fd_set error_fds;
+  hevent_backend_t event_backend;
+  hevent_loop_t loop;
   connection_callback_t connected_callback;
   connection_callback_t disconnected_callback;
+  uint32_t reconnect_delay_ms;        /*!< Pause between connection attempts. */
+  bool measure_rtt;                   /*!< Stamp the CMDs sent to the server and time their replies. */
+  size_t send_high_watermark;         /*!< Zero means HP_SEND_HIGH_WATERMARK. */
+  size_t send_low_watermark;          /*!< Zero means HP_SEND_LOW_WATERMARK. */
+  bool throttle_reads;                /*!< Stop reading from the server while the send queue is above the high watermark. */
+  hp_socket_profile_t socket_profile;
+  bool compress;                      /*!< Compress packets once the server takes them, see endpoint_set_compression(). */
+  uint16_t compress_threshold;
+  const hlz_dict_t *compress_dict;
+  bool shared_memory;                 /*!< Offer the shared memory transport on a unix socket. */
+  htimer_t reconnect_timer;
 };
 
 int client_init(hclient_t *cli);
 int client_periodic(hclient_t *cli);
+int client_poll(hclient_t *cli, int timeout_ms);
+int client_open_endpoint(endpoint_t *endpoint, const char *address, uint16_t port);
+int client_check_endpoint(endpoint_t *endpoint);
+
+// client engine ------------------------------------------------------------------
+
+/* Many outbound connections on one event loop, grouped into pools per destination. */
+struct hclient_engine_t;
+typedef struct hclient_engine_t hclient_engine_t;
+struct hclient_pool_t;
+typedef struct hclient_pool_t hclient_pool_t;
+
+typedef enum
+{
+  HCLIENT_ROUTE_ROUND_ROBIN = 0,      /*!< Connected connections take turns. */
+  HCLIENT_ROUTE_LEAST_OUTSTANDING     /*!< The connection with the fewest CMDs still waiting for a reply. */
+} hclient_route_t;
+
+typedef struct
+{
+  endpoint_t endpoint;                /*!< First, event data and callbacks get the endpoint of the connection. */
+  hclient_pool_t *pool;
+  connection_state_t connection_state;
+  uint32_t outstanding;               /*!< CMDs sent through the pool and not answered by a HP_MSG_REPLY yet. */
+  htimer_t reconnect_timer;
+  void *user_data;
+} hclient_conn_t;
+
+typedef int (*client_conn_callback_t)(hclient_conn_t* conn);
+
+struct hclient_pool_t
+{
+  char* server_address;
+  uint16_t server_port;
+  uint32_t size;                      /*!< Connections kept open to the destination. */
+  hclient_route_t route;
+  uint32_t reconnect_delay_ms;        /*!< Zero means CLIENT_DEFAULT_RECONNECT_DELAY_MS. */
+  bool measure_rtt;
+  size_t send_high_watermark;         /*!< Per connection, zero means HP_SEND_HIGH_WATERMARK. */
+  size_t send_low_watermark;          /*!< Per connection, zero means HP_SEND_LOW_WATERMARK. */
+  hp_socket_profile_t socket_profile; /*!< Per connection. */
+  bool compress;                      /*!< Per connection, see endpoint_set_compression(). */
+  uint16_t compress_threshold;
+  const hlz_dict_t *compress_dict;
+  bool shared_memory;                 /*!< Per connection, offer the shared memory transport on a unix socket. */
+  client_conn_callback_t connected_callback;
+  client_conn_callback_t disconnected_callback;
+  packet_received_callback_t packet_received_callback;   /*!< Packets of every connection, replies already counted. */
+  // Filled by client_engine_add_pool()
+  hclient_engine_t *engine;
+  hclient_conn_t *conns;
+  uint32_t connected_count;
+  uint32_t next;                      /*!< Round robin cursor. */
+};
+
+struct hclient_engine_t
+{
+  hevent_backend_t event_backend;
+  hevent_loop_t loop;
+  hclient_pool_t **pools;
+  uint32_t pool_count;
+};
+
+int client_engine_init(hclient_engine_t *engine);
+void client_engine_close(hclient_engine_t *engine);
+int client_engine_add_pool(hclient_engine_t *engine, hclient_pool_t *pool);
+int client_engine_poll(hclient_engine_t *engine, int timeout_ms);
+hclient_conn_t *client_pool_route(hclient_pool_t *pool);
+hclient_conn_t *client_pool_send(hclient_pool_t *pool, hp_packet_t *packet);
+hclient_conn_t *client_pool_call(hclient_pool_t *pool, const void *message, uint32_t length, uint32_t timeout_ms, rpc_response_callback_t callback, void *user_data);
 #endif /* COMMON_H */
@@ -0,0 +1,537 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "hcomm.h"
+
+/*
+ * Microbenchmarks of the framing, queue and dispatch hot paths.
+ *
+ * Everything runs in memory or over socketpairs, no network needed. Each case is repeated with a
+ * doubling iteration count until one run takes at least the minimum duration, then one CSV line is
+ * printed so results can be diffed between commits:
+ *
+ *   benchmark,message_size,param,ops,ns_per_op,msgs_per_s,bytes_per_s
+ *
+ * Usage: hcomm_bench [min_ms [name_filter]]
+ */
+
+#define BENCH_QUEUE_BATCH           (32)      /*!< Packets pushed before the queue is drained again. */
+#define BENCH_FRAME_BYTES           (HP_RECEIVE_BUFFER_SIZE)   /*!< Frames parsed per iteration, at least one. */
+#define BENCH_DRAIN_EVERY           (16)      /*!< Broadcast rounds between reads of the peer sockets. */
+#define BENCH_TELEMETRY_DICT        "Reply to peer 127.0.0.1: value= state=ok"
+
+typedef struct
+{
+    uint32_t message_size;
+    uint32_t param;
+    // Endpoints and the socket ends receiving what they send
+    endpoint_t endpoint;
+    int peer;
+    endpoint_t target;                  /*!< Relay cases forward what endpoint receives into its queue. */
+    hserver_t svr;
+    int *peers;
+    // Encoded frames parsed by the receive cases
+    uint8_t *frames;
+    size_t frames_length;
+    uint32_t frame_count;
+    hp_packet_t packet;
+    // Codec cases compress packet.message, primed with dict when param is 1
+    hlz_dict_t dict;
+    int compressed_length;
+} bench_ctx_t;
+
+typedef uint64_t (*bench_fn_t)(bench_ctx_t *ctx, uint64_t iterations);
+
+static uint32_t bench_min_ms = 200;
+static const char *bench_filter = NULL;
+static uint64_t bench_received = 0;
+static endpoint_t *bench_relay_target = NULL;
+static uint8_t bench_scratch[256 * 1024];
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static int bench_packet_received(endpoint_t *peer, hp_packet_t *packet)
+{
+    bench_received++;
+    return 0;
+}
+
+static int bench_message_received(endpoint_t *peer, hp_packet_header *header, uint8_t *message, uint32_t length)
+{
+    bench_received++;
+    return 0;
+}
+
+static int bench_relay_copy_received(endpoint_t *peer, hp_packet_t *packet)
+{
+    bench_received++;
+    return endpoint_queue_send(bench_relay_target, packet);
+}
+
+static int bench_relay_view_received(endpoint_t *peer, hp_packet_view_t *view)
+{
+    bench_received++;
+    return endpoint_queue_view(bench_relay_target, view);
+}
+
+static size_t bench_frame_length(uint32_t message_size)
+{
+    return message_size <= HP_MESSAGE_MAX_SIZE ? HP_PACKET_HEADER_SIZE + message_size : HP_LARGE_HEADER_SIZE + message_size;
+}
+
+static void bench_drain(int fd)
+{
+    while (read(fd, bench_scratch, sizeof(bench_scratch)) > 0)
+        ;
+}
+
+static int bench_socketpair(int *local, int *remote)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        return -1;
+    int size = 1024 * 1024;
+    for (int i = 0; i < 2; ++i)
+    {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL, 0) | O_NONBLOCK);
+        setsockopt(fds[i], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        setsockopt(fds[i], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    *local = fds[0];
+    *remote = fds[1];
+    return 0;
+}
+
+static int bench_endpoint_init(bench_ctx_t *ctx)
+{
+    memset(&ctx->endpoint, 0, sizeof(ctx->endpoint));
+    create_endpoint(&ctx->endpoint);
+    ctx->endpoint.packet_received_callback = bench_packet_received;
+    ctx->endpoint.message_received_callback = bench_message_received;
+    ctx->endpoint.max_message_length = 0xffffffff;
+    return bench_socketpair(&ctx->endpoint.socket, &ctx->peer);
+}
+
+static void bench_endpoint_close(bench_ctx_t *ctx)
+{
+    delete_endpoint(&ctx->endpoint);
+    close(ctx->peer);
+}
+
+/* Encode frames of message_size into ctx->frames, as many as fill BENCH_FRAME_BYTES. */
+static int bench_build_frames(bench_ctx_t *ctx)
+{
+    size_t frame_length = bench_frame_length(ctx->message_size);
+    ctx->frame_count = BENCH_FRAME_BYTES / frame_length ? BENCH_FRAME_BYTES / frame_length : 1;
+    ctx->frames_length = frame_length * ctx->frame_count;
+    ctx->frames = malloc(ctx->frames_length);
+    if (ctx->frames == NULL)
+        return -1;
+    memset(ctx->frames, 'x', ctx->frames_length);
+    for (uint32_t i = 0; i < ctx->frame_count; ++i)
+    {
+        uint8_t *frame = ctx->frames + i * frame_length;
+        if (ctx->message_size <= HP_MESSAGE_MAX_SIZE)
+        {
+            hp_packet_header header = { .version = 0, .message_type = HP_MSG_CMD, .message_size = ctx->message_size };
+            memcpy(frame, header.raw, sizeof(header));
+        }
+        else
+        {
+            hp_large_header large;
+            memset(&large, 0, sizeof(large));
+            large.header.version = HP_PACKET_VERSION_LARGE;
+            large.message_length = ctx->message_size;
+            memcpy(frame, large.raw, sizeof(large));
+        }
+    }
+    return 0;
+}
+
+static void bench_fill_packet(bench_ctx_t *ctx)
+{
+    memset(&ctx->packet, 'x', sizeof(ctx->packet));
+    memset(ctx->packet.header.raw, 0, sizeof(ctx->packet.header));
+    ctx->packet.header.message_size = ctx->message_size;
+}
+
+static void bench_report(const char *name, bench_ctx_t *ctx, uint64_t ops, uint64_t elapsed_ns)
+{
+    if (ops == 0 || elapsed_ns == 0)
+        return;
+    double seconds = elapsed_ns / 1e9;
+    printf("%s,%u,%u,%llu,%.1f,%.0f,%.0f\n", name, ctx->message_size, ctx->param, (unsigned long long)ops,
+           (double)elapsed_ns / ops, ops / seconds, ops * (double)bench_frame_length(ctx->message_size) / seconds);
+    fflush(stdout);
+}
+
+static void bench_run(const char *name, bench_ctx_t *ctx, bench_fn_t fn)
+{
+    // Warm the caches and the pool first
+    fn(ctx, 16);
+    uint64_t iterations = 16;
+    for (;;)
+    {
+        uint64_t start = bench_now_ns();
+        uint64_t ops = fn(ctx, iterations);
+        uint64_t elapsed = bench_now_ns() - start;
+        if (elapsed >= (uint64_t)bench_min_ms * 1000000ull || ops == 0)
+        {
+            bench_report(name, ctx, ops, elapsed);
+            return;
+        }
+        iterations *= 2;
+    }
+}
+
+static bool bench_selected(const char *name)
+{
+    return bench_filter == NULL || strstr(name, bench_filter) != NULL;
+}
+
+/* queue --------------------------------------------------------------------- */
+
+static uint64_t bench_queue_copy(bench_ctx_t *ctx, uint64_t iterations)
+{
+    packet_queue_t *queue = &ctx->endpoint.send_queue;
+    hp_packet_t out;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        for (int n = 0; n < BENCH_QUEUE_BATCH; ++n)
+            enqueue(queue, &ctx->packet);
+        for (int n = 0; n < BENCH_QUEUE_BATCH; ++n)
+            dequeue(queue, &out);
+    }
+    return iterations * BENCH_QUEUE_BATCH;
+}
+
+static uint64_t bench_queue_in_place(bench_ctx_t *ctx, uint64_t iterations)
+{
+    packet_queue_t *queue = &ctx->endpoint.send_queue;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        for (int n = 0; n < BENCH_QUEUE_BATCH; ++n)
+        {
+            hp_packet_t *packet = packet_queue_reserve(queue, HP_PACKET_HEADER_SIZE + ctx->message_size);
+            packet->header.message_size = ctx->message_size;
+            packet_queue_commit(queue);
+        }
+        for (int n = 0; n < BENCH_QUEUE_BATCH; ++n)
+            packet_queue_pop(queue);
+    }
+    return iterations * BENCH_QUEUE_BATCH;
+}
+
+/* framing and dispatch ---------------------------------------------------------- */
+
+static uint64_t bench_parse(bench_ctx_t *ctx, uint64_t iterations)
+{
+    bench_received = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        if (endpoint_receive_bytes(&ctx->endpoint, ctx->frames, ctx->frames_length) < 0)
+            return 0;
+    }
+    return bench_received;
+}
+
+static uint64_t bench_receive(bench_ctx_t *ctx, uint64_t iterations)
+{
+    bench_received = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        uint64_t expected = bench_received + ctx->frame_count;
+        size_t offset = 0;
+        while (bench_received < expected)
+        {
+            if (offset < ctx->frames_length)
+            {
+                ssize_t written = write(ctx->peer, ctx->frames + offset, ctx->frames_length - offset);
+                if (written > 0)
+                    offset += written;
+                else if (errno != EAGAIN)
+                    return 0;
+            }
+            if (receive_from_endpoint(&ctx->endpoint) < 0)
+                return 0;
+        }
+    }
+    return bench_received;
+}
+
+/* Parse frames on one endpoint and queue every one on another, copied or as a view of the
+   receive buffer. The target queue is emptied after each batch as if it had been sent. */
+static uint64_t bench_relay(bench_ctx_t *ctx, uint64_t iterations)
+{
+    bench_received = 0;
+    bench_relay_target = &ctx->target;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        if (endpoint_receive_bytes(&ctx->endpoint, ctx->frames, ctx->frames_length) < 0)
+            return 0;
+        dequeue_all(&ctx->target.send_queue);
+    }
+    return bench_received;
+}
+
+/* sending ------------------------------------------------------------------------ */
+
+static uint64_t bench_send(bench_ctx_t *ctx, uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        for (uint32_t n = 0; n < ctx->param; ++n)
+            endpoint_queue_send(&ctx->endpoint, &ctx->packet);
+        while (endpoint_has_pending_send(&ctx->endpoint))
+        {
+            if (send_to_endpoint(&ctx->endpoint) < 0)
+                return 0;
+            bench_drain(ctx->peer);
+        }
+    }
+    return iterations * ctx->param;
+}
+
+static int bench_broadcast_init(bench_ctx_t *ctx)
+{
+    memset(&ctx->svr, 0, sizeof(ctx->svr));
+    conn_table_init(&ctx->svr.clients, ctx->param);
+    ctx->peers = calloc(ctx->param, sizeof(int));
+    if (ctx->peers == NULL)
+        return -1;
+    for (uint32_t i = 0; i < ctx->param; ++i)
+    {
+        int local;
+        if (bench_socketpair(&local, &ctx->peers[i]) != 0)
+            return -1;
+        endpoint_t *endpoint = conn_table_insert(&ctx->svr.clients, local);
+        if (endpoint == NULL)
+            return -1;
+        create_endpoint(endpoint);
+    }
+    return 0;
+}
+
+static void bench_broadcast_close(bench_ctx_t *ctx)
+{
+    while (ctx->svr.clients.live_count > 0)
+    {
+        endpoint_t *endpoint = ctx->svr.clients.live[0];
+        conn_table_remove(&ctx->svr.clients, endpoint);
+        delete_endpoint(endpoint);
+    }
+    conn_table_destroy(&ctx->svr.clients);
+    for (uint32_t i = 0; i < ctx->param; ++i)
+        close(ctx->peers[i]);
+    free(ctx->peers);
+}
+
+static uint64_t bench_broadcast(bench_ctx_t *ctx, uint64_t iterations)
+{
+    conn_table_t *clients = &ctx->svr.clients;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        hp_shared_packet_t *shared = shared_packet_create(&ctx->packet);
+        if (shared == NULL)
+            return 0;
+        server_queue_send_shared(&ctx->svr, shared);
+        shared_packet_release(shared);
+        for (uint32_t n = 0; n < clients->live_count; ++n)
+        {
+            if (send_to_endpoint(clients->live[n]) < 0)
+                return 0;
+        }
+        if ((i + 1) % BENCH_DRAIN_EVERY == 0 || i + 1 == iterations)
+        {
+            for (uint32_t n = 0; n < ctx->param; ++n)
+                bench_drain(ctx->peers[n]);
+        }
+    }
+    return iterations * clients->live_count;
+}
+
+/* compression -------------------------------------------------------------------- */
+
+/* Telemetry like text as repetitive as the demo replies. */
+static void bench_fill_telemetry(bench_ctx_t *ctx)
+{
+    bench_fill_packet(ctx);
+    char line[64];
+    uint32_t offset = 0;
+    for (int n = 0; offset < ctx->message_size; ++n)
+    {
+        int length = snprintf(line, sizeof(line), "Reply to peer 127.0.0.1:%d value=%d state=ok\n", 40000 + n, n * 37);
+        uint32_t count = ctx->message_size - offset < (uint32_t)length ? ctx->message_size - offset : (uint32_t)length;
+        memcpy(ctx->packet.message + offset, line, count);
+        offset += count;
+    }
+}
+
+static const hlz_dict_t *bench_dict(bench_ctx_t *ctx)
+{
+    return ctx->param ? &ctx->dict : NULL;
+}
+
+static uint64_t bench_compress(bench_ctx_t *ctx, uint64_t iterations)
+{
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        if (hlz_compress(bench_dict(ctx), ctx->packet.message, ctx->message_size, bench_scratch, sizeof(bench_scratch)) < 0)
+            return 0;
+    }
+    return iterations;
+}
+
+static uint64_t bench_decompress(bench_ctx_t *ctx, uint64_t iterations)
+{
+    hp_packet_t out;
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        if (hlz_decompress(bench_dict(ctx), bench_scratch, ctx->compressed_length, out.message, sizeof(out.message)) != (int)ctx->message_size)
+            return 0;
+    }
+    return iterations;
+}
+
+/* main ------------------------------------------------------------------------------ */
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+        bench_min_ms = atoi(argv[1]);
+    if (argc > 2)
+        bench_filter = argv[2];
+
+    static const uint32_t packet_sizes[] = { 8, 64, 256, HP_MESSAGE_MAX_SIZE };
+    static const uint32_t frame_sizes[] = { 8, 64, 256, HP_MESSAGE_MAX_SIZE, 16384, 262144 };
+    static const uint32_t send_batches[] = { 1, 16, 64 };
+    static const uint32_t fanouts[] = { 1, 16, 256 };
+    const int packet_size_count = sizeof(packet_sizes) / sizeof(packet_sizes[0]);
+    const int frame_size_count = sizeof(frame_sizes) / sizeof(frame_sizes[0]);
+
+    printf("benchmark,message_size,param,ops,ns_per_op,msgs_per_s,bytes_per_s\n");
+    bench_ctx_t ctx;
+
+    for (int i = 0; i < packet_size_count; ++i)
+    {
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.message_size = packet_sizes[i];
+        ctx.param = BENCH_QUEUE_BATCH;
+        bench_fill_packet(&ctx);
+        create_endpoint(&ctx.endpoint);
+        if (bench_selected("queue_copy"))
+            bench_run("queue_copy", &ctx, bench_queue_copy);
+        if (bench_selected("queue_in_place"))
+            bench_run("queue_in_place", &ctx, bench_queue_in_place);
+        delete_packet_queue(&ctx.endpoint.send_queue);
+    }
+
+    for (int i = 0; i < frame_size_count; ++i)
+    {
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.message_size = frame_sizes[i];
+        if (bench_build_frames(&ctx) != 0 || bench_endpoint_init(&ctx) != 0)
+        {
+            printf("Error, failed to set up frames of %u bytes\n", ctx.message_size);
+            return EXIT_FAILURE;
+        }
+        ctx.param = ctx.frame_count;
+        if (bench_selected("parse"))
+            bench_run("parse", &ctx, bench_parse);
+        if (bench_selected("receive"))
+            bench_run("receive", &ctx, bench_receive);
+        bench_endpoint_close(&ctx);
+        free(ctx.frames);
+    }
+
+    for (int i = 0; i < packet_size_count; ++i)
+    {
+        if (!bench_selected("relay"))
+            continue;
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.message_size = packet_sizes[i];
+        if (bench_build_frames(&ctx) != 0)
+            return EXIT_FAILURE;
+        ctx.param = ctx.frame_count;
+        create_endpoint(&ctx.endpoint);
+        create_endpoint(&ctx.target);
+        ctx.endpoint.packet_received_callback = bench_relay_copy_received;
+        if (bench_selected("relay_copy"))
+            bench_run("relay_copy", &ctx, bench_relay);
+        ctx.endpoint.packet_view_callback = bench_relay_view_received;
+        if (bench_selected("relay_view"))
+            bench_run("relay_view", &ctx, bench_relay);
+        delete_packet_queue(&ctx.target.send_queue);
+        delete_packet_queue(&ctx.endpoint.send_queue);
+        free(ctx.frames);
+    }
+
+    for (int i = 0; i < packet_size_count; ++i)
+    {
+        for (uint32_t d = 0; d < 2; ++d)
+        {
+            if (!bench_selected("compress") && !bench_selected("decompress"))
+                continue;
+            memset(&ctx, 0, sizeof(ctx));
+            ctx.message_size = packet_sizes[i];
+            ctx.param = d;
+            bench_fill_telemetry(&ctx);
+            hlz_dict_init(&ctx.dict, (const uint8_t *)BENCH_TELEMETRY_DICT, strlen(BENCH_TELEMETRY_DICT));
+            ctx.compressed_length = hlz_compress(bench_dict(&ctx), ctx.packet.message, ctx.message_size, bench_scratch, sizeof(bench_scratch));
+            if (bench_selected("compress"))
+                bench_run("compress", &ctx, bench_compress);
+            if (bench_selected("decompress"))
+                bench_run("decompress", &ctx, bench_decompress);
+        }
+    }
+
+    for (int i = 0; i < packet_size_count; ++i)
+    {
+        for (int b = 0; b < (int)(sizeof(send_batches) / sizeof(send_batches[0])); ++b)
+        {
+            if (!bench_selected("send"))
+                continue;
+            memset(&ctx, 0, sizeof(ctx));
+            ctx.message_size = packet_sizes[i];
+            ctx.param = send_batches[b];
+            bench_fill_packet(&ctx);
+            if (bench_endpoint_init(&ctx) != 0)
+                return EXIT_FAILURE;
+            bench_run("send", &ctx, bench_send);
+            bench_endpoint_close(&ctx);
+        }
+    }
+
+    for (int i = 0; i < packet_size_count; ++i)
+    {
+        for (int f = 0; f < (int)(sizeof(fanouts) / sizeof(fanouts[0])); ++f)
+        {
+            if (!bench_selected("broadcast"))
+                continue;
+            memset(&ctx, 0, sizeof(ctx));
+            ctx.message_size = packet_sizes[i];
+            ctx.param = fanouts[f];
+            bench_fill_packet(&ctx);
+            if (bench_broadcast_init(&ctx) != 0)
+            {
+                printf("Error, failed to open %u socketpairs: %d\n", ctx.param, errno);
+                return EXIT_FAILURE;
+            }
+            bench_run("broadcast", &ctx, bench_broadcast);
+            bench_broadcast_close(&ctx);
+        }
+    }
+    hp_pool_drain();
+    return EXIT_SUCCESS;
+}
@@ -8,16 +8,15 @@
 #define HCOMM_DEBUG_BANDWIDTH
 
 #ifdef HCOMM_DEBUG_BANDWIDTH
+// Byte counts of the endpoints at the previous printout
 typedef struct 
 {
-  int bytes_sent;
-  int bytes_received;
-  int prev_bytes_sent;
-  int prev_bytes_received;
+  uint64_t prev_bytes_sent;
+  uint64_t prev_bytes_received;
   uint32_t prev_time_ms;
 } bandwidth_t;
 
-bandwidth_t bandwidth = { 0,0,0,0,0};
+bandwidth_t bandwidth = { 0,0,0};
 #define BANDWIDTH_CALCULATION_INTERVAL_MS 5000 // Five seconds
 #endif
 
@@ -26,21 +25,18 @@ int packet_received(endpoint_t* peer, hp_packet_t* packet)
 #ifdef HCOMM_DEBUG_INFO
     printf("Info, client RX from %s containing a message of %d bytes.\n", get_endpoint_address_str(peer), packet->header.message_size);    
 #endif
-    // Send a reply packet back
-    hp_packet_t reply_packet;
-    memset(&reply_packet, 0, sizeof(reply_packet));
+    // Build the reply packet directly in the send queue
+    hp_packet_t *reply_packet = endpoint_reserve_send(peer, HP_MESSAGE_MAX_SIZE);
+    if (reply_packet == NULL)
+        return -1;
     // Specify the size of the message inside the reply packet
-    reply_packet.header.message_size = snprintf((char *)reply_packet.message, HP_MESSAGE_MAX_SIZE, "Reply to peer %s\r\n", get_endpoint_address_str(peer));
+    reply_packet->header.message_size = snprintf((char *)reply_packet->message, HP_MESSAGE_MAX_SIZE, "Reply to peer %s\r\n", get_endpoint_address_str(peer));
 
 #ifdef HCOMM_DEBUG_INFO
-    printf("Info, client TX to %s a message of %d bytes.\n", get_endpoint_address_str(peer), reply_packet.header.message_size);
+    printf("Info, client TX to %s a message of %d bytes.\n", get_endpoint_address_str(peer), reply_packet->header.message_size);
 #endif
-    endpoint_queue_send(peer, &reply_packet);
 
-#ifdef HCOMM_DEBUG_BANDWIDTH
-    bandwidth.bytes_received += sizeof(packet->header) + packet->header.message_size;
-    bandwidth.bytes_sent += sizeof(reply_packet.header) + reply_packet.header.message_size;
-#endif
+    endpoint_commit_send(peer, reply_packet);
     return 0;
 }
 
@@ -50,12 +46,12 @@ int connected_callback(hclient_t* cli)
     // Setup the receive callback
     cli->server_endpoint.packet_received_callback = packet_received;
 
-    // Send a reply packet back
-    hp_packet_t reply_packet;
-    memset(&reply_packet, 0, sizeof(reply_packet));
-    // Specify the size of the message inside the reply packet
-    reply_packet.header.message_size = snprintf((char *)reply_packet.message, HP_MESSAGE_MAX_SIZE, "Saying Hello to peer %s\r\n", get_endpoint_address_str(&cli->server_endpoint));
-    endpoint_queue_send(&cli->server_endpoint, &reply_packet);
+    // Say hello, built directly in the send queue
+    hp_packet_t *hello_packet = endpoint_reserve_send(&cli->server_endpoint, HP_MESSAGE_MAX_SIZE);
+    if (hello_packet == NULL)
+        return -1;
+    hello_packet->header.message_size = snprintf((char *)hello_packet->message, HP_MESSAGE_MAX_SIZE, "Saying Hello to peer %s\r\n", get_endpoint_address_str(&cli->server_endpoint));
+    endpoint_commit_send(&cli->server_endpoint, hello_packet);
     return 0;
 }
 
@@ -96,24 +92,87 @@ int setup_signals()
   return 0;
 }
 
-void calculate_bandwitdh()
+int pool_connected_callback(hclient_conn_t* conn)
+{
+    printf("Info, connection %u of %u connected\n", conn->pool->connected_count, conn->pool->size);
+    // Say hello, the replies keep the connection busy from then on
+    hp_packet_t *hello_packet = endpoint_reserve_send(&conn->endpoint, HP_MESSAGE_MAX_SIZE);
+    if (hello_packet == NULL)
+        return -1;
+    hello_packet->header.message_size = snprintf((char *)hello_packet->message, HP_MESSAGE_MAX_SIZE, "Saying Hello to peer %s\r\n", get_endpoint_address_str(&conn->endpoint));
+    endpoint_commit_send(&conn->endpoint, hello_packet);
+    return 0;
+}
+
+int pool_disconnected_callback(hclient_conn_t* conn)
+{
+    printf("Info, connection lost, %u of %u left\n", conn->pool->connected_count, conn->pool->size);
+    return 0;
+}
+
+/* Round trips of a single client or merged over every connection of a pool. */
+void print_rtt(hclient_t *cli, hclient_pool_t *pool)
 {
-    struct timespec current_time;
-    uint32_t current_time_ms = 0;
-    clock_gettime(CLOCK_REALTIME, &current_time);    
-    current_time_ms = current_time.tv_sec * 1000 + current_time.tv_nsec / 1000000;
+    static hhist_t total;
+    hhist_reset(&total);
+    if (cli != NULL && cli->server_endpoint.rtt != NULL)
+        hhist_merge(&total, cli->server_endpoint.rtt);
+    for (uint32_t i = 0; pool != NULL && i < pool->size; ++i)
+    {
+        if (pool->conns[i].connection_state == CONNECTION_STATE_CONNECTED && pool->conns[i].endpoint.rtt != NULL)
+            hhist_merge(&total, pool->conns[i].endpoint.rtt);
+    }
+    hhist_summary_t rtt;
+    hhist_summarize(&total, &rtt);
+    if (rtt.count > 0)
+        printf("RTT us p50: %u p90: %u p99: %u p99.9: %u max: %u over %llu replies\n",
+                rtt.p50, rtt.p90, rtt.p99, rtt.p999, rtt.max, (unsigned long long)rtt.count);
+}
+
+hclient_t *demo_client = NULL;
+hclient_pool_t *demo_pool = NULL;
+
+/* Add the traffic counters of a connected endpoint to total. */
+void add_stats(hp_stats_t *total, endpoint_t *endpoint)
+{
+    hp_stats_t stats;
+    endpoint_stats(endpoint, &stats);
+    total->bytes_received += stats.bytes_received;
+    total->bytes_sent += stats.bytes_sent;
+}
+
+int calculate_bandwitdh(htimer_t *timer)
+{
+    uint32_t current_time_ms = (uint32_t)htimer_now_ms();
     uint32_t elapsed_time_ms = current_time_ms - bandwidth.prev_time_ms;
-    if ( elapsed_time_ms > BANDWIDTH_CALCULATION_INTERVAL_MS)
+    hp_stats_t total;
+    memset(&total, 0, sizeof(total));
+    if (demo_client != NULL && demo_client->connection_state == CONNECTION_STATE_CONNECTED)
+        add_stats(&total, &demo_client->server_endpoint);
+    for (uint32_t i = 0; demo_pool != NULL && i < demo_pool->size; ++i)
     {
-        printf("RX bytes/sec: %d TX bytes/sec: %d \n", 
-                (bandwidth.bytes_received - bandwidth.prev_bytes_received) * 1000 / elapsed_time_ms,
-                (bandwidth.bytes_sent - bandwidth.prev_bytes_sent) * 1000 / elapsed_time_ms);
+        if (demo_pool->conns[i].connection_state == CONNECTION_STATE_CONNECTED)
+            add_stats(&total, &demo_pool->conns[i].endpoint);
+    }
+    // Counters start over with every connection
+    if (total.bytes_received < bandwidth.prev_bytes_received || total.bytes_sent < bandwidth.prev_bytes_sent)
+    {
+        bandwidth.prev_bytes_received = 0;
+        bandwidth.prev_bytes_sent = 0;
+    }
+    if (elapsed_time_ms > 0)
+    {
+        printf("RX bytes/sec: %llu TX bytes/sec: %llu \n", 
+                (unsigned long long)((total.bytes_received - bandwidth.prev_bytes_received) * 1000 / elapsed_time_ms),
+                (unsigned long long)((total.bytes_sent - bandwidth.prev_bytes_sent) * 1000 / elapsed_time_ms));
+
+        print_rtt(demo_client, demo_pool);
 
         bandwidth.prev_time_ms = current_time_ms;
-        bandwidth.prev_bytes_received = bandwidth.bytes_received;
-        bandwidth.prev_bytes_sent = bandwidth.bytes_sent;
+        bandwidth.prev_bytes_received = total.bytes_received;
+        bandwidth.prev_bytes_sent = total.bytes_sent;
     }
-    
+    return 0;
 }
 
 #pragma pack(push,1)
@@ -134,19 +193,58 @@ int main(int argc, char **argv)
 
     setup_signals();
 
+    // Optional event backend after the address, then how many connections to open
+    hevent_backend_t backend = event_backend_from_str(argc > 2 ? argv[2] : NULL);
+    int connections = argc > 3 ? atoi(argv[3]) : 1;
+    hevent_loop_t *loop;
+
     hclient_t cli = {.server_address = argv[1],
                      .server_port = 31000,
+                     .event_backend = backend,
                      .connected_callback = connected_callback,
-                     .disconnected_callback = disconnected_callback };
+                     .disconnected_callback = disconnected_callback,
+                     .measure_rtt = true,
+                     .shared_memory = true };
+    // Many connections share one event loop through the client engine
+    hclient_engine_t engine = {.event_backend = backend};
+    hclient_pool_t pool = {.server_address = argv[1],
+                           .server_port = 31000,
+                           .size = connections,
+                           .route = HCLIENT_ROUTE_LEAST_OUTSTANDING,
+                           .measure_rtt = true,
+                           .shared_memory = true,
+                           .connected_callback = pool_connected_callback,
+                           .disconnected_callback = pool_disconnected_callback,
+                           .packet_received_callback = packet_received };
+
+    if (connections > 1)
+    {
+        if (client_engine_init(&engine) != 0 || client_engine_add_pool(&engine, &pool) != 0)
+            return EXIT_FAILURE;
+        demo_pool = &pool;
+        loop = &engine.loop;
+    }
+    else
+    {
+        client_init(&cli);
+        demo_client = &cli;
+        loop = &cli.loop;
+    }
 
-    client_init(&cli);
+#ifdef HCOMM_DEBUG_BANDWIDTH
+    // The bandwidth printout runs off the event loop timers, so polling can block
+    htimer_t bandwidth_timer;
+    htimer_init(&bandwidth_timer, calculate_bandwitdh, NULL);
+    bandwidth.prev_time_ms = (uint32_t)htimer_now_ms();
+    htimer_add(&loop->timers, &bandwidth_timer, BANDWIDTH_CALCULATION_INTERVAL_MS, BANDWIDTH_CALCULATION_INTERVAL_MS);
+#endif
 
     while(true)
     {
-        client_periodic(&cli);
-#ifdef HCOMM_DEBUG_BANDWIDTH
-        calculate_bandwitdh();
-#endif
+        if (demo_pool != NULL)
+            client_engine_poll(&engine, -1);
+        else
+            client_poll(&cli, -1);
     }
     return 0;
 }
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <signal.h>
+#include <unistd.h>
 
 #include "hcomm.h"
 
@@ -9,35 +10,39 @@ int packet_received(endpoint_t* peer, hp_packet_t* packet)
 #ifdef HCOMM_DEBUG_INFO
     printf("Info, server RX from %s containing a message of %d bytes\n", get_endpoint_address_str(peer), packet->header.message_size);
 #endif
-    // Send a reply packet back
-    hp_packet_t reply_packet;
-    memset(&reply_packet, 0, sizeof(reply_packet));
+    // Build the reply packet directly in the send queue
+    hp_packet_t *reply_packet = endpoint_reserve_send(peer, HP_MESSAGE_MAX_SIZE);
+    if (reply_packet == NULL)
+        return -1;
     // Specify the size of the message inside the reply packet
-    reply_packet.header.message_size = snprintf((char *)reply_packet.message, HP_MESSAGE_MAX_SIZE, "Reply to peer %s\r\n", get_endpoint_address_str(peer));
+    reply_packet->header.message_size = snprintf((char *)reply_packet->message, HP_MESSAGE_MAX_SIZE, "Reply to peer %s\r\n", get_endpoint_address_str(peer));
+    // Echo the stamp so the client can time the round trip
+    reply_packet->header.message_type = HP_MSG_REPLY;
+    reply_packet->header.stamp = packet->header.stamp;
 #ifdef HCOMM_DEBUG_INFO
-    printf("Info, server TX to %s containing a message of %d bytes\n", get_endpoint_address_str(peer), reply_packet.header.message_size);
+    printf("Info, server TX to %s containing a message of %d bytes\n", get_endpoint_address_str(peer), reply_packet->header.message_size);
 #endif
-    endpoint_queue_send(peer, &reply_packet);
+    endpoint_commit_send(peer, reply_packet);
     return 0;
 }
 
-int client_connected_callback(hserver_t* svr, int i)
+int client_connected_callback(hserver_t* svr, endpoint_t* client)
 {
-    printf("Info, new client connected from %s\n", get_endpoint_address_str(&svr->client_list[i]));
+    printf("Info, new client connected from %s on shard %u\n", get_endpoint_address_str(client), svr->shard_id);
     // Setup the receive callback
-    svr->client_list[i].packet_received_callback = packet_received;
+    client->packet_received_callback = packet_received;
     // Send a welcome packet back
     hp_packet_t packet;
     memset(&packet, 0, sizeof(packet));
     // Specify the size of the message inside the packet
-    packet.header.message_size = snprintf((char *)packet.message, HP_MESSAGE_MAX_SIZE, "Welcome client#%d\r\n", i);
+    packet.header.message_size = snprintf((char *)packet.message, HP_MESSAGE_MAX_SIZE, "Welcome client#%u\r\n", client->table_slot);
     server_queue_send_packet(svr, &packet);
     return 0;
 }
 
-int client_disconnected_callback(hserver_t* svr, int i)
+int client_disconnected_callback(hserver_t* svr, endpoint_t* client)
 {
-    printf("Info, client disconnected.\n");
+    printf("Info, client disconnected from shard %u.\n", svr->shard_id);
     return 0;
 }
 
@@ -52,6 +57,11 @@ void handle_signal_action(int sig_number)
   {
     printf("SIGPIPE was caught!\n");
   }
+  else if (sig_number == SIGUSR1)
+  {
+    // kill -USR1 switches verbose logging on and off while running
+    hlog_set_level(hlog_level == HLOG_LEVEL_VERBOSE ? HLOG_LEVEL_INFO : HLOG_LEVEL_VERBOSE);
+  }
 }
 
 int setup_signals()
@@ -68,6 +78,11 @@ int setup_signals()
     perror("sigaction()");
     return -1;
   }
+  if (sigaction(SIGUSR1, &sa, 0) != 0)
+  {
+    perror("sigaction()");
+    return -1;
+  }
   
   return 0;
 }
@@ -75,7 +90,22 @@ int setup_signals()
 int main(int argc, char **argv)
 {
     setup_signals();
+    // HCOMM_LOG_LEVEL=error, info or verbose
+    hlog_set_level(hlog_level_from_str(getenv("HCOMM_LOG_LEVEL")));
+    // Optional event backend: select, epoll or uring, the number of reactor threads, then a unix
+    // socket path to listen on instead of the port
     hserver_t svr = {.listen_port = 31000,
+                     .max_clients = 10,
+                     .event_backend = event_backend_from_str(argc > 1 ? argv[1] : NULL),
+                     .shard_count = argc > 2 ? atoi(argv[2]) : 0,
+                     .pin_shards = true,
+                     .unix_path = argc > 3 ? argv[3] : NULL,
+                     // Local clients asking for it talk over shared memory rings
+                     .shared_memory = true,
+                     // Prometheus scrapes http://127.0.0.1:31080/metrics
+                     .metrics_port = 31080,
+                     // Stop reading from clients that don't collect their replies
+                     .throttle_reads = true,
                      .client_connected_callback = client_connected_callback,
                      .client_disconnected_callback = client_disconnected_callback};
 
@@ -84,9 +114,21 @@ int main(int argc, char **argv)
         printf("Error, cannot initialize server on port: %d\n", svr.listen_port);
         exit(EXIT_FAILURE);
     }
+    if (svr.shard_count > 0)
+    {
+        if (server_start(&svr) < 0)
+        {
+            printf("Error, cannot start %u server shards\n", svr.shard_count);
+            exit(EXIT_FAILURE);
+        }
+        // The shards do all the work until SIGINT
+        while (true)
+            pause();
+    }
     while (true)
     {
-        server_periodic(&svr);
+        // Block until there is something to do
+        server_poll(&svr, -1);
     }
     return 0;
 }
@@ -0,0 +1,160 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hcomm.h"
+
+/*
+ * Connection table.
+ *
+ * Endpoints live in fixed size slabs so their addresses never move while the table grows. Free slots
+ * are kept on a stack, live ones in a dense array with every endpoint remembering its position, which
+ * makes insert, remove and both lookups O(1) and lets iteration skip idle capacity entirely.
+ */
+
+static endpoint_t *conn_table_slot(conn_table_t *table, uint32_t slot)
+{
+    return &table->slabs[slot / CONN_TABLE_SLAB_SIZE][slot % CONN_TABLE_SLAB_SIZE];
+}
+
+static int conn_table_grow(conn_table_t *table)
+{
+    if (table->capacity >= table->max_connections)
+        return -1;
+
+    uint32_t slab_count = table->capacity / CONN_TABLE_SLAB_SIZE + 1;
+    endpoint_t **slabs = realloc(table->slabs, slab_count * sizeof(endpoint_t *));
+    if (slabs == NULL)
+        return -1;
+    table->slabs = slabs;
+    slabs[slab_count - 1] = calloc(CONN_TABLE_SLAB_SIZE, sizeof(endpoint_t));
+    if (slabs[slab_count - 1] == NULL)
+        return -1;
+
+    uint32_t capacity = table->capacity + CONN_TABLE_SLAB_SIZE;
+    uint32_t *free_slots = realloc(table->free_slots, capacity * sizeof(uint32_t));
+    endpoint_t **live = realloc(table->live, capacity * sizeof(endpoint_t *));
+    if (free_slots != NULL)
+        table->free_slots = free_slots;
+    if (live != NULL)
+        table->live = live;
+    if (free_slots == NULL || live == NULL)
+    {
+        free(slabs[slab_count - 1]);
+        return -1;
+    }
+
+    // Push in reverse so the lowest slot is handed out first
+    for (uint32_t slot = capacity; slot-- > table->capacity;)
+    {
+        endpoint_t *endpoint = conn_table_slot(table, slot);
+        endpoint->socket = NO_SOCKET;
+        endpoint->table_slot = slot;
+        endpoint->live_index = -1;
+        table->free_slots[table->free_count++] = slot;
+    }
+    table->capacity = capacity;
+    return 0;
+}
+
+static int conn_table_map_fd(conn_table_t *table, int fd, endpoint_t *endpoint)
+{
+    if (fd < 0)
+        return -1;
+    if (fd >= table->fd_map_size)
+    {
+        int size = table->fd_map_size ? table->fd_map_size : 256;
+        while (size <= fd)
+            size *= 2;
+        endpoint_t **by_fd = realloc(table->by_fd, size * sizeof(endpoint_t *));
+        if (by_fd == NULL)
+            return -1;
+        memset(by_fd + table->fd_map_size, 0, (size - table->fd_map_size) * sizeof(endpoint_t *));
+        table->by_fd = by_fd;
+        table->fd_map_size = size;
+    }
+    table->by_fd[fd] = endpoint;
+    return 0;
+}
+
+int conn_table_init(conn_table_t *table, uint32_t max_connections)
+{
+    memset(table, 0, sizeof(*table));
+    table->max_connections = max_connections;
+    return 0;
+}
+
+void conn_table_destroy(conn_table_t *table)
+{
+    uint32_t slab_count = table->capacity / CONN_TABLE_SLAB_SIZE;
+    for (uint32_t i = 0; i < slab_count; ++i)
+        free(table->slabs[i]);
+    free(table->slabs);
+    free(table->free_slots);
+    free(table->live);
+    free(table->by_fd);
+    memset(table, 0, sizeof(*table));
+}
+
+/* Take a free slot for socket fd, returns NULL once max_connections are live. */
+endpoint_t *conn_table_insert(conn_table_t *table, int fd)
+{
+    if (table->live_count >= table->max_connections)
+        return NULL;
+    if (table->free_count == 0 && conn_table_grow(table) != 0)
+        return NULL;
+
+    uint32_t slot = table->free_slots[table->free_count - 1];
+    endpoint_t *endpoint = conn_table_slot(table, slot);
+    if (conn_table_map_fd(table, fd, endpoint) != 0)
+        return NULL;
+    table->free_count--;
+
+    // Reset everything but the slot bookkeeping, the generation makes stale ids miss
+    uint32_t generation = (endpoint->generation + 1) & 0xffffff;
+    memset(endpoint, 0, sizeof(*endpoint));
+    endpoint->table_slot = slot;
+    endpoint->generation = generation ? generation : 1;
+    endpoint->id = table->id_tag | ((conn_id_t)endpoint->generation << 32) | slot;
+    endpoint->socket = fd;
+    endpoint->live_index = (int32_t)table->live_count;
+    table->live[table->live_count++] = endpoint;
+    return endpoint;
+}
+
+/* Give the slot back, call before the endpoint socket is closed so the fd mapping can be dropped. */
+void conn_table_remove(conn_table_t *table, endpoint_t *endpoint)
+{
+    if (endpoint->live_index < 0)
+        return;
+
+    if (endpoint->socket >= 0 && endpoint->socket < table->fd_map_size && table->by_fd[endpoint->socket] == endpoint)
+        table->by_fd[endpoint->socket] = NULL;
+
+    // Swap the last live endpoint into the hole
+    endpoint_t *last = table->live[--table->live_count];
+    table->live[endpoint->live_index] = last;
+    last->live_index = endpoint->live_index;
+    endpoint->live_index = -1;
+
+    table->free_slots[table->free_count++] = endpoint->table_slot;
+}
+
+endpoint_t *conn_table_find_fd(conn_table_t *table, int fd)
+{
+    if (fd < 0 || fd >= table->fd_map_size)
+        return NULL;
+    return table->by_fd[fd];
+}
+
+endpoint_t *conn_table_find_id(conn_table_t *table, conn_id_t id)
+{
+    uint32_t slot = (uint32_t)id;
+    if (slot >= table->capacity)
+        return NULL;
+    endpoint_t *endpoint = conn_table_slot(table, slot);
+    if (endpoint->live_index < 0 || endpoint->id != id)
+        return NULL;
+    return endpoint;
+}
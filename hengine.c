@@ -0,0 +1,250 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hcomm.h"
+
+/*
+ * Client engine.
+ *
+ * Drives any number of outbound connections from one event loop. Connections are grouped into pools,
+ * one per destination, each connecting, reconnecting after a delay and counting its outstanding
+ * requests on its own, and the pool routes every send to one of its connected members.
+ */
+
+static int client_conn_connect(hclient_conn_t *conn);
+
+static void client_conn_disconnect(hclient_conn_t *conn)
+{
+  hclient_pool_t *pool = conn->pool;
+  connection_state_t prev_connection_state = conn->connection_state;
+  delete_endpoint(&conn->endpoint);
+  conn->connection_state = CONNECTION_STATE_DISCONNECTED;
+  conn->outstanding = 0;
+  if (prev_connection_state == CONNECTION_STATE_CONNECTED)
+  {
+    pool->connected_count--;
+    if (pool->disconnected_callback)
+      pool->disconnected_callback(conn);
+  }
+  uint32_t delay_ms = pool->reconnect_delay_ms ? pool->reconnect_delay_ms : CLIENT_DEFAULT_RECONNECT_DELAY_MS;
+  htimer_add(&pool->engine->loop.timers, &conn->reconnect_timer, delay_ms, 0);
+}
+
+static int client_conn_reconnect(htimer_t *timer)
+{
+  hclient_conn_t *conn = timer->data;
+  if (conn->connection_state == CONNECTION_STATE_DISCONNECTED)
+    client_conn_connect(conn);
+  return 0;
+}
+
+/* Count the replies before the pool sees the packet. */
+static int client_conn_packet_received(endpoint_t *peer, hp_packet_t *packet)
+{
+  hclient_conn_t *conn = (hclient_conn_t *)peer;
+  if (packet->header.message_type == HP_MSG_REPLY && conn->outstanding > 0)
+    conn->outstanding--;
+  if (conn->pool->packet_received_callback)
+    return conn->pool->packet_received_callback(peer, packet);
+  return 0;
+}
+
+static int client_conn_connect(hclient_conn_t *conn)
+{
+  hclient_pool_t *pool = conn->pool;
+  create_endpoint(&conn->endpoint);
+  conn->endpoint.packet_received_callback = client_conn_packet_received;
+  if (pool->measure_rtt)
+    endpoint_measure_rtt(&conn->endpoint, true);
+  endpoint_set_watermarks(&conn->endpoint, pool->send_high_watermark, pool->send_low_watermark, false);
+  endpoint_set_compression(&conn->endpoint, pool->compress, pool->compress_threshold, pool->compress_dict);
+  conn->endpoint.profile = pool->socket_profile;
+  conn->endpoint.shared_memory = pool->shared_memory;
+  if (client_open_endpoint(&conn->endpoint, pool->server_address, pool->server_port) < 0)
+  {
+    client_conn_disconnect(conn);
+    return -1;
+  }
+  conn->connection_state = CONNECTION_STATE_INPROGRESS;
+
+  // Wait for the socket to become writable, client_conn_finish_connect() completes it
+  if (event_loop_add(&pool->engine->loop, conn->endpoint.socket, HEVENT_WRITE, &conn->endpoint) != 0)
+  {
+    client_conn_disconnect(conn);
+    return -1;
+  }
+  conn->endpoint.loop = &pool->engine->loop;
+  conn->endpoint.registered_events = HEVENT_WRITE;
+  return 0;
+}
+
+static int client_conn_finish_connect(hclient_conn_t *conn)
+{
+  hclient_pool_t *pool = conn->pool;
+  if (client_check_endpoint(&conn->endpoint) < 0)
+  {
+    client_conn_disconnect(conn);
+    return -1;
+  }
+  HLOG_VERBOSE("Info, Connected to %s:%d.\n", pool->server_address, pool->server_port);
+  conn->connection_state = CONNECTION_STATE_CONNECTED;
+  pool->connected_count++;
+  if (pool->connected_callback)
+    pool->connected_callback(conn);
+  // From now on read interest is permanent and write interest follows the send queue
+  return endpoint_update_events(&conn->endpoint);
+}
+
+int client_engine_init(hclient_engine_t *engine)
+{
+  engine->pools = NULL;
+  engine->pool_count = 0;
+  return event_loop_init(&engine->loop, engine->event_backend);
+}
+
+void client_engine_close(hclient_engine_t *engine)
+{
+  for (uint32_t p = 0; p < engine->pool_count; ++p)
+  {
+    hclient_pool_t *pool = engine->pools[p];
+    for (uint32_t i = 0; i < pool->size; ++i)
+    {
+      hclient_conn_t *conn = &pool->conns[i];
+      htimer_cancel(&engine->loop.timers, &conn->reconnect_timer);
+      if (conn->connection_state != CONNECTION_STATE_DISCONNECTED)
+        delete_endpoint(&conn->endpoint);
+    }
+    free(pool->conns);
+    pool->conns = NULL;
+    pool->connected_count = 0;
+  }
+  free(engine->pools);
+  engine->pools = NULL;
+  engine->pool_count = 0;
+  event_loop_close(&engine->loop);
+}
+
+/* Open pool->size connections to the pool destination, the pool must outlive the engine. */
+int client_engine_add_pool(hclient_engine_t *engine, hclient_pool_t *pool)
+{
+  if (pool->size == 0)
+    return -1;
+  hclient_pool_t **pools = realloc(engine->pools, (engine->pool_count + 1) * sizeof(hclient_pool_t *));
+  if (pools == NULL)
+    return -1;
+  engine->pools = pools;
+  pool->conns = calloc(pool->size, sizeof(hclient_conn_t));
+  if (pool->conns == NULL)
+    return -1;
+  engine->pools[engine->pool_count++] = pool;
+  pool->engine = engine;
+  pool->connected_count = 0;
+  pool->next = 0;
+
+  for (uint32_t i = 0; i < pool->size; ++i)
+  {
+    hclient_conn_t *conn = &pool->conns[i];
+    conn->endpoint.socket = NO_SOCKET;
+    conn->pool = pool;
+    htimer_init(&conn->reconnect_timer, client_conn_reconnect, conn);
+    client_conn_connect(conn);
+  }
+  return 0;
+}
+
+/* Wait up to timeout_ms for events on every connection (-1 blocks) and service them. */
+int client_engine_poll(hclient_engine_t *engine, int timeout_ms)
+{
+  int count = event_loop_wait(&engine->loop, timeout_ms);
+  if (count < 0)
+    return -1;
+
+  for (int n = 0; n < count; ++n)
+  {
+    hevent_t ev = engine->loop.events[n];
+    hclient_conn_t *conn = ev.data;
+    // Closed by an earlier event of this batch
+    if (conn->connection_state == CONNECTION_STATE_DISCONNECTED)
+      continue;
+    if (conn->connection_state == CONNECTION_STATE_INPROGRESS)
+    {
+      if (client_conn_finish_connect(conn) != 0)
+        continue;
+      // Flush whatever the connected callback queued
+      ev.events |= HEVENT_WRITE;
+    }
+    if (endpoint_handle_event(&conn->endpoint, &ev) < 0)
+      client_conn_disconnect(conn);
+  }
+  return count;
+}
+
+/* Requests a connection has outstanding, plain CMDs and pipelined calls alike. */
+static uint32_t client_conn_load(hclient_conn_t *conn)
+{
+  return conn->outstanding + conn->endpoint.rpc_in_flight;
+}
+
+/* Connected member of the pool the next request should go to, NULL while none is connected and
+   writable. Unwritable members are passed over until their send queue drained. */
+hclient_conn_t *client_pool_route(hclient_pool_t *pool)
+{
+  if (pool->connected_count == 0)
+    return NULL;
+
+  hclient_conn_t *best = NULL;
+  for (uint32_t i = 0; i < pool->size; ++i)
+  {
+    uint32_t index = (pool->next + i) % pool->size;
+    hclient_conn_t *conn = &pool->conns[index];
+    if (conn->connection_state != CONNECTION_STATE_CONNECTED || conn->endpoint.unwritable)
+      continue;
+    if (pool->route == HCLIENT_ROUTE_ROUND_ROBIN)
+    {
+      best = conn;
+      break;
+    }
+    if (best == NULL || client_conn_load(conn) < client_conn_load(best))
+    {
+      best = conn;
+      if (client_conn_load(best) == 0)
+        break;
+    }
+  }
+  if (best != NULL)
+    pool->next = (best - pool->conns + 1) % pool->size;
+  return best;
+}
+
+/* Queue packet on the connection the pool routes it to, returns that connection or NULL. */
+hclient_conn_t *client_pool_send(hclient_pool_t *pool, hp_packet_t *packet)
+{
+  hclient_conn_t *conn = client_pool_route(pool);
+  if (conn == NULL)
+    return NULL;
+  if (endpoint_queue_send(&conn->endpoint, packet) != 0)
+  {
+    HLOG_ERROR("Error, Send queue of %s is at its limit, we lost this packet!\n", get_endpoint_address_str(&conn->endpoint));
+    return NULL;
+  }
+  if (packet->header.message_type == HP_MSG_CMD)
+    conn->outstanding++;
+  return conn;
+}
+
+/* Send message as a request on the connection the pool routes it to, see endpoint_rpc_call(). Returns
+   that connection or NULL, callback is only ever called when a connection was returned. */
+hclient_conn_t *client_pool_call(hclient_pool_t *pool, const void *message, uint32_t length, uint32_t timeout_ms, rpc_response_callback_t callback, void *user_data)
+{
+  hclient_conn_t *conn = client_pool_route(pool);
+  if (conn == NULL)
+    return NULL;
+  if (endpoint_rpc_call(&conn->endpoint, message, length, timeout_ms, callback, user_data) != 0)
+  {
+    HLOG_ERROR("Error, Send queue of %s is at its limit, we lost this request!\n", get_endpoint_address_str(&conn->endpoint));
+    return NULL;
+  }
+  return conn;
+}
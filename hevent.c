@@ -0,0 +1,419 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "hcomm.h"
+
+/* select() fallback backend ------------------------------------------------ */
+
+static int select_backend_init(hevent_loop_t *loop)
+{
+    loop->select_data = calloc(FD_SETSIZE, sizeof(void *));
+    loop->select_events = calloc(FD_SETSIZE, sizeof(uint8_t));
+    if (loop->select_data == NULL || loop->select_events == NULL)
+    {
+        free(loop->select_data);
+        free(loop->select_events);
+        loop->select_data = NULL;
+        loop->select_events = NULL;
+        return -1;
+    }
+    loop->select_max_fd = -1;
+    return 0;
+}
+
+static int select_backend_set(hevent_loop_t *loop, int fd, uint32_t events, void *data)
+{
+    if (fd < 0 || fd >= FD_SETSIZE)
+    {
+        HLOG_ERROR("Error, fd %d does not fit into select() FD_SETSIZE %d\n", fd, FD_SETSIZE);
+        return -1;
+    }
+    loop->select_data[fd] = data;
+    loop->select_events[fd] = (uint8_t)(events | HEVENT_REGISTERED);
+    if (fd > loop->select_max_fd)
+        loop->select_max_fd = fd;
+    return 0;
+}
+
+static int select_backend_remove(hevent_loop_t *loop, int fd)
+{
+    if (fd < 0 || fd >= FD_SETSIZE)
+        return -1;
+    loop->select_data[fd] = NULL;
+    loop->select_events[fd] = 0;
+    while (loop->select_max_fd >= 0 && loop->select_events[loop->select_max_fd] == 0)
+        loop->select_max_fd--;
+    return 0;
+}
+
+static int select_backend_wait(hevent_loop_t *loop, int timeout_ms)
+{
+    fd_set read_fds;
+    fd_set write_fds;
+    fd_set error_fds;
+    FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
+    FD_ZERO(&error_fds);
+
+    for (int fd = 0; fd <= loop->select_max_fd; ++fd)
+    {
+        uint8_t events = loop->select_events[fd];
+        if (events == 0)
+            continue;
+        if (events & (HEVENT_READ | HEVENT_ACCEPT))
+            FD_SET(fd, &read_fds);
+        if (events & HEVENT_WRITE)
+            FD_SET(fd, &write_fds);
+        FD_SET(fd, &error_fds);
+    }
+
+    struct timeval select_timeout = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+    int result = select(loop->select_max_fd + 1, &read_fds, &write_fds, &error_fds, timeout_ms < 0 ? NULL : &select_timeout);
+    if (result < 0)
+    {
+        if (errno == EINTR)
+            return 0;
+        HLOG_ERROR("Error, select failed: %d\n", errno);
+        return -1;
+    }
+
+    int count = 0;
+    for (int fd = 0; fd <= loop->select_max_fd && result > 0 && count < HEVENT_MAX_EVENTS; ++fd)
+    {
+        uint32_t events = 0;
+        if (FD_ISSET(fd, &read_fds))
+            events |= HEVENT_READ;
+        if (FD_ISSET(fd, &write_fds))
+            events |= HEVENT_WRITE;
+        if (FD_ISSET(fd, &error_fds))
+            events |= HEVENT_ERROR;
+        if (events == 0)
+            continue;
+        result--;
+        memset(&loop->events[count], 0, sizeof(hevent_t));
+        loop->events[count].fd = fd;
+        loop->events[count].events = events;
+        loop->events[count].data = loop->select_data[fd];
+        count++;
+    }
+    return count;
+}
+
+/* epoll backend ------------------------------------------------------------ */
+
+#ifdef __linux__
+static uint32_t epoll_events_from(uint32_t events)
+{
+    // Edge-triggered: callers drain the socket until EAGAIN on every wakeup.
+    uint32_t epoll_events = EPOLLET | EPOLLRDHUP;
+    if (events & (HEVENT_READ | HEVENT_ACCEPT))
+        epoll_events |= EPOLLIN;
+    if (events & HEVENT_WRITE)
+        epoll_events |= EPOLLOUT;
+    return epoll_events;
+}
+
+static int epoll_backend_ctl(hevent_loop_t *loop, int op, int fd, uint32_t events, void *data)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = epoll_events_from(events);
+    ev.data.ptr = data;
+    if (epoll_ctl(loop->epoll_fd, op, fd, &ev) != 0)
+    {
+        HLOG_ERROR("Error, epoll_ctl op %d fd %d failed: %d\n", op, fd, errno);
+        return -1;
+    }
+    return 0;
+}
+
+static int epoll_backend_wait(hevent_loop_t *loop, int timeout_ms)
+{
+    struct epoll_event epoll_events[HEVENT_MAX_EVENTS];
+    int result = epoll_wait(loop->epoll_fd, epoll_events, HEVENT_MAX_EVENTS, timeout_ms);
+    if (result < 0)
+    {
+        if (errno == EINTR)
+            return 0;
+        HLOG_ERROR("Error, epoll_wait failed: %d\n", errno);
+        return -1;
+    }
+
+    for (int i = 0; i < result; ++i)
+    {
+        uint32_t events = 0;
+        // A hang up is reported as readable so the pending data and the zero read are still consumed.
+        if (epoll_events[i].events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP))
+            events |= HEVENT_READ;
+        if (epoll_events[i].events & EPOLLOUT)
+            events |= HEVENT_WRITE;
+        if (epoll_events[i].events & EPOLLERR)
+            events |= HEVENT_ERROR;
+        memset(&loop->events[i], 0, sizeof(hevent_t));
+        loop->events[i].fd = -1;
+        loop->events[i].events = events;
+        loop->events[i].data = epoll_events[i].data.ptr;
+    }
+    return result;
+}
+#endif
+
+/* wakeup ------------------------------------------------------------------- */
+
+static int event_loop_init_wake(hevent_loop_t *loop)
+{
+#ifdef __linux__
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    loop->wake_write_fd = loop->wake_fd;
+    if (loop->wake_fd < 0)
+#else
+    int fds[2];
+    if (pipe(fds) != 0 || fcntl(fds[0], F_SETFL, O_NONBLOCK) != 0 || fcntl(fds[1], F_SETFL, O_NONBLOCK) != 0)
+#endif
+    {
+        HLOG_ERROR("Error, creating the loop wakeup descriptor failed: %d\n", errno);
+        return -1;
+    }
+#ifndef __linux__
+    loop->wake_fd = fds[0];
+    loop->wake_write_fd = fds[1];
+#endif
+    // The loop itself is the data of its wakeup, event_loop_wait() swallows those events
+    return event_loop_add(loop, loop->wake_fd, HEVENT_READ | HEVENT_POLL, loop);
+}
+
+static void event_loop_drain_wake(hevent_loop_t *loop)
+{
+    uint8_t buffer[64];
+    while (read(loop->wake_fd, buffer, sizeof(buffer)) > 0)
+        ;
+}
+
+/* Interrupt a blocking event_loop_wait(), safe to call from any thread. */
+int event_loop_wake(hevent_loop_t *loop)
+{
+    uint64_t one = 1;
+    ssize_t result = write(loop->wake_write_fd, &one, loop->wake_write_fd == loop->wake_fd ? sizeof(one) : 1);
+    // A full pipe or counter already means a wakeup is pending
+    if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        return -1;
+    return 0;
+}
+
+/* Wait-free push, the exchange orders producers and the consumer follows the next links. */
+void hmpsc_init(hmpsc_queue_t *queue)
+{
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+void hmpsc_push(hmpsc_queue_t *queue, hmpsc_node_t *node)
+{
+    __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+    hmpsc_node_t *prev = __atomic_exchange_n(&queue->head, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+/* Oldest node or NULL, also NULL while a producer is halfway through its push. */
+hmpsc_node_t *hmpsc_pop(hmpsc_queue_t *queue)
+{
+    hmpsc_node_t *tail = queue->tail;
+    hmpsc_node_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &queue->stub)
+    {
+        if (next == NULL)
+            return NULL;
+        queue->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL)
+    {
+        queue->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
+        return NULL;
+    // Last node, put the stub behind it so it can be handed out
+    hmpsc_push(queue, &queue->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL)
+    {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/* public interface --------------------------------------------------------- */
+
+int event_loop_init(hevent_loop_t *loop, hevent_backend_t backend)
+{
+    memset(loop, 0, sizeof(*loop));
+    loop->epoll_fd = NO_SOCKET;
+    loop->wake_fd = NO_SOCKET;
+    loop->wake_write_fd = NO_SOCKET;
+    htimer_wheel_init(&loop->timers, htimer_now_ms());
+
+    if (backend == HEVENT_BACKEND_DEFAULT)
+    {
+#ifdef __linux__
+        backend = HEVENT_BACKEND_EPOLL;
+#else
+        backend = HEVENT_BACKEND_SELECT;
+#endif
+    }
+    loop->backend = backend;
+
+    int result = -1;
+    switch (backend)
+    {
+    case HEVENT_BACKEND_EPOLL:
+#ifdef __linux__
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epoll_fd < 0)
+        {
+            HLOG_ERROR("Error, epoll_create1 failed: %d\n", errno);
+            return -1;
+        }
+        result = 0;
+#endif
+        break;
+    case HEVENT_BACKEND_SELECT:
+        result = select_backend_init(loop);
+        break;
+    case HEVENT_BACKEND_URING:
+        result = uring_init(loop);
+        break;
+    default:
+        break;
+    }
+    if (result != 0)
+        return result;
+    if (event_loop_init_wake(loop) != 0)
+    {
+        event_loop_close(loop);
+        return -1;
+    }
+    return 0;
+}
+
+void event_loop_close(hevent_loop_t *loop)
+{
+    if (loop->wake_write_fd != NO_SOCKET && loop->wake_write_fd != loop->wake_fd)
+        close(loop->wake_write_fd);
+    if (loop->wake_fd != NO_SOCKET)
+        close(loop->wake_fd);
+    loop->wake_fd = NO_SOCKET;
+    loop->wake_write_fd = NO_SOCKET;
+    if (loop->epoll_fd != NO_SOCKET)
+        close(loop->epoll_fd);
+    loop->epoll_fd = NO_SOCKET;
+    uring_close(loop);
+    free(loop->select_data);
+    free(loop->select_events);
+    loop->select_data = NULL;
+    loop->select_events = NULL;
+}
+
+int event_loop_add(hevent_loop_t *loop, int fd, uint32_t events, void *data)
+{
+    if (loop->backend == HEVENT_BACKEND_URING)
+        return uring_set(loop, fd, events, data);
+#ifdef __linux__
+    if (loop->backend == HEVENT_BACKEND_EPOLL)
+        return epoll_backend_ctl(loop, EPOLL_CTL_ADD, fd, events, data);
+#endif
+    return select_backend_set(loop, fd, events, data);
+}
+
+int event_loop_modify(hevent_loop_t *loop, int fd, uint32_t events, void *data)
+{
+    if (loop->backend == HEVENT_BACKEND_URING)
+        return uring_set(loop, fd, events, data);
+#ifdef __linux__
+    if (loop->backend == HEVENT_BACKEND_EPOLL)
+        return epoll_backend_ctl(loop, EPOLL_CTL_MOD, fd, events, data);
+#endif
+    return select_backend_set(loop, fd, events, data);
+}
+
+int event_loop_remove(hevent_loop_t *loop, int fd)
+{
+    if (loop->backend == HEVENT_BACKEND_URING)
+        return uring_remove(loop, fd);
+#ifdef __linux__
+    if (loop->backend == HEVENT_BACKEND_EPOLL)
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        return epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+    }
+#endif
+    return select_backend_remove(loop, fd);
+}
+
+/* Wait up to timeout_ms (-1 blocks forever, 0 polls) and fill loop->events.
+   Due timers run first and the wait never outlasts the next one. A wakeup returns early, possibly
+   with no events. */
+int event_loop_wait(hevent_loop_t *loop, int timeout_ms)
+{
+    if (loop->timers.count > 0)
+    {
+        htimer_advance(&loop->timers, htimer_now_ms());
+        int timer_ms = htimer_next_timeout(&loop->timers);
+        if (timer_ms >= 0 && (timeout_ms < 0 || timer_ms < timeout_ms))
+            timeout_ms = timer_ms;
+    }
+
+    int count;
+    if (loop->backend == HEVENT_BACKEND_URING)
+        count = uring_wait(loop, timeout_ms);
+#ifdef __linux__
+    else if (loop->backend == HEVENT_BACKEND_EPOLL)
+        count = epoll_backend_wait(loop, timeout_ms);
+#endif
+    else
+        count = select_backend_wait(loop, timeout_ms);
+
+    // Swallow the wakeups
+    int kept = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        if (loop->events[i].data == loop)
+        {
+            event_loop_drain_wake(loop);
+            continue;
+        }
+        if (kept != i)
+            loop->events[kept] = loop->events[i];
+        kept++;
+    }
+    // Timers due while idle fire right away, with events pending they wait for the next call
+    if (count >= 0 && kept == 0 && loop->timers.count > 0)
+        htimer_advance(&loop->timers, htimer_now_ms());
+    return count < 0 ? count : kept;
+}
+
+hevent_backend_t event_backend_from_str(const char *name)
+{
+    if (name == NULL)
+        return HEVENT_BACKEND_DEFAULT;
+    if (strcmp(name, "select") == 0)
+        return HEVENT_BACKEND_SELECT;
+    if (strcmp(name, "epoll") == 0)
+        return HEVENT_BACKEND_EPOLL;
+    if (strcmp(name, "uring") == 0)
+        return HEVENT_BACKEND_URING;
+    return HEVENT_BACKEND_DEFAULT;
+}
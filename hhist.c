@@ -0,0 +1,127 @@
+#include <time.h>
+
+#include "hcomm.h"
+
+/*
+ * Log-linear latency histogram.
+ *
+ * Values below HHIST_SUB_BUCKETS get a bucket each, above that every power of two is split into
+ * HHIST_SUB_BUCKETS / 2 equal buckets, so any value is known to about 3% whatever its magnitude.
+ * The counts are a fixed array: recording is a couple of shifts and an increment, never an allocation.
+ */
+
+#define HHIST_HALF_BUCKETS          (HHIST_SUB_BUCKETS / 2)
+
+uint32_t hhist_now_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)((uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000);
+}
+
+static uint32_t hhist_index(uint32_t value)
+{
+    if (value < HHIST_SUB_BUCKETS)
+        return value;
+    int shift = 31 - __builtin_clz(value) - (HHIST_SUB_BUCKET_BITS - 1);
+    return HHIST_SUB_BUCKETS + (shift - 1) * HHIST_HALF_BUCKETS + ((value >> shift) - HHIST_HALF_BUCKETS);
+}
+
+/* Largest value counted in bucket index. */
+static uint32_t hhist_bucket_high(uint32_t index)
+{
+    if (index < HHIST_SUB_BUCKETS)
+        return index;
+    uint32_t shift = (index - HHIST_SUB_BUCKETS) / HHIST_HALF_BUCKETS + 1;
+    uint32_t base = (index - HHIST_SUB_BUCKETS) % HHIST_HALF_BUCKETS + HHIST_HALF_BUCKETS;
+    return (uint32_t)((((uint64_t)base + 1) << shift) - 1);
+}
+
+void hhist_reset(hhist_t *hist)
+{
+    memset(hist, 0, sizeof(*hist));
+    hist->min = UINT32_MAX;
+}
+
+void hhist_record(hhist_t *hist, uint32_t value)
+{
+    hist->counts[hhist_index(value)]++;
+    hist->count++;
+    hist->sum += value;
+    if (value < hist->min)
+        hist->min = value;
+    if (value > hist->max)
+        hist->max = value;
+}
+
+/* Add every value of src to dst, for totals over endpoints or threads. */
+void hhist_merge(hhist_t *dst, const hhist_t *src)
+{
+    for (int i = 0; i < HHIST_BUCKET_COUNT; ++i)
+        dst->counts[i] += src->counts[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+/* Value at or below which percentile (0 to 100) of the recorded values fall, 0 when empty. */
+uint32_t hhist_percentile(const hhist_t *hist, double percentile)
+{
+    if (hist->count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(percentile / 100.0 * hist->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank >= hist->count)
+        return hist->max;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HHIST_BUCKET_COUNT; ++i)
+    {
+        seen += hist->counts[i];
+        if (seen >= rank)
+        {
+            uint32_t value = hhist_bucket_high(i);
+            return value > hist->max ? hist->max : value;
+        }
+    }
+    return hist->max;
+}
+
+void hhist_summarize(const hhist_t *hist, hhist_summary_t *summary)
+{
+    summary->count = hist->count;
+    summary->min = hist->count ? hist->min : 0;
+    summary->mean = hist->count ? (uint32_t)(hist->sum / hist->count) : 0;
+    summary->p50 = hhist_percentile(hist, 50.0);
+    summary->p90 = hhist_percentile(hist, 90.0);
+    summary->p99 = hhist_percentile(hist, 99.0);
+    summary->p999 = hhist_percentile(hist, 99.9);
+    summary->max = hist->max;
+}
+
+/* Record value, a seqlock tells readers on other threads to copy again. */
+void hhist_shared_record(hhist_shared_t *shared, uint32_t value)
+{
+    uint32_t sequence = shared->sequence;
+    __atomic_store_n(&shared->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    hhist_record(&shared->hist, value);
+    __atomic_store_n(&shared->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/* Copy the histogram out consistently while its thread keeps recording. */
+void hhist_snapshot(const hhist_shared_t *shared, hhist_t *copy)
+{
+    uint32_t before, after;
+    do
+    {
+        before = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+        memcpy(copy, &shared->hist, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&shared->sequence, __ATOMIC_RELAXED);
+    } while ((before & 1) != 0 || before != after);
+}
@@ -0,0 +1,525 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hcomm.h"
+
+/*
+ * Asynchronous logger.
+ *
+ * Logging a line formats nothing: the record keeps the format pointer as its id, the timestamp and
+ * the raw arguments, found by walking the conversions of the format. Strings are copied in, as they
+ * may be gone by the time the line is printed. Every thread writes its records into a ring of its
+ * own, a single producer single consumer ring needing no lock, and a full ring drops the record
+ * rather than waiting.
+ *
+ * A background thread started with the first record drains the rings every HLOG_FLUSH_MS, merges
+ * them by timestamp and formats the lines to stdout. Records left behind when the process exits
+ * are flushed by an atexit() handler.
+ */
+
+#define HLOG_ALIGN(n)               (((n) + 7) & ~(size_t)7)
+
+typedef struct
+{
+    const char *format;                 /*!< NULL pads the rest of the ring, the record after it starts over. */
+    uint64_t time_ns;                   /*!< CLOCK_REALTIME. */
+    uint16_t length;                    /*!< Of the whole record, a multiple of 8. */
+    uint8_t level;
+    uint8_t arg_count;
+    uint16_t strings;                   /*!< Bytes of copied strings behind the arguments. */
+} hlog_record_t;
+
+typedef struct hlog_ring_t
+{
+    struct hlog_ring_t *next;           /*!< Rings of every logging thread, pushed at the head. */
+    uint32_t head;                      /*!< Producer, free running. */
+    uint32_t tail;                      /*!< Consumer, free running. */
+    uint32_t dropped;                   /*!< Records the producer found no room for. */
+    uint32_t dropped_seen;              /*!< Consumer, reported so far. */
+    bool retired;                       /*!< Its thread exited, freed once drained. */
+    uint8_t data[HLOG_RING_SIZE] __attribute__((aligned(8)));
+} hlog_ring_t;
+
+hlog_level_t hlog_level = HLOG_LEVEL_INFO;
+
+static hlog_ring_t *hlog_rings;
+static __thread hlog_ring_t *hlog_thread_ring;
+static pthread_key_t hlog_ring_key;
+static pthread_mutex_t hlog_start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t hlog_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool hlog_started;
+static bool hlog_closed;
+static bool hlog_stopping;
+static pthread_t hlog_thread;
+
+static void hlog_close(void);
+
+void hlog_set_level(hlog_level_t level)
+{
+    __atomic_store_n(&hlog_level, level, __ATOMIC_RELAXED);
+}
+
+hlog_level_t hlog_level_from_str(const char *name)
+{
+    if (name == NULL)
+        return HLOG_LEVEL_INFO;
+    if (strcmp(name, "error") == 0)
+        return HLOG_LEVEL_ERROR;
+    if (strcmp(name, "verbose") == 0)
+        return HLOG_LEVEL_VERBOSE;
+    return HLOG_LEVEL_INFO;
+}
+
+// parsing ----------------------------------------------------------------------
+
+typedef enum
+{
+    HLOG_ARG_NONE = 0,                  /*!< %% or a conversion not supported. */
+    HLOG_ARG_INT,
+    HLOG_ARG_LONG,
+    HLOG_ARG_LONG_LONG,
+    HLOG_ARG_SIZE,
+    HLOG_ARG_INTMAX,
+    HLOG_ARG_PTRDIFF,
+    HLOG_ARG_DOUBLE,
+    HLOG_ARG_POINTER,
+    HLOG_ARG_STRING
+} hlog_arg_t;
+
+/* One conversion of a format, from its '%' to its conversion character. */
+typedef struct
+{
+    const char *start;
+    size_t length;
+    int stars;                          /*!< Width and precision taken from int arguments. */
+    bool precision_star;                /*!< The last star is the precision. */
+    int precision;                      /*!< A literal precision, -1 without. */
+    hlog_arg_t type;
+} hlog_conversion_t;
+
+/* Parse the conversion at *format, which points at a '%'. */
+static void hlog_parse(const char **format, hlog_conversion_t *conversion)
+{
+    const char *p = *format + 1;
+    conversion->start = *format;
+    conversion->stars = 0;
+    conversion->precision_star = false;
+    conversion->precision = -1;
+    while (*p != '\0' && strchr("-+ #0", *p) != NULL)
+        p++;
+    if (*p == '*')
+    {
+        conversion->stars++;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9')
+        p++;
+    if (*p == '.')
+    {
+        p++;
+        if (*p == '*')
+        {
+            conversion->stars++;
+            conversion->precision_star = true;
+            p++;
+        }
+        else
+        {
+            conversion->precision = 0;
+            while (*p >= '0' && *p <= '9')
+                conversion->precision = conversion->precision * 10 + *p++ - '0';
+        }
+    }
+
+    hlog_arg_t integer = HLOG_ARG_INT;
+    if (p[0] == 'h')
+        p += p[1] == 'h' ? 2 : 1;
+    else if (p[0] == 'l' && p[1] == 'l')
+        integer = HLOG_ARG_LONG_LONG, p += 2;
+    else if (p[0] == 'l')
+        integer = HLOG_ARG_LONG, p++;
+    else if (p[0] == 'z')
+        integer = HLOG_ARG_SIZE, p++;
+    else if (p[0] == 'j')
+        integer = HLOG_ARG_INTMAX, p++;
+    else if (p[0] == 't')
+        integer = HLOG_ARG_PTRDIFF, p++;
+
+    switch (*p)
+    {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+        conversion->type = integer;
+        break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        conversion->type = HLOG_ARG_DOUBLE;
+        break;
+    case 'p':
+        conversion->type = HLOG_ARG_POINTER;
+        break;
+    case 's':
+        conversion->type = HLOG_ARG_STRING;
+        break;
+    default:
+        conversion->type = HLOG_ARG_NONE;
+        break;
+    }
+    if (*p != '\0')
+        p++;
+    conversion->length = p - conversion->start;
+    *format = p;
+}
+
+// producer ---------------------------------------------------------------------
+
+static void *hlog_main(void *arg);
+
+static void hlog_retire(void *arg)
+{
+    hlog_ring_t *ring = arg;
+    __atomic_store_n(&ring->retired, true, __ATOMIC_RELEASE);
+}
+
+/* A forked child inherits neither the thread nor the records of its parent, and of its threads only
+   the one that forked. */
+static void hlog_after_fork(void)
+{
+    hlog_started = false;
+    hlog_stopping = false;
+    for (hlog_ring_t *ring = hlog_rings; ring != NULL; ring = ring->next)
+    {
+        ring->tail = ring->head;
+        ring->retired = ring != hlog_thread_ring;
+    }
+    pthread_mutex_init(&hlog_start_lock, NULL);
+    pthread_mutex_init(&hlog_drain_lock, NULL);
+}
+
+/* Start the background thread once. */
+static void hlog_start(void)
+{
+    static bool registered = false;
+    pthread_mutex_lock(&hlog_start_lock);
+    if (!__atomic_load_n(&hlog_started, __ATOMIC_ACQUIRE) && !hlog_closed)
+    {
+        if (!registered)
+        {
+            pthread_key_create(&hlog_ring_key, hlog_retire);
+            pthread_atfork(NULL, NULL, hlog_after_fork);
+            atexit(hlog_close);
+            registered = true;
+        }
+        if (pthread_create(&hlog_thread, NULL, hlog_main, NULL) == 0)
+            __atomic_store_n(&hlog_started, true, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&hlog_start_lock);
+}
+
+static hlog_ring_t *hlog_ring(void)
+{
+    if (hlog_thread_ring != NULL)
+        return hlog_thread_ring;
+    hlog_ring_t *ring = calloc(1, sizeof(hlog_ring_t));
+    if (ring == NULL)
+        return NULL;
+    ring->next = __atomic_load_n(&hlog_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&hlog_rings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    pthread_setspecific(hlog_ring_key, ring);
+    hlog_thread_ring = ring;
+    return ring;
+}
+
+/* Room for length contiguous bytes at the head, padding the end of the ring when they don't fit
+   there. NULL when the ring is too full. */
+static uint8_t *hlog_reserve(hlog_ring_t *ring, size_t length)
+{
+    uint32_t head = ring->head;
+    uint32_t used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t offset = head & (HLOG_RING_SIZE - 1);
+    uint32_t contiguous = HLOG_RING_SIZE - offset;
+    if (contiguous < length)
+    {
+        if (HLOG_RING_SIZE - used < contiguous + length)
+            return NULL;
+        hlog_record_t *padding = (hlog_record_t *)(ring->data + offset);
+        padding->format = NULL;
+        head += contiguous;
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        return ring->data;
+    }
+    if (HLOG_RING_SIZE - used < length)
+        return NULL;
+    return ring->data + offset;
+}
+
+void hlog_write(hlog_level_t level, const char *format, ...)
+{
+    if (!__atomic_load_n(&hlog_started, __ATOMIC_ACQUIRE))
+        hlog_start();
+    hlog_ring_t *ring = hlog_ring();
+    if (ring == NULL)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t args[HLOG_MAX_ARGS];
+    char strings[HLOG_MAX_ARGS * HLOG_STRING_MAX];
+    size_t strings_length = 0;
+    int arg_count = 0;
+
+    va_list list;
+    va_start(list, format);
+    const char *p = format;
+    while ((p = strchr(p, '%')) != NULL && arg_count < HLOG_MAX_ARGS)
+    {
+        hlog_conversion_t conversion;
+        hlog_parse(&p, &conversion);
+        int precision = conversion.precision;
+        for (int i = 0; i < conversion.stars && arg_count < HLOG_MAX_ARGS; ++i)
+        {
+            int star = va_arg(list, int);
+            args[arg_count++] = star;
+            if (conversion.precision_star && i == conversion.stars - 1)
+                precision = star;
+        }
+        if (conversion.type == HLOG_ARG_NONE || arg_count == HLOG_MAX_ARGS)
+            continue;
+
+        uint64_t value = 0;
+        switch (conversion.type)
+        {
+        case HLOG_ARG_INT: value = va_arg(list, int); break;
+        case HLOG_ARG_LONG: value = va_arg(list, long); break;
+        case HLOG_ARG_LONG_LONG: value = va_arg(list, long long); break;
+        case HLOG_ARG_SIZE: value = va_arg(list, size_t); break;
+        case HLOG_ARG_INTMAX: value = va_arg(list, intmax_t); break;
+        case HLOG_ARG_PTRDIFF: value = va_arg(list, ptrdiff_t); break;
+        case HLOG_ARG_POINTER: value = (uintptr_t)va_arg(list, void *); break;
+        case HLOG_ARG_DOUBLE:
+        {
+            double d = va_arg(list, double);
+            memcpy(&value, &d, sizeof(value));
+            break;
+        }
+        case HLOG_ARG_STRING:
+        {
+            // Kept as the offset of a copy, cut at the precision and HLOG_STRING_MAX
+            const char *s = va_arg(list, const char *);
+            if (s == NULL)
+                s = "(null)";
+            size_t limit = precision >= 0 && precision < HLOG_STRING_MAX - 1 ? (size_t)precision : HLOG_STRING_MAX - 1;
+            size_t length = strnlen(s, limit);
+            value = strings_length;
+            memcpy(strings + strings_length, s, length);
+            strings[strings_length + length] = '\0';
+            strings_length += length + 1;
+            break;
+        }
+        default:
+            break;
+        }
+        args[arg_count++] = value;
+    }
+    va_end(list);
+
+    size_t length = HLOG_ALIGN(sizeof(hlog_record_t) + arg_count * sizeof(uint64_t) + strings_length);
+    uint8_t *data = hlog_reserve(ring, length);
+    if (data == NULL)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    hlog_record_t *record = (hlog_record_t *)data;
+    record->time_ns = (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+    record->format = format;
+    record->length = length;
+    record->level = level;
+    record->arg_count = arg_count;
+    record->strings = strings_length;
+    memcpy(data + sizeof(hlog_record_t), args, arg_count * sizeof(uint64_t));
+    memcpy(data + sizeof(hlog_record_t) + arg_count * sizeof(uint64_t), strings, strings_length);
+    __atomic_store_n(&ring->head, ring->head + length, __ATOMIC_RELEASE);
+}
+
+// consumer ---------------------------------------------------------------------
+
+/* The next record of ring, skipping padding, NULL while it is empty. */
+static hlog_record_t *hlog_peek(hlog_ring_t *ring)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    while (ring->tail != head)
+    {
+        uint32_t offset = ring->tail & (HLOG_RING_SIZE - 1);
+        hlog_record_t *record = (hlog_record_t *)(ring->data + offset);
+        if (record->format != NULL)
+            return record;
+        __atomic_store_n(&ring->tail, ring->tail + (HLOG_RING_SIZE - offset), __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/* Format record into line, the way printf() would have when it was logged. */
+static size_t hlog_format(const hlog_record_t *record, char *line, size_t capacity)
+{
+    const uint64_t *args = (const uint64_t *)(record + 1);
+    const char *strings = (const char *)(args + record->arg_count);
+    int arg = 0;
+    size_t length = 0;
+
+    time_t seconds = record->time_ns / 1000000000u;
+    struct tm tm;
+    localtime_r(&seconds, &tm);
+    length += strftime(line, capacity, "%H:%M:%S", &tm);
+    length += snprintf(line + length, capacity - length, ".%06u ", (unsigned)(record->time_ns % 1000000000u / 1000));
+
+    const char *p = record->format;
+    while (*p != '\0' && length < capacity - 1)
+    {
+        const char *percent = strchr(p, '%');
+        size_t literal = percent ? (size_t)(percent - p) : strlen(p);
+        if (literal > capacity - 1 - length)
+            literal = capacity - 1 - length;
+        memcpy(line + length, p, literal);
+        length += literal;
+        if (percent == NULL)
+            break;
+        p = percent;
+
+        hlog_conversion_t conversion;
+        hlog_parse(&p, &conversion);
+        // The stars are filled in, each conversion is then printed on its own
+        char spec[48];
+        size_t spec_length = 0;
+        for (size_t i = 0; i < conversion.length && spec_length < sizeof(spec) - 12; ++i)
+        {
+            if (conversion.start[i] == '*')
+                spec_length += snprintf(spec + spec_length, sizeof(spec) - spec_length, "%d", arg < record->arg_count ? (int)args[arg++] : 0);
+            else
+                spec[spec_length++] = conversion.start[i];
+        }
+        spec[spec_length] = '\0';
+        if (conversion.type != HLOG_ARG_NONE && arg >= record->arg_count)
+            break;
+
+        uint64_t value = conversion.type != HLOG_ARG_NONE ? args[arg++] : 0;
+        char *out = line + length;
+        size_t room = capacity - length;
+        int written = 0;
+        switch (conversion.type)
+        {
+        case HLOG_ARG_NONE: written = snprintf(out, room, "%s", strcmp(spec, "%%") == 0 ? "%" : ""); break;
+        case HLOG_ARG_INT: written = snprintf(out, room, spec, (int)value); break;
+        case HLOG_ARG_LONG: written = snprintf(out, room, spec, (long)value); break;
+        case HLOG_ARG_LONG_LONG: written = snprintf(out, room, spec, (long long)value); break;
+        case HLOG_ARG_SIZE: written = snprintf(out, room, spec, (size_t)value); break;
+        case HLOG_ARG_INTMAX: written = snprintf(out, room, spec, (intmax_t)value); break;
+        case HLOG_ARG_PTRDIFF: written = snprintf(out, room, spec, (ptrdiff_t)value); break;
+        case HLOG_ARG_POINTER: written = snprintf(out, room, spec, (void *)(uintptr_t)value); break;
+        case HLOG_ARG_STRING: written = snprintf(out, room, spec, strings + value); break;
+        case HLOG_ARG_DOUBLE:
+        {
+            double d;
+            memcpy(&d, &value, sizeof(d));
+            written = snprintf(out, room, spec, d);
+            break;
+        }
+        }
+        if (written > 0)
+            length += (size_t)written < room ? (size_t)written : room - 1;
+    }
+    if (length == 0 || line[length - 1] != '\n')
+    {
+        if (length >= capacity - 1)
+            length = capacity - 2;
+        line[length++] = '\n';
+    }
+    line[length] = '\0';
+    return length;
+}
+
+/* Print every record the rings hold, oldest first, and free the rings of exited threads. */
+static void hlog_drain(void)
+{
+    char line[1024];
+    pthread_mutex_lock(&hlog_drain_lock);
+    while (true)
+    {
+        hlog_ring_t *oldest = NULL;
+        hlog_record_t *oldest_record = NULL;
+        for (hlog_ring_t *ring = __atomic_load_n(&hlog_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+        {
+            hlog_record_t *record = hlog_peek(ring);
+            if (record != NULL && (oldest_record == NULL || record->time_ns < oldest_record->time_ns))
+            {
+                oldest = ring;
+                oldest_record = record;
+            }
+        }
+        if (oldest == NULL)
+            break;
+        size_t length = hlog_format(oldest_record, line, sizeof(line));
+        fwrite(line, 1, length, stdout);
+        __atomic_store_n(&oldest->tail, oldest->tail + oldest_record->length, __ATOMIC_RELEASE);
+    }
+
+    hlog_ring_t **link = &hlog_rings;
+    hlog_ring_t *ring;
+    while ((ring = __atomic_load_n(link, __ATOMIC_ACQUIRE)) != NULL)
+    {
+        uint32_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->dropped_seen)
+        {
+            fprintf(stdout, "Error, the log dropped %u records, its ring was full\n", dropped - ring->dropped_seen);
+            ring->dropped_seen = dropped;
+        }
+        if (!__atomic_load_n(&ring->retired, __ATOMIC_ACQUIRE) || ring->tail != __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+        {
+            link = &ring->next;
+            continue;
+        }
+        // Threads only ever push at the head, anywhere else the ring is unlinked plainly
+        if (link == &hlog_rings && !__atomic_compare_exchange_n(&hlog_rings, &ring, ring->next, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            continue;
+        if (link != &hlog_rings)
+            *link = ring->next;
+        free(ring);
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&hlog_drain_lock);
+}
+
+static void *hlog_main(void *arg)
+{
+    struct timespec interval = {0, HLOG_FLUSH_MS * 1000000L};
+    while (!__atomic_load_n(&hlog_stopping, __ATOMIC_ACQUIRE))
+    {
+        hlog_drain();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+/* Stop the background thread and print what is left, at exit. Records logged later stay unprinted. */
+static void hlog_close(void)
+{
+    pthread_mutex_lock(&hlog_start_lock);
+    hlog_closed = true;
+    if (__atomic_load_n(&hlog_started, __ATOMIC_ACQUIRE))
+    {
+        __atomic_store_n(&hlog_stopping, true, __ATOMIC_RELEASE);
+        pthread_join(hlog_thread, NULL);
+    }
+    pthread_mutex_unlock(&hlog_start_lock);
+    hlog_drain();
+}
+
+void hlog_flush(void)
+{
+    hlog_drain();
+}
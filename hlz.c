@@ -0,0 +1,201 @@
+#include "hcomm.h"
+
+/*
+ * LZ codec for short messages.
+ *
+ * A block is a run of sequences, each a token byte, literals and a match copied from up to 64 KB
+ * back: the token holds the literal count in its high nibble and the match length minus
+ * HLZ_MIN_MATCH in its low one, a nibble of 15 continues in bytes of 255 until a smaller one.
+ * The offset is two little endian bytes after the literals, the last sequence stops after its
+ * literals. Matches are found through a hash table of the last position of every 4 byte sequence.
+ *
+ * A dictionary is thought of as lying right before the input, so matches reach into it on both
+ * sides. Its hash table is built once, compressing starts from a copy of it.
+ */
+
+#define HLZ_HASH_SIZE               (1 << HLZ_HASH_BITS)
+#define HLZ_MIN_MATCH               (4)
+#define HLZ_WINDOW                  (0xffff)
+
+static uint32_t hlz_hash(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - HLZ_HASH_BITS);
+}
+
+/* Four bytes at pos of the dictionary followed by src. */
+static uint32_t hlz_read32(const uint8_t *dict, uint32_t dict_length, const uint8_t *src, uint32_t pos)
+{
+    uint32_t value;
+    if (pos >= dict_length)
+    {
+        memcpy(&value, src + pos - dict_length, sizeof(value));
+        return value;
+    }
+    uint8_t bytes[4];
+    for (int i = 0; i < 4; ++i, ++pos)
+        bytes[i] = pos < dict_length ? dict[pos] : src[pos - dict_length];
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+/* Prime the codec with length bytes of data, which must outlive dict. */
+int hlz_dict_init(hlz_dict_t *dict, const uint8_t *data, uint32_t length)
+{
+    if (length > HLZ_DICT_MAX_SIZE)
+        return -1;
+    dict->data = data;
+    dict->length = length;
+    memset(dict->table, 0, sizeof(dict->table));
+    for (uint32_t pos = 0; pos + HLZ_MIN_MATCH <= length; ++pos)
+        dict->table[hlz_hash(hlz_read32(data, length, NULL, pos))] = pos;
+    return 0;
+}
+
+/* Append a length of 15 or more, the nibble already holds 15. */
+static int hlz_put_length(uint8_t *dst, uint32_t capacity, uint32_t *out, uint32_t length)
+{
+    length -= 15;
+    while (length >= 255)
+    {
+        if (*out >= capacity)
+            return -1;
+        dst[(*out)++] = 255;
+        length -= 255;
+    }
+    if (*out >= capacity)
+        return -1;
+    dst[(*out)++] = length;
+    return 0;
+}
+
+/* Append one sequence, match_length 0 ends the block after the literals. */
+static int hlz_put_sequence(uint8_t *dst, uint32_t capacity, uint32_t *out, const uint8_t *literals, uint32_t literal_length, uint32_t offset, uint32_t match_length)
+{
+    uint32_t match_code = match_length ? match_length - HLZ_MIN_MATCH : 0;
+    if (*out >= capacity)
+        return -1;
+    dst[(*out)++] = (literal_length < 15 ? literal_length : 15) << 4 | (match_code < 15 ? match_code : 15);
+    if (literal_length >= 15 && hlz_put_length(dst, capacity, out, literal_length) != 0)
+        return -1;
+    if (capacity - *out < literal_length)
+        return -1;
+    memcpy(dst + *out, literals, literal_length);
+    *out += literal_length;
+    if (match_length == 0)
+        return 0;
+    if (capacity - *out < 2)
+        return -1;
+    dst[(*out)++] = offset & 0xff;
+    dst[(*out)++] = offset >> 8;
+    if (match_code >= 15 && hlz_put_length(dst, capacity, out, match_code) != 0)
+        return -1;
+    return 0;
+}
+
+/* Compress length bytes of src into dst, primed with dict unless it is NULL. Returns the compressed
+   length, or -1 when it doesn't fit into capacity or dictionary and input exceed the window. */
+int hlz_compress(const hlz_dict_t *dict, const uint8_t *src, uint32_t length, uint8_t *dst, uint32_t capacity)
+{
+    const uint8_t *dict_data = dict ? dict->data : NULL;
+    uint32_t dict_length = dict ? dict->length : 0;
+    if (dict_length + length > HLZ_WINDOW)
+        return -1;
+
+    uint16_t table[HLZ_HASH_SIZE];
+    if (dict != NULL)
+        memcpy(table, dict->table, sizeof(table));
+    else
+        memset(table, 0, sizeof(table));
+
+    // Positions count from the start of the dictionary
+    uint32_t end = dict_length + length;
+    uint32_t pos = dict_length;
+    uint32_t anchor = pos;
+    uint32_t out = 0;
+    while (pos + HLZ_MIN_MATCH <= end)
+    {
+        uint32_t sequence = hlz_read32(dict_data, dict_length, src, pos);
+        uint32_t hash = hlz_hash(sequence);
+        uint32_t candidate = table[hash];
+        table[hash] = pos;
+        if (candidate >= pos || hlz_read32(dict_data, dict_length, src, candidate) != sequence)
+        {
+            pos++;
+            continue;
+        }
+
+        uint32_t match_length = HLZ_MIN_MATCH;
+        while (pos + match_length < end)
+        {
+            uint32_t from = candidate + match_length;
+            uint8_t expected = from < dict_length ? dict_data[from] : src[from - dict_length];
+            if (src[pos + match_length - dict_length] != expected)
+                break;
+            match_length++;
+        }
+        if (hlz_put_sequence(dst, capacity, &out, src + anchor - dict_length, pos - anchor, pos - candidate, match_length) != 0)
+            return -1;
+        pos += match_length;
+        anchor = pos;
+    }
+    if (hlz_put_sequence(dst, capacity, &out, src + anchor - dict_length, end - anchor, 0, 0) != 0)
+        return -1;
+    return out;
+}
+
+/* Read a length continued past its nibble of 15. */
+static int hlz_get_length(const uint8_t *src, uint32_t length, uint32_t *in, uint32_t *value)
+{
+    uint8_t byte;
+    do
+    {
+        if (*in >= length)
+            return -1;
+        byte = src[(*in)++];
+        *value += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+/* Restore a block made by hlz_compress() with the same dict into dst. Returns the decompressed
+   length, or -1 for a malformed block or one that doesn't fit into capacity. */
+int hlz_decompress(const hlz_dict_t *dict, const uint8_t *src, uint32_t length, uint8_t *dst, uint32_t capacity)
+{
+    uint32_t dict_length = dict ? dict->length : 0;
+    uint32_t in = 0;
+    uint32_t out = 0;
+    while (in < length)
+    {
+        uint8_t token = src[in++];
+        uint32_t literal_length = token >> 4;
+        if (literal_length == 15 && hlz_get_length(src, length, &in, &literal_length) != 0)
+            return -1;
+        if (literal_length > length - in || literal_length > capacity - out)
+            return -1;
+        memcpy(dst + out, src + in, literal_length);
+        in += literal_length;
+        out += literal_length;
+        if (in == length)
+            break;
+
+        if (length - in < 2)
+            return -1;
+        uint32_t offset = src[in] | (uint32_t)src[in + 1] << 8;
+        in += 2;
+        uint32_t match_length = (token & 15) + HLZ_MIN_MATCH;
+        if ((token & 15) == 15 && hlz_get_length(src, length, &in, &match_length) != 0)
+            return -1;
+        if (offset == 0 || offset > out + dict_length || match_length > capacity - out)
+            return -1;
+        if (offset <= out && offset >= match_length)
+        {
+            memcpy(dst + out, dst + out - offset, match_length);
+            out += match_length;
+            continue;
+        }
+        // Byte by byte, the match overlaps its own output or starts in the dictionary
+        for (uint32_t i = 0; i < match_length; ++i, ++out)
+            dst[out] = offset > out ? dict->data[dict_length - (offset - out)] : dst[out - offset];
+    }
+    return out;
+}
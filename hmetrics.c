@@ -0,0 +1,279 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "hcomm.h"
+
+/*
+ * Metrics.
+ *
+ * Endpoints count their traffic into their own hp_stats_t and into the totals of their server,
+ * which also counts accepts, rejects and disconnects. Only the thread running a loop writes its
+ * counters, every update is a relaxed store of a plain add, so counting costs next to nothing and
+ * other threads may take snapshots whenever they like.
+ *
+ * The metrics listener is a thread of its own blocking in accept(). It renders the shard totals as
+ * Prometheus text per scrape, a slow or stuck scraper only ever holds up that thread.
+ */
+
+typedef struct
+{
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t offset;                      /*!< Of the counter within hserver_stats_t. */
+    bool nanoseconds;                   /*!< Exported in seconds. */
+} hmetrics_field_t;
+
+#define HMETRICS_TRAFFIC(field)     (offsetof(hserver_stats_t, traffic) + offsetof(hp_stats_t, field))
+
+static const hmetrics_field_t hmetrics_fields[] =
+{
+    {"hcomm_received_bytes_total", "counter", "Bytes received from clients.", HMETRICS_TRAFFIC(bytes_received), false},
+    {"hcomm_sent_bytes_total", "counter", "Bytes sent to clients.", HMETRICS_TRAFFIC(bytes_sent), false},
+    {"hcomm_received_frames_total", "counter", "Frames received from clients.", HMETRICS_TRAFFIC(frames_received), false},
+    {"hcomm_sent_frames_total", "counter", "Frames sent to clients.", HMETRICS_TRAFFIC(frames_sent), false},
+    {"hcomm_recv_calls_total", "counter", "Receive calls, socket and shared memory.", HMETRICS_TRAFFIC(recv_calls), false},
+    {"hcomm_send_calls_total", "counter", "Send calls, socket and shared memory.", HMETRICS_TRAFFIC(send_calls), false},
+    {"hcomm_recv_eagain_total", "counter", "Receive calls that found nothing.", HMETRICS_TRAFFIC(recv_eagain), false},
+    {"hcomm_send_eagain_total", "counter", "Send calls that found no room.", HMETRICS_TRAFFIC(send_eagain), false},
+    {"hcomm_partial_sends_total", "counter", "Send calls that took less than offered.", HMETRICS_TRAFFIC(partial_sends), false},
+    {"hcomm_send_drops_total", "counter", "Sends refused at the send queue limit.", HMETRICS_TRAFFIC(send_drops), false},
+    {"hcomm_dispatch_seconds_total", "counter", "Time spent parsing received frames and in their callbacks.", HMETRICS_TRAFFIC(dispatch_ns), true},
+    {"hcomm_queued_bytes", "gauge", "Bytes waiting in the send queues.", HMETRICS_TRAFFIC(queued_bytes), false},
+    {"hcomm_queued_high_bytes", "gauge", "Most bytes that waited in the send queues at once.", HMETRICS_TRAFFIC(queued_high), false},
+    {"hcomm_accepts_total", "counter", "Client connections accepted.", offsetof(hserver_stats_t, accepts), false},
+    {"hcomm_rejects_total", "counter", "Client connections turned away.", offsetof(hserver_stats_t, rejects), false},
+    {"hcomm_connections", "gauge", "Clients connected.", offsetof(hserver_stats_t, connections), false},
+};
+
+static const char *hmetrics_reasons[HP_DISCONNECT_REASON_COUNT] =
+{
+    "peer_closed", "read_error", "write_error", "protocol_error", "idle", "closed", "shutdown"
+};
+
+uint64_t hmetrics_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/* Copy the counters of shard s, or of svr itself when it has no shards, while they are written. */
+static void hmetrics_load(hserver_t *svr, uint32_t s, hserver_stats_t *stats)
+{
+    const uint64_t *src = (const uint64_t *)(svr->shards != NULL ? &svr->shards[s].stats : &svr->stats);
+    uint64_t *dst = (uint64_t *)stats;
+    for (size_t i = 0; i < sizeof(*stats) / sizeof(uint64_t); ++i)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+/* Counters of the connection so far, from the thread running it. */
+void endpoint_stats(endpoint_t *endpoint, hp_stats_t *stats)
+{
+    *stats = endpoint->stats;
+}
+
+/* Counters summed over every shard, from any thread. Gauge high water marks are the sum of those
+   of the shards. */
+void server_stats(hserver_t* svr, hserver_stats_t* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    uint32_t server_count = svr->shards != NULL ? svr->shard_count : 1;
+    for (uint32_t s = 0; s < server_count; ++s)
+    {
+        hserver_stats_t shard;
+        hmetrics_load(svr, s, &shard);
+        uint64_t *total = (uint64_t *)stats;
+        for (size_t i = 0; i < sizeof(shard) / sizeof(uint64_t); ++i)
+            total[i] += ((uint64_t *)&shard)[i];
+    }
+}
+
+/* Append to buffer like snprintf(), remembering when it ran out of room. */
+__attribute__((format(printf, 4, 5)))
+static void hmetrics_append(char *buffer, size_t capacity, size_t *length, const char *format, ...)
+{
+    if (*length >= capacity)
+        return;
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(buffer + *length, capacity - *length, format, args);
+    va_end(args);
+    *length = written < 0 ? capacity : *length + written;
+}
+
+/* Render the counters of every shard in the Prometheus text format, labelled with the shard.
+   Returns the length written, or -1 when it doesn't fit into capacity. */
+int server_metrics_text(hserver_t* svr, char* buffer, size_t capacity)
+{
+    uint32_t server_count = svr->shards != NULL ? svr->shard_count : 1;
+    hserver_stats_t *shards = malloc(server_count * sizeof(hserver_stats_t));
+    if (shards == NULL)
+        return -1;
+    for (uint32_t s = 0; s < server_count; ++s)
+        hmetrics_load(svr, s, &shards[s]);
+
+    size_t length = 0;
+    for (size_t f = 0; f < sizeof(hmetrics_fields) / sizeof(hmetrics_fields[0]); ++f)
+    {
+        const hmetrics_field_t *field = &hmetrics_fields[f];
+        hmetrics_append(buffer, capacity, &length, "# HELP %s %s\n# TYPE %s %s\n", field->name, field->help, field->name, field->type);
+        for (uint32_t s = 0; s < server_count; ++s)
+        {
+            uint64_t value = *(uint64_t *)((uint8_t *)&shards[s] + field->offset);
+            if (field->nanoseconds)
+                hmetrics_append(buffer, capacity, &length, "%s{shard=\"%u\"} %.9f\n", field->name, s, value / 1e9);
+            else
+                hmetrics_append(buffer, capacity, &length, "%s{shard=\"%u\"} %llu\n", field->name, s, (unsigned long long)value);
+        }
+    }
+    hmetrics_append(buffer, capacity, &length, "# HELP hcomm_disconnects_total Client connections closed, by reason.\n# TYPE hcomm_disconnects_total counter\n");
+    for (uint32_t s = 0; s < server_count; ++s)
+    {
+        for (int r = 0; r < HP_DISCONNECT_REASON_COUNT; ++r)
+            hmetrics_append(buffer, capacity, &length, "hcomm_disconnects_total{shard=\"%u\",reason=\"%s\"} %llu\n", s, hmetrics_reasons[r], (unsigned long long)shards[s].disconnects[r]);
+    }
+    free(shards);
+    return length < capacity ? (int)length : -1;
+}
+
+/* Write all of data or give up. */
+static int hmetrics_send_all(int sock, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t sent = send(sock, data, length, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return -1;
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+/* Answer one HTTP request, GET /metrics or GET / with the metrics, anything else with 404. */
+static void hmetrics_serve(hserver_t *svr, int sock, char **buffer, size_t *capacity)
+{
+    struct timeval timeout = {HMETRICS_TIMEOUT_MS / 1000, (HMETRICS_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Only the request line matters, the headers are read so closing doesn't reset the connection
+    char request[1024];
+    size_t received = 0;
+    while (received < sizeof(request) - 1)
+    {
+        ssize_t count = recv(sock, request + received, sizeof(request) - 1 - received, 0);
+        if (count <= 0)
+            break;
+        received += count;
+        request[received] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL)
+            break;
+    }
+    request[received] = '\0';
+
+    char header[160];
+    if (strncmp(request, "GET /metrics ", 13) != 0 && strncmp(request, "GET / ", 6) != 0)
+    {
+        int length = snprintf(header, sizeof(header), "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        hmetrics_send_all(sock, header, length);
+        return;
+    }
+
+    int length;
+    while ((length = server_metrics_text(svr, *buffer, *capacity)) < 0)
+    {
+        char *grown = realloc(*buffer, *capacity * 2);
+        if (grown == NULL)
+            return;
+        *buffer = grown;
+        *capacity *= 2;
+    }
+    int header_length = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", length);
+    if (hmetrics_send_all(sock, header, header_length) == 0)
+        hmetrics_send_all(sock, *buffer, length);
+}
+
+static void *hmetrics_thread(void *arg)
+{
+    hserver_t *svr = arg;
+    size_t capacity = HMETRICS_BUFFER_SIZE;
+    char *buffer = malloc(capacity);
+    if (buffer == NULL)
+        return NULL;
+
+    while (__atomic_load_n(&svr->metrics_running, __ATOMIC_ACQUIRE))
+    {
+        int sock = accept(svr->metrics_sock, NULL, NULL);
+        if (sock < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            // Shut down by server_metrics_stop()
+            break;
+        }
+        hmetrics_serve(svr, sock, &buffer, &capacity);
+        close(sock);
+    }
+    free(buffer);
+    return NULL;
+}
+
+/* Listen on metrics_port and answer scrapes from a thread of its own. */
+int server_metrics_start(hserver_t* svr)
+{
+    svr->metrics_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (svr->metrics_sock < 0)
+    {
+        HLOG_ERROR("Error, create metrics socket error: %d\n", errno);
+        return -1;
+    }
+    int reuse = 1;
+    setsockopt(svr->metrics_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(svr->metrics_port);
+    if (inet_pton(AF_INET, svr->metrics_address ? svr->metrics_address : "127.0.0.1", &addr.sin_addr) != 1
+        || bind(svr->metrics_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(svr->metrics_sock, LISTEN_MAX) != 0)
+    {
+        HLOG_ERROR("Error, metrics listener on port %d failure: %d\n", svr->metrics_port, errno);
+        close(svr->metrics_sock);
+        return -1;
+    }
+
+    __atomic_store_n(&svr->metrics_running, true, __ATOMIC_RELEASE);
+    if (pthread_create(&svr->metrics_thread, NULL, hmetrics_thread, svr) != 0)
+    {
+        HLOG_ERROR("Error, starting the metrics thread failed: %d\n", errno);
+        svr->metrics_running = false;
+        close(svr->metrics_sock);
+        return -1;
+    }
+    HLOG_INFO("Info, Serving metrics on port:%d\n", svr->metrics_port);
+    return 0;
+}
+
+/* Stop answering scrapes, before the server the listener reads from goes away. */
+void server_metrics_stop(hserver_t* svr)
+{
+    if (!__atomic_exchange_n(&svr->metrics_running, false, __ATOMIC_ACQ_REL))
+        return;
+    // Wakes the accept() of the listener thread
+    shutdown(svr->metrics_sock, SHUT_RDWR);
+    pthread_join(svr->metrics_thread, NULL);
+    close(svr->metrics_sock);
+}
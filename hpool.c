@@ -0,0 +1,301 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "hcomm.h"
+
+/*
+ * Size class buffer pool.
+ *
+ * Send packets, send queue rings and receive buffers are borrowed from here only while data is in
+ * flight and returned as soon as an endpoint drains, so resident memory follows the bytes in flight
+ * instead of the connection count. Each class keeps a free list threaded through the idle blocks
+ * themselves. The pool is per thread and every block carries a pointer to the pool it came from: a
+ * block returned by another thread is pushed onto a lock-free list of its pool, taken over by the
+ * owning thread on its next allocation. A pool whose thread drained it while other threads still
+ * held blocks is released by the last of them coming back.
+ *
+ * Blocks are malloc()ed one by one and a class caches at most HP_POOL_CACHE_BYTES of idle ones,
+ * unless huge pages were asked for: then blocks are carved out of HP_POOL_ARENA_SIZE arenas, idle
+ * blocks are always cached and the arenas are only unmapped once the drained pool got every block
+ * back.
+ */
+
+static const size_t hp_pool_class_sizes[HP_POOL_CLASS_COUNT] = { 64, 256, 1024, 16384 };
+
+#define HP_POOL_TAG                 (8)       /*!< Pointer to the owning pool in front of every block. */
+
+typedef struct hp_pool_block_t
+{
+    struct hp_pool_block_t *next;
+    int pool_class;                     /*!< Of a block another thread returned. */
+} hp_pool_block_t;
+
+typedef struct hp_pool_t
+{
+    hp_pool_block_t *free_list[HP_POOL_CLASS_COUNT];
+    uint32_t free_count[HP_POOL_CLASS_COUNT];
+    uint32_t in_use[HP_POOL_CLASS_COUNT];
+    bool hugepages;
+    uint8_t *arena;
+    size_t arena_left;
+    void *arenas;                       /*!< Every arena mapped, linked through their first word. */
+    // Blocks returned by other threads. The counters only ever grow, also while a pool is reused.
+    hp_pool_block_t *remote;
+    uint64_t remote_freed;              /*!< Blocks ever pushed onto remote. */
+    uint64_t remote_taken;              /*!< Blocks ever taken over from remote by the owner. */
+    uint64_t retire_target;             /*!< remote_freed once a drained pool got every block back, zero while owned. */
+    struct hp_pool_t *next_spare;
+} hp_pool_t;
+
+static __thread hp_pool_t *hp_pool;
+static __thread bool hp_pool_hugepages;
+// Released pools are kept for new threads instead of freed, late remote frees may still look at them
+static hp_pool_t *hp_pool_spares;
+static pthread_mutex_t hp_pool_spares_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int hp_pool_class(size_t size)
+{
+    for (int i = 0; i < HP_POOL_CLASS_COUNT; ++i)
+    {
+        if (size <= hp_pool_class_sizes[i] + HP_POOL_HEADROOM)
+            return i;
+    }
+    return -1;
+}
+
+/* Usable size of a block handed out for size bytes. */
+size_t hp_pool_size(size_t size)
+{
+    int pool_class = hp_pool_class(size);
+    return pool_class < 0 ? size : hp_pool_class_sizes[pool_class] + HP_POOL_HEADROOM;
+}
+
+/* The pool of the calling thread, set up with its first allocation. */
+static hp_pool_t *hp_pool_get(void)
+{
+    if (hp_pool != NULL)
+        return hp_pool;
+    pthread_mutex_lock(&hp_pool_spares_lock);
+    hp_pool_t *pool = hp_pool_spares;
+    if (pool != NULL)
+        hp_pool_spares = pool->next_spare;
+    pthread_mutex_unlock(&hp_pool_spares_lock);
+    if (pool == NULL)
+    {
+        pool = calloc(1, sizeof(hp_pool_t));
+        if (pool == NULL)
+            return NULL;
+    }
+    pool->hugepages = hp_pool_hugepages;
+    pool->next_spare = NULL;
+    hp_pool = pool;
+    return pool;
+}
+
+static void *hp_pool_arena_alloc(hp_pool_t *pool, size_t size)
+{
+    if (pool->arena_left < size)
+    {
+        void *arena = mmap(NULL, HP_POOL_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (arena == MAP_FAILED)
+        {
+            // No reserved huge pages, fall back to transparent ones
+            arena = mmap(NULL, HP_POOL_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (arena == MAP_FAILED)
+            {
+                HLOG_ERROR("Error, mmap of a %d byte pool arena failed: %d\n", HP_POOL_ARENA_SIZE, errno);
+                return NULL;
+            }
+#ifdef MADV_HUGEPAGE
+            madvise(arena, HP_POOL_ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+        }
+        *(void **)arena = pool->arenas;
+        pool->arenas = arena;
+        pool->arena = (uint8_t *)arena + HP_POOL_HEADROOM;
+        pool->arena_left = HP_POOL_ARENA_SIZE - HP_POOL_HEADROOM;
+    }
+    void *block = pool->arena;
+    pool->arena += size;
+    pool->arena_left -= size;
+    return block;
+}
+
+/* Keep an idle block of pool, or give it back to malloc() once the class cached enough. */
+static void hp_pool_cache(hp_pool_t *pool, hp_pool_block_t *block, int pool_class)
+{
+    if (!pool->hugepages && (pool->free_count[pool_class] + 1) * hp_pool_class_sizes[pool_class] > HP_POOL_CACHE_BYTES)
+    {
+        free((uint8_t *)block - HP_POOL_TAG);
+        return;
+    }
+    block->next = pool->free_list[pool_class];
+    pool->free_list[pool_class] = block;
+    pool->free_count[pool_class]++;
+}
+
+/* Take over the blocks other threads returned to pool. */
+static void hp_pool_collect(hp_pool_t *pool)
+{
+    hp_pool_block_t *block = __atomic_exchange_n(&pool->remote, NULL, __ATOMIC_ACQUIRE);
+    while (block != NULL)
+    {
+        hp_pool_block_t *next = block->next;
+        int pool_class = block->pool_class;
+        pool->in_use[pool_class]--;
+        pool->remote_taken++;
+        hp_pool_cache(pool, block, pool_class);
+        block = next;
+    }
+}
+
+/* Free everything of a pool none of whose blocks is lent out anymore and keep it for reuse. */
+static void hp_pool_release(hp_pool_t *pool)
+{
+    hp_pool_collect(pool);
+    for (int i = 0; i < HP_POOL_CLASS_COUNT; ++i)
+    {
+        while (!pool->hugepages && pool->free_list[i] != NULL)
+        {
+            hp_pool_block_t *block = pool->free_list[i];
+            pool->free_list[i] = block->next;
+            free((uint8_t *)block - HP_POOL_TAG);
+        }
+        pool->free_list[i] = NULL;
+        pool->free_count[i] = 0;
+        pool->in_use[i] = 0;
+    }
+    while (pool->arenas != NULL)
+    {
+        void *arena = pool->arenas;
+        pool->arenas = *(void **)arena;
+        munmap(arena, HP_POOL_ARENA_SIZE);
+    }
+    pool->arena = NULL;
+    pool->arena_left = 0;
+
+    pthread_mutex_lock(&hp_pool_spares_lock);
+    pool->next_spare = hp_pool_spares;
+    hp_pool_spares = pool;
+    pthread_mutex_unlock(&hp_pool_spares_lock);
+}
+
+/* Back the calling thread's pool with huge page arenas, only possible before its first allocation
+   or after hp_pool_drain(). */
+int hp_pool_use_hugepages(bool enable)
+{
+    if (hp_pool != NULL && hp_pool->hugepages != enable)
+        return -1;
+    hp_pool_hugepages = enable;
+    return 0;
+}
+
+void *hp_pool_alloc(size_t size)
+{
+    int pool_class = hp_pool_class(size);
+    if (pool_class < 0)
+        return malloc(size);
+
+    hp_pool_t *pool = hp_pool_get();
+    if (pool == NULL)
+        return NULL;
+    if (__atomic_load_n(&pool->remote, __ATOMIC_RELAXED) != NULL)
+        hp_pool_collect(pool);
+    pool->in_use[pool_class]++;
+    hp_pool_block_t *block = pool->free_list[pool_class];
+    if (block != NULL)
+    {
+        pool->free_list[pool_class] = block->next;
+        pool->free_count[pool_class]--;
+        return block;
+    }
+
+    size_t block_size = HP_POOL_TAG + hp_pool_class_sizes[pool_class] + HP_POOL_HEADROOM;
+    uint8_t *tagged = pool->hugepages ? hp_pool_arena_alloc(pool, block_size) : malloc(block_size);
+    if (tagged == NULL)
+    {
+        pool->in_use[pool_class]--;
+        return NULL;
+    }
+    *(hp_pool_t **)tagged = pool;
+    return tagged + HP_POOL_TAG;
+}
+
+/* Return a block, size must be what it was allocated with or anything rounding to the same class.
+   Any thread may return it, it goes back to the pool it came from. */
+void hp_pool_free(void *buffer, size_t size)
+{
+    if (buffer == NULL)
+        return;
+    int pool_class = hp_pool_class(size);
+    if (pool_class < 0)
+    {
+        free(buffer);
+        return;
+    }
+
+    hp_pool_t *owner = *(hp_pool_t **)((uint8_t *)buffer - HP_POOL_TAG);
+    hp_pool_block_t *block = buffer;
+    if (owner == hp_pool)
+    {
+        owner->in_use[pool_class]--;
+        hp_pool_cache(owner, block, pool_class);
+        return;
+    }
+
+    block->pool_class = pool_class;
+    block->next = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&owner->remote, &block->next, block, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    // The block that completes a drained pool releases it, claimed by swapping the target out
+    uint64_t freed = __atomic_add_fetch(&owner->remote_freed, 1, __ATOMIC_SEQ_CST);
+    uint64_t target = freed;
+    if (__atomic_compare_exchange_n(&owner->retire_target, &target, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        hp_pool_release(owner);
+}
+
+/* Blocks of the calling thread's pool lent out and cached per class, either array may be NULL. */
+void hp_pool_stats(uint32_t *in_use, uint32_t *cached)
+{
+    hp_pool_t *pool = hp_pool;
+    if (pool != NULL && __atomic_load_n(&pool->remote, __ATOMIC_RELAXED) != NULL)
+        hp_pool_collect(pool);
+    for (int i = 0; i < HP_POOL_CLASS_COUNT; ++i)
+    {
+        if (in_use)
+            in_use[i] = pool ? pool->in_use[i] : 0;
+        if (cached)
+            cached[i] = pool ? pool->free_count[i] : 0;
+    }
+}
+
+/* Release the calling thread's pool, threads call it before they exit. Blocks other threads still
+   hold come back to it later, the last of them releases it then. The next allocation of the thread
+   starts a new pool. */
+void hp_pool_drain(void)
+{
+    hp_pool_t *pool = hp_pool;
+    if (pool == NULL)
+        return;
+    hp_pool = NULL;
+    hp_pool_collect(pool);
+    uint64_t lent = 0;
+    for (int i = 0; i < HP_POOL_CLASS_COUNT; ++i)
+        lent += pool->in_use[i];
+    if (lent == 0)
+    {
+        hp_pool_release(pool);
+        return;
+    }
+
+    // Every block still lent out comes back through remote now
+    uint64_t target = pool->remote_taken + lent;
+    __atomic_store_n(&pool->retire_target, target, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->remote_freed, __ATOMIC_SEQ_CST) == target &&
+        __atomic_compare_exchange_n(&pool->retire_target, &target, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        hp_pool_release(pool);
+}
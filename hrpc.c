@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hcomm.h"
+
+/*
+ * Pipelined request / response.
+ *
+ * A HP_MSG_REQUEST carries a 32 bit request id in front of its message and the HP_MSG_RESPONSE
+ * answering it the same id, so any number of requests may be outstanding on one connection and
+ * their responses may come back in any order. The header stamp stays free for round trip stamps.
+ *
+ * Outstanding calls sit in a table indexed by the low bits of their id. Ids are handed out in order,
+ * so the table only has to grow once the oldest outstanding call lies a whole table behind the
+ * newest, which deadlines keep from happening for long.
+ */
+
+typedef struct hp_rpc_call_t
+{
+    endpoint_t *endpoint;
+    uint32_t id;
+    uint32_t sent_us;                   /*!< Send time while the endpoint measures round trips. */
+    rpc_response_callback_t callback;
+    void *user_data;
+    htimer_wheel_t *timers;             /*!< Wheel the deadline is armed on, NULL without one. */
+    htimer_t deadline;
+} hp_rpc_call_t;
+
+/* Queue message behind its request id as one packet, or as a large frame when it doesn't fit. */
+static int rpc_send(endpoint_t *endpoint, uint8_t message_type, uint32_t id, const void *message, uint32_t length)
+{
+    if (length <= HP_MESSAGE_MAX_SIZE - HP_RPC_HEADER_SIZE)
+    {
+        hp_packet_t *packet = endpoint_reserve_send(endpoint, HP_RPC_HEADER_SIZE + length);
+        if (packet == NULL)
+            return -1;
+        packet->header.message_type = message_type;
+        packet->header.message_size = HP_RPC_HEADER_SIZE + length;
+        memcpy(packet->message, &id, sizeof(id));
+        memcpy(packet->message + HP_RPC_HEADER_SIZE, message, length);
+        return endpoint_commit_send(endpoint, packet);
+    }
+
+    if (length > UINT32_MAX - HP_RPC_HEADER_SIZE)
+        return -1;
+    hp_shared_packet_t *shared = shared_packet_create_large(message_type, NULL, HP_RPC_HEADER_SIZE + length);
+    if (shared == NULL)
+    {
+        HLOG_ERROR("Error, Failed to allocate a request of %u bytes\n", length);
+        return -1;
+    }
+    uint8_t *data = shared->packet.raw + HP_LARGE_HEADER_SIZE;
+    memcpy(data, &id, sizeof(id));
+    memcpy(data + HP_RPC_HEADER_SIZE, message, length);
+    int result = endpoint_queue_shared(endpoint, shared);
+    shared_packet_release(shared);
+    return result;
+}
+
+/* Make a free slot for id, doubling the table until every outstanding call has a slot of its own. */
+static int rpc_reserve(endpoint_t *endpoint, uint32_t id)
+{
+    if (endpoint->rpc_calls != NULL && endpoint->rpc_calls[id & (endpoint->rpc_capacity - 1)] == NULL)
+        return 0;
+
+    for (uint32_t capacity = endpoint->rpc_calls ? endpoint->rpc_capacity * 2 : HP_RPC_TABLE_SIZE; capacity != 0; capacity *= 2)
+    {
+        hp_rpc_call_t **calls = calloc(capacity, sizeof(hp_rpc_call_t *));
+        if (calls == NULL)
+            return -1;
+        uint32_t i;
+        for (i = 0; i < endpoint->rpc_capacity; ++i)
+        {
+            hp_rpc_call_t *call = endpoint->rpc_calls[i];
+            if (call == NULL)
+                continue;
+            if (calls[call->id & (capacity - 1)] != NULL)
+                break;
+            calls[call->id & (capacity - 1)] = call;
+        }
+        if (i == endpoint->rpc_capacity && calls[id & (capacity - 1)] == NULL)
+        {
+            free(endpoint->rpc_calls);
+            endpoint->rpc_calls = calls;
+            endpoint->rpc_capacity = capacity;
+            return 0;
+        }
+        free(calls);
+    }
+    return -1;
+}
+
+/* Take the call with id out of the table, NULL when it isn't outstanding anymore. */
+static hp_rpc_call_t *rpc_take(endpoint_t *endpoint, uint32_t id)
+{
+    if (endpoint->rpc_calls == NULL)
+        return NULL;
+    hp_rpc_call_t **slot = &endpoint->rpc_calls[id & (endpoint->rpc_capacity - 1)];
+    hp_rpc_call_t *call = *slot;
+    if (call == NULL || call->id != id)
+        return NULL;
+    *slot = NULL;
+    endpoint->rpc_in_flight--;
+    return call;
+}
+
+/* Free a call taken out of the table and tell its owner how it ended. */
+static int rpc_complete(hp_rpc_call_t *call, int status, uint8_t *message, uint32_t length)
+{
+    endpoint_t *endpoint = call->endpoint;
+    rpc_response_callback_t callback = call->callback;
+    void *user_data = call->user_data;
+    if (call->timers != NULL)
+        htimer_cancel(call->timers, &call->deadline);
+    hp_pool_free(call, sizeof(*call));
+    if (callback)
+        return callback(endpoint, user_data, status, message, length);
+    return 0;
+}
+
+static int rpc_deadline_expired(htimer_t *timer)
+{
+    hp_rpc_call_t *call = timer->data;
+    HLOG_ERROR("Error, Request %u to %s timed out\n", call->id, get_endpoint_address_str(call->endpoint));
+    rpc_take(call->endpoint, call->id);
+    return rpc_complete(call, -HP_ETIMEDOUT, NULL, 0);
+}
+
+/* Send message as a request, callback gets the response or -HP_ETIMEDOUT once timeout_ms passed
+   without one (0 waits forever), or -HP_EIO when the connection closes first. The deadline is kept
+   by the event loop the endpoint is registered with, there is none while it isn't. */
+int endpoint_rpc_call(endpoint_t *endpoint, const void *message, uint32_t length, uint32_t timeout_ms, rpc_response_callback_t callback, void *user_data)
+{
+    if (endpoint->socket == NO_SOCKET)
+        return -1;
+    uint32_t id = endpoint->rpc_next_id;
+    if (rpc_reserve(endpoint, id) != 0)
+        return -1;
+    hp_rpc_call_t *call = hp_pool_alloc(sizeof(hp_rpc_call_t));
+    if (call == NULL)
+        return -1;
+    if (rpc_send(endpoint, HP_MSG_REQUEST, id, message, length) != 0)
+    {
+        hp_pool_free(call, sizeof(hp_rpc_call_t));
+        return -1;
+    }
+
+    call->endpoint = endpoint;
+    call->id = id;
+    call->sent_us = endpoint->rtt != NULL ? hhist_now_us() : 0;
+    call->callback = callback;
+    call->user_data = user_data;
+    call->timers = NULL;
+    htimer_init(&call->deadline, rpc_deadline_expired, call);
+    if (timeout_ms != 0 && endpoint->loop != NULL && htimer_add(&endpoint->loop->timers, &call->deadline, timeout_ms, 0) == 0)
+        call->timers = &endpoint->loop->timers;
+    endpoint->rpc_calls[id & (endpoint->rpc_capacity - 1)] = call;
+    endpoint->rpc_in_flight++;
+    endpoint->rpc_next_id++;
+    return 0;
+}
+
+/* Answer request with message. Fails once the connection the request came in on is gone. */
+int endpoint_rpc_respond(const hp_rpc_request_t *request, const void *message, uint32_t length)
+{
+    endpoint_t *endpoint = request->endpoint;
+    if (endpoint->socket == NO_SOCKET || endpoint->rpc_session != request->session)
+    {
+        HLOG_ERROR("Error, Dropped the response to request %u, its connection closed\n", request->id);
+        return -1;
+    }
+    return rpc_send(endpoint, HP_MSG_RESPONSE, request->id, message, length);
+}
+
+/* Whether frames of message_type go to the RPC layer instead of the packet callbacks. */
+bool endpoint_rpc_takes(endpoint_t *endpoint, uint8_t message_type)
+{
+    if (message_type == HP_MSG_REQUEST)
+        return endpoint->request_callback != NULL;
+    if (message_type == HP_MSG_RESPONSE)
+        return endpoint->rpc_calls != NULL;
+    return false;
+}
+
+/* Hand a received request to request_callback or complete the call a response answers, message
+   starts with the request id. Responses arriving after their deadline are dropped. */
+int endpoint_rpc_dispatch(endpoint_t *endpoint, uint8_t message_type, uint8_t *message, uint32_t length)
+{
+    if (length < HP_RPC_HEADER_SIZE)
+    {
+        HLOG_ERROR("Error, Received a request or response without id from %s\n", get_endpoint_address_str(endpoint));
+        return -HP_EX_INVALID_MSG_SIZE;
+    }
+    uint32_t id;
+    memcpy(&id, message, sizeof(id));
+    if (message_type == HP_MSG_REQUEST)
+    {
+        hp_rpc_request_t request;
+        request.endpoint = endpoint;
+        request.session = endpoint->rpc_session;
+        request.id = id;
+        return endpoint->request_callback(endpoint, &request, message + HP_RPC_HEADER_SIZE, length - HP_RPC_HEADER_SIZE);
+    }
+
+    hp_rpc_call_t *call = rpc_take(endpoint, id);
+    if (call == NULL)
+        return 0;
+    if (endpoint->rtt != NULL && call->sent_us != 0)
+        hhist_record(endpoint->rtt, hhist_now_us() - call->sent_us);
+    return rpc_complete(call, 0, message + HP_RPC_HEADER_SIZE, length - HP_RPC_HEADER_SIZE);
+}
+
+/* Complete every outstanding call with status, the connection is gone. */
+void endpoint_rpc_fail_all(endpoint_t *endpoint, int status)
+{
+    // Detached first, the callbacks may call again
+    hp_rpc_call_t **calls = endpoint->rpc_calls;
+    uint32_t capacity = endpoint->rpc_capacity;
+    endpoint->rpc_calls = NULL;
+    endpoint->rpc_capacity = 0;
+    endpoint->rpc_in_flight = 0;
+    for (uint32_t i = 0; i < capacity; ++i)
+    {
+        if (calls[i] != NULL)
+            rpc_complete(calls[i], status, NULL, 0);
+    }
+    free(calls);
+}
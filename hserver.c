@@ -1,6 +1,9 @@
 // Simple example of server with select() and multiple clients.
 
+#define _GNU_SOURCE
 #include <errno.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/select.h>
@@ -9,35 +12,63 @@
 #include <string.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <arpa/inet.h>
-#include <netinet/tcp.h>
 
 #include "hcomm.h"
 
 void server_shutdown(hserver_t *svr, int code);
 
+/* Bind listen_sock to the unix socket at unix_path, replacing whatever a previous run left there. */
+static int server_bind_unix(hserver_t *svr)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(svr->unix_path) >= sizeof(addr.sun_path))
+  {
+    HLOG_ERROR("Error, unix socket path %s is too long\n", svr->unix_path);
+    return -1;
+  }
+  strcpy(addr.sun_path, svr->unix_path);
+  unlink(svr->unix_path);
+  if (bind(svr->listen_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+  {
+    HLOG_ERROR("Error, bind %s failure: %d\n", svr->unix_path, errno);
+    return -1;
+  }
+  return 0;
+}
+
 /* Start listening socket listen_sock. */
 int server_start_listening(hserver_t *svr)
 {
   // Obtain a file descriptor for our "listening" socket.
-  svr->listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+  svr->listen_sock = socket(svr->unix_path ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
   if (svr->listen_sock < 0)
   {
-#ifdef HCOMM_DEBUG_ERROR
-    printf("Error, create socket error: %d \n", errno);
-#endif
+    HLOG_ERROR("Error, create socket error: %d \n", errno);
 		return -1;
   }
 
   int reuse = 1;
   if (setsockopt(svr->listen_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0)
   {
-#ifdef HCOMM_DEBUG_ERROR
-		printf("Error, setsockopt SOL_SOCKET SO_RESUSEADDR error: %d\n", errno);
-#endif
+		HLOG_ERROR("Error, setsockopt SOL_SOCKET SO_RESUSEADDR error: %d\n", errno);
 		return -1;
   }
+
+  if (svr->reuse_port)
+  {
+#ifdef SO_REUSEPORT
+    if (setsockopt(svr->listen_sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) != 0)
+#endif
+    {
+      HLOG_ERROR("Error, setsockopt SOL_SOCKET SO_REUSEPORT error: %d\n", errno);
+      return -1;
+    }
+  }
   
   memset(&svr->svr_addr, 0, sizeof(svr->svr_addr));
   svr->svr_addr.sin_family = AF_INET;  
@@ -48,76 +79,198 @@ int server_start_listening(hserver_t *svr)
 	int flags = fcntl(svr->listen_sock, F_GETFL, 0);
 	if (flags == -1)
 	{
-#ifdef HCOMM_DEBUG_ERROR
-		printf("Error, fcntl F_GETFL error: %d\n", errno);
-#endif
+		HLOG_ERROR("Error, fcntl F_GETFL error: %d\n", errno);
 		return(14);
 	}
 	flags |= O_NONBLOCK;
 	int result = fcntl(svr->listen_sock, F_SETFL, flags);
 	if (result == -1)
 	{
-#ifdef HCOMM_DEBUG_ERROR
-		printf("Error, fcntl F_SETFL error: %d\n", errno);
-#endif
+		HLOG_ERROR("Error, fcntl F_SETFL error: %d\n", errno);
 		return(15);
 	}
 
-  if (bind(svr->listen_sock, (struct sockaddr *)&svr->svr_addr, sizeof(struct sockaddr)) != 0)
+  if (svr->unix_path)
   {
-#ifdef HCOMM_DEBUG_ERROR
-    printf("Error, bind failure: %d\n", errno);
-#endif
+    if (server_bind_unix(svr) != 0)
+      return -1;
+  }
+  else if (bind(svr->listen_sock, (struct sockaddr *)&svr->svr_addr, sizeof(struct sockaddr)) != 0)
+  {
+    HLOG_ERROR("Error, bind failure: %d\n", errno);
     return -1;
   }
 
   // Start accept client connections
   if (listen(svr->listen_sock, LISTEN_MAX) != 0)
   {
-#ifdef HCOMM_DEBUG_ERROR
-    printf("Error, listening error: %d\n", errno);
-#endif
+    HLOG_ERROR("Error, listening error: %d\n", errno);
     return -1;
   }
-  printf("Info, Listening for incoming connections on port:%d\n", svr->listen_port);
+  if (svr->unix_path)
+    HLOG_INFO("Info, Listening for incoming connections on %s\n", svr->unix_path);
+  else
+    HLOG_INFO("Info, Listening for incoming connections on port:%d\n", svr->listen_port);
   return 0;
 }
 
+static void server_drain_submissions(hserver_t *svr, bool send);
+
 void server_shutdown(hserver_t *svr, int code)
 {
-  int i;
-
+  if (!svr->initialized)
+    return;
+  // A sharded server has no loop, listener or clients of its own, its shards go down with it
+  if (svr->shards != NULL)
+  {
+    server_stop(svr);
+    return;
+  }
+  server_metrics_stop(svr);
   close(svr->listen_sock);
+  if (svr->unix_path)
+    unlink(svr->unix_path);
+  server_drain_submissions(svr, false);
 
-  for (i = 0; i < MAX_CLIENTS; ++i)
-    if (svr->client_list[i].socket != NO_SOCKET)
-      close(svr->client_list[i].socket);
-
-  printf("Shutdown server properly.\n");  
+  while (svr->clients.live_count > 0)
+  {
+    endpoint_t *client = svr->clients.live[svr->clients.live_count - 1];
+    conn_table_remove(&svr->clients, client);
+    delete_endpoint(client);
+    HP_STAT_ADD(&svr->stats, connections, -1);
+    HP_STAT_ADD(&svr->stats, disconnects[HP_DISCONNECT_SHUTDOWN], 1);
+  }
+  htopic_index_destroy(&svr->topics);
+  conn_table_destroy(&svr->clients);
+  htimer_cancel(&svr->loop.timers, &svr->accept_retry);
+  if (svr->reserve_fd >= 0)
+    close(svr->reserve_fd);
+  event_loop_close(&svr->loop);
+  svr->initialized = false;
+
+  HLOG_INFO("Shutdown server properly.\n");
 }
 
-int server_build_fd_sets(hserver_t *svr)
+static int server_idle_timeout(htimer_t *timer);
+static int server_topic_received(endpoint_t *client, hp_packet_header *header, uint8_t *message, uint32_t length);
+
+/* Take over an accepted socket, either from accept() or from an io_uring accept completion. */
+int server_add_connection(hserver_t* svr, int new_client_sock, struct sockaddr_in *client_addr_in)
 {
-  FD_ZERO(&svr->read_fds);  
-  FD_SET(svr->listen_sock, &svr->read_fds);
-  for (int i = 0; i < MAX_CLIENTS; ++i)
-    if (svr->client_list[i].socket != NO_SOCKET)
-      FD_SET(svr->client_list[i].socket, &svr->read_fds);
+  struct sockaddr_in client_addr;
+  memset(&client_addr, 0, sizeof(client_addr));
+  if (client_addr_in != NULL)
+  {
+    client_addr = *client_addr_in;
+  }
+  else
+  {
+    socklen_t client_len = sizeof(client_addr);
+    getpeername(new_client_sock, (struct sockaddr *)&client_addr, &client_len);
+  }
+
+  // Accepted sockets don't inherit O_NONBLOCK on Linux, edge-triggered reads rely on it
+  int flags = fcntl(new_client_sock, F_GETFL, 0);
+  if (flags == -1 || fcntl(new_client_sock, F_SETFL, flags | O_NONBLOCK) == -1)
+  {
+    HLOG_ERROR("Error, server_handle_new_connection fcntl O_NONBLOCK failure %d\n", errno);
+    close(new_client_sock);
+    HP_STAT_ADD(&svr->stats, rejects, 1);
+    return -2;
+  }
 
-  FD_ZERO(&svr->write_fds);
-  for (int i = 0; i < MAX_CLIENTS; ++i)
-    if (svr->client_list[i].socket != NO_SOCKET && svr->client_list[i].send_queue.index > 0)
-      FD_SET(svr->client_list[i].socket, &svr->write_fds);
+  // Unix peers only leave their family behind in client_addr
+  char client_ipv4_str[INET_ADDRSTRLEN];
+  strcpy(client_ipv4_str, "unix");
+  if (client_addr.sin_family != AF_UNIX)
+    inet_ntop(AF_INET, &client_addr.sin_addr, client_ipv4_str, INET_ADDRSTRLEN);
 
-  FD_ZERO(&svr->error_fds);  
-  FD_SET(svr->listen_sock, &svr->error_fds);
-  for (int i = 0; i < MAX_CLIENTS; ++i)
-    if (svr->client_list[i].socket != NO_SOCKET)
-      FD_SET(svr->client_list[i].socket, &svr->error_fds);
+  HLOG_INFO("Info, Incoming connection from %s:%d.\n", client_ipv4_str, client_addr.sin_port);
 
+  endpoint_t *client = conn_table_insert(&svr->clients, new_client_sock);
+  if (client == NULL)
+  {
+    HLOG_ERROR("Error, Connection limit %u reached. Closing new connection %s:%d.\n", svr->clients.max_connections, client_ipv4_str, client_addr.sin_port);
+    close(new_client_sock);
+    HP_STAT_ADD(&svr->stats, rejects, 1);
+    return -2;
+  }
+  create_endpoint(client);
+  client->stats_total = &svr->stats.traffic;
+  client->address = client_addr;
+  client->packet_received_callback = 0;
+  client->topic_callback = server_topic_received;
+  client->topic_context = svr;
+  client->shared_memory = svr->shared_memory;
+  endpoint_set_watermarks(client, svr->send_high_watermark, svr->send_low_watermark, svr->throttle_reads);
+  endpoint_set_compression(client, svr->compress, svr->compress_threshold, svr->compress_dict);
+  if (endpoint_register(client, &svr->loop) != 0 || endpoint_set_profile(client, svr->socket_profile) != 0)
+  {
+    conn_table_remove(&svr->clients, client);
+    delete_endpoint(client);
+    HP_STAT_ADD(&svr->stats, rejects, 1);
+    return -2;
+  }
+  HP_STAT_ADD(&svr->stats, accepts, 1);
+  HP_STAT_ADD(&svr->stats, connections, 1);
+  if (svr->measure_rtt && endpoint_measure_rtt(client, true) == 0)
+    client->rtt_total = &svr->rtt;
+  if (svr->idle_timeout_ms != 0)
+  {
+    htimer_init(&client->idle_timer, server_idle_timeout, svr);
+    htimer_add(&svr->loop.timers, &client->idle_timer, svr->idle_timeout_ms, 0);
+  }
+  svr->client_connected_callback(svr, client);
+  return 0;
+}
+
+/* Accepting paused after a failure, registered again the listener reports what waits in the backlog. */
+static int server_accept_resume(htimer_t *timer)
+{
+  hserver_t *svr = timer->data;
+  if (svr->reserve_fd < 0)
+    svr->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  event_loop_modify(&svr->loop, svr->listen_sock, HEVENT_READ | HEVENT_ACCEPT, svr);
   return 0;
 }
 
+/* Accepting failed with error. Out of file descriptors the pending connection is taken on the reserve
+   descriptor and dropped, when that fails too or the kernel is out of memory accepting pauses for
+   SERVER_ACCEPT_RETRY_MS. Returns -1 once nothing can be accepted now, -2 to go on. */
+static int server_accept_failed(hserver_t* svr, int error)
+{
+  if (error == EAGAIN || error == EWOULDBLOCK)
+    return -1;
+  if ((error == EMFILE || error == ENFILE) && svr->reserve_fd >= 0)
+  {
+    close(svr->reserve_fd);
+    int sock = accept(svr->listen_sock, NULL, NULL);
+    if (sock >= 0)
+      close(sock);
+    else
+      error = errno;
+    svr->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (sock >= 0)
+    {
+      HLOG_ERROR("Error, Out of file descriptors, dropped a new connection.\n");
+      HP_STAT_ADD(&svr->stats, rejects, 1);
+      return -2;
+    }
+    if (error == EAGAIN || error == EWOULDBLOCK)
+      return -1;
+  }
+  if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM)
+  {
+    HLOG_ERROR("Error, accept failure %d, accepting again in %d ms\n", error, SERVER_ACCEPT_RETRY_MS);
+    event_loop_modify(&svr->loop, svr->listen_sock, 0, svr);
+    htimer_add(&svr->loop.timers, &svr->accept_retry, SERVER_ACCEPT_RETRY_MS, 0);
+    return -1;
+  }
+  // Only this connection failed, e.g. it was reset while waiting in the backlog
+  HLOG_ERROR("Error, accept failure  %d\n", error);
+  return -2;
+}
+
 int server_handle_new_connection(hserver_t* svr)
 {
   struct sockaddr_in client_addr;
@@ -125,91 +278,290 @@ int server_handle_new_connection(hserver_t* svr)
   socklen_t client_len = sizeof(client_addr);
   int new_client_sock = accept(svr->listen_sock, (struct sockaddr *)&client_addr, &client_len);
   if (new_client_sock < 0)
+    return server_accept_failed(svr, errno);
+  return server_add_connection(svr, new_client_sock, &client_addr);
+}
+
+static int server_remove_client(hserver_t* svr, endpoint_t *client, hp_disconnect_reason_t reason)
+{
+  HLOG_INFO("Info, Close client socket for %s.\n", get_endpoint_address_str(client));
+
+  htimer_cancel(&svr->loop.timers, &client->idle_timer);
+  htopic_unsubscribe_all(&svr->topics, client);
+  conn_table_remove(&svr->clients, client);
+  delete_endpoint(client);
+  HP_STAT_ADD(&svr->stats, connections, -1);
+  HP_STAT_ADD(&svr->stats, disconnects[reason], 1);
+  
+  return 0;
+}
+
+int server_close_client_connection(hserver_t* svr, endpoint_t *client)
+{
+  return server_remove_client(svr, client, HP_DISCONNECT_CLOSED);
+}
+
+/* Why endpoint_handle_event() gave up on a client. */
+static hp_disconnect_reason_t server_disconnect_reason(int result)
+{
+  switch (result)
   {
-#ifdef HCOMM_DEBUG_ERROR
-    printf("Error, accept failure  %d\n", errno);
-#endif
+  case HP_SOCKET_ZERO_READ:
+    return HP_DISCONNECT_PEER_CLOSED;
+  case HP_SOCKET_READ_ERROR:
+    return HP_DISCONNECT_READ_ERROR;
+  case HP_SOCKET_WRITE_ERROR:
+    return HP_DISCONNECT_WRITE_ERROR;
+  default:
+    return HP_DISCONNECT_PROTOCOL_ERROR;
+  }
+}
+
+/* Nothing arrived from the client for idle_timeout_ms. */
+static int server_idle_timeout(htimer_t *timer)
+{
+  hserver_t *svr = timer->data;
+  endpoint_t *client = (endpoint_t *)((uint8_t *)timer - offsetof(endpoint_t, idle_timer));
+  HLOG_ERROR("Error, %s idle for %u ms.\n", get_endpoint_address_str(client), svr->idle_timeout_ms);
+  svr->client_disconnected_callback(svr, client);
+  server_remove_client(svr, client, HP_DISCONNECT_IDLE);
+  return 0;
+}
+
+endpoint_t* server_find_client(hserver_t* svr, conn_id_t id)
+{
+  return conn_table_find_id(&svr->clients, id);
+}
+
+/* Round trip percentiles over every client the server ever had, shards included. Each shard
+   records into a histogram of its own, copied here while its thread carries on. */
+int server_rtt_summary(hserver_t* svr, hhist_summary_t* summary)
+{
+  if (!svr->measure_rtt)
     return -1;
+  hhist_t *total = malloc(2 * sizeof(hhist_t));
+  if (total == NULL)
+    return -1;
+  hhist_t *shard = total + 1;
+  hhist_reset(total);
+  uint32_t server_count = svr->shards != NULL ? svr->shard_count : 1;
+  for (uint32_t s = 0; s < server_count; ++s)
+  {
+    hhist_snapshot(svr->shards != NULL ? &svr->shards[s].rtt : &svr->rtt, shard);
+    hhist_merge(total, shard);
   }
+  hhist_summarize(total, summary);
+  free(total);
+  return 0;
+}
 
-  int option = 0;
-  int result = setsockopt(new_client_sock, SOL_TCP, TCP_NODELAY, &option, sizeof(option));
-  if (result == -1)
+/* Queue shared for all clients by reference, returns how many clients got it. Unwritable clients
+   still get it, only a client whose queue reached its limit is skipped. */
+int server_queue_send_shared(hserver_t* svr, hp_shared_packet_t* shared)
+{
+  int queued = 0;
+  for (uint32_t i = 0; i < svr->clients.live_count; ++i)
   {
-#ifdef HCOMM_DEBUG_ERROR
-    printf("Error, server_handle_new_connection setsockopt TCP_NODELAY failure %d", errno);
-#endif
-    return -2;
+    if (endpoint_queue_shared(svr->clients.live[i], shared) != 0)
+    {
+      HLOG_ERROR("Error, Send queue of %s is at its limit, we lost this packet!\n", get_endpoint_address_str(svr->clients.live[i]));
+      continue;
+    }
+    queued++;
   }
+  HLOG_VERBOSE("Info, New packet queued for %d clients.\n", queued);
+  return queued;
+}
 
-  option = 1;
-  result = setsockopt(new_client_sock, SOL_TCP, TCP_QUICKACK, &option, sizeof(option));
-  if (result == -1)
+/* Encode new_packet once and queue it for all clients, returns how many clients got it or -1. */
+int server_queue_send_packet(hserver_t* svr, hp_packet_t* new_packet)
+{
+  hp_shared_packet_t *shared = shared_packet_create(new_packet);
+  if (shared == NULL)
   {
-#ifdef HCOMM_DEBUG_ERROR
-    printf("Error, server_handle_new_connection setsockopt TCP_QUICKACK failure %d", errno);
-#endif
-    return -2;
+    HLOG_ERROR("Error, Failed to allocate a broadcast packet of %d bytes\n", new_packet->header.message_size);
+    return -1;
   }
-  char client_ipv4_str[INET_ADDRSTRLEN];
-  inet_ntop(AF_INET, &client_addr.sin_addr, client_ipv4_str, INET_ADDRSTRLEN);
+  int queued = server_queue_send_shared(svr, shared);
+  shared_packet_release(shared);
+  return queued;
+}
 
-  printf("Info, Incoming connection from %s:%d.\n", client_ipv4_str, client_addr.sin_port);
+static int server_publish_visit(endpoint_t *subscriber, void *context)
+{
+  if (endpoint_queue_shared(subscriber, context) != 0)
+  {
+    HLOG_ERROR("Error, Send queue of %s is at its limit, we lost this publish!\n", get_endpoint_address_str(subscriber));
+    return -1;
+  }
+  return 0;
+}
+
+/* Queue the HP_MSG_PUBLISH frame shared for the clients subscribed to its topic, by reference.
+   Returns how many clients got it, or -1 for a malformed frame. */
+int server_publish_shared(hserver_t* svr, hp_shared_packet_t* shared)
+{
+  hp_packet_t *packet = &shared->packet;
+  const uint8_t *message = packet->message;
+  uint32_t length = packet->header.message_size;
+  if ((packet->header.version & HP_PACKET_VERSION_MASK) == HP_PACKET_VERSION_LARGE)
+  {
+    message = packet->raw + HP_LARGE_HEADER_SIZE;
+    length = ((hp_large_header *)packet->raw)->message_length;
+  }
+  const char *topic;
+  uint32_t topic_length;
+  const uint8_t *payload;
+  uint32_t payload_length;
+  if (packet->header.message_type != HP_MSG_PUBLISH ||
+      topic_packet_parse(message, length, &topic, &topic_length, &payload, &payload_length) != 0)
+    return -1;
+  int queued = htopic_match(&svr->topics, topic, topic_length, server_publish_visit, shared);
+  HLOG_VERBOSE("Info, Publish to %.*s queued for %d clients.\n", (int)topic_length, topic, queued);
+  return queued;
+}
 
-  for (int i = 0; i < MAX_CLIENTS; ++i)
+/* Encode message once under topic and queue it for the subscribed clients, returns how many got it or -1. */
+int server_publish(hserver_t* svr, const char* topic, const void* message, uint32_t length)
+{
+  hp_shared_packet_t *shared = topic_packet_create(topic, message, length);
+  if (shared == NULL)
   {
-    if (svr->client_list[i].socket == NO_SOCKET)
+    HLOG_ERROR("Error, Failed to allocate a publish of %u bytes\n", length);
+    return -1;
+  }
+  int queued = server_publish_shared(svr, shared);
+  shared_packet_release(shared);
+  return queued;
+}
+
+static int server_submit(hserver_t* svr, conn_id_t id, hp_shared_packet_t* shared, bool publish)
+{
+  if (svr->shards != NULL)
+  {
+    if (id == CONN_ID_NONE)
     {
-      svr->client_list[i].socket = new_client_sock;
-      svr->client_list[i].address = client_addr;
-      svr->client_list[i].send_packet_index = -1;
-      svr->client_list[i].receive_packet_index = 0;
-      svr->client_list[i].packet_received_callback = 0;
-      svr->client_connected_callback(svr, i);
-      return 0;
+      int result = 0;
+      for (uint32_t i = 0; i < svr->shard_count; ++i)
+      {
+        if (server_submit(&svr->shards[i], id, shared, publish) != 0)
+          result = -1;
+      }
+      return result;
     }
+    uint32_t shard_id = (uint32_t)(id >> 56);
+    if (shard_id >= svr->shard_count)
+      return -1;
+    return server_submit(&svr->shards[shard_id], id, shared, publish);
   }
-#ifdef HCOMM_DEBUG_ERROR
-  printf("Error, Connection limit %d reached. Closing new connection %s:%d.\n", MAX_CLIENTS, client_ipv4_str, client_addr.sin_port);
-#endif
-  close(new_client_sock);
-  return -1;
+
+  hserver_submission_t *submission = malloc(sizeof(hserver_submission_t));
+  if (submission == NULL)
+    return -1;
+  submission->id = id;
+  submission->packet = shared;
+  submission->publish = publish;
+  shared_packet_retain(shared);
+  hmpsc_push(&svr->submissions, &submission->node);
+  // Only the first submission since the last drain has to interrupt the wait
+  if (!__atomic_exchange_n(&svr->submission_pending, true, __ATOMIC_ACQ_REL))
+    return event_loop_wake(&svr->loop);
+  return 0;
 }
 
-int server_close_client_connection(endpoint_t *client)
+/* Hand shared to the thread polling svr for client id, CONN_ID_NONE sends to every client.
+   Safe from any thread, a sharded server passes it on to the shard owning the id. */
+int server_submit_shared(hserver_t* svr, conn_id_t id, hp_shared_packet_t* shared)
 {
-  printf("Info, Close client socket for %s.\n", get_endpoint_address_str(client));
+  return server_submit(svr, id, shared, false);
+}
 
-  close(client->socket);
-  client->socket = NO_SOCKET;
-  dequeue_all(&client->send_queue);
-  client->send_packet_index = -1;
-  client->receive_packet_index = 0;
-  
-  return 0;
+/* Publish message under topic from any thread, every shard queues it for its own subscribers. */
+int server_submit_publish(hserver_t* svr, const char* topic, const void* message, uint32_t length)
+{
+  hp_shared_packet_t *shared = topic_packet_create(topic, message, length);
+  if (shared == NULL)
+    return -1;
+  int result = server_submit(svr, CONN_ID_NONE, shared, true);
+  shared_packet_release(shared);
+  return result;
 }
 
-int server_queue_send_packet(hserver_t* svr, hp_packet_t* new_packet)
+/* Subscriptions of a client go into the index of its shard, its publishes out to the subscribers
+   of every shard when the server relays them. */
+static int server_topic_received(endpoint_t *client, hp_packet_header *header, uint8_t *message, uint32_t length)
+{
+  hserver_t *svr = client->topic_context;
+  int result = 0;
+  if (header->message_type == HP_MSG_SUBSCRIBE)
+    result = htopic_subscribe(&svr->topics, client, (const char *)message, length);
+  else if (header->message_type == HP_MSG_UNSUBSCRIBE)
+    result = htopic_unsubscribe(&svr->topics, client, (const char *)message, length);
+  else if (svr->relay_publishes)
+  {
+    hp_shared_packet_t *shared;
+    if (length <= HP_MESSAGE_MAX_SIZE)
+    {
+      hp_packet_t copy;
+      copy.header = *header;
+      copy.header.message_size = length;
+      memcpy(copy.message, message, length);
+      shared = shared_packet_create(&copy);
+    }
+    else
+      shared = shared_packet_create_large(HP_MSG_PUBLISH, message, length);
+    if (shared == NULL || server_publish_shared(svr, shared) < 0)
+      result = -1;
+    for (uint32_t i = 0; shared != NULL && svr->parent != NULL && i < svr->parent->shard_count; ++i)
+    {
+      if (&svr->parent->shards[i] != svr)
+        server_submit(&svr->parent->shards[i], CONN_ID_NONE, shared, true);
+    }
+    shared_packet_release(shared);
+  }
+  if (result != 0)
+    HLOG_ERROR("Error, Topic message %u of %u bytes from %s refused\n", header->message_type, length, get_endpoint_address_str(client));
+  return result;
+}
+
+int server_submit_packet(hserver_t* svr, conn_id_t id, hp_packet_t* packet)
+{
+  hp_shared_packet_t *shared = shared_packet_create(packet);
+  if (shared == NULL)
+    return -1;
+  int result = server_submit_shared(svr, id, shared);
+  shared_packet_release(shared);
+  return result;
+}
+
+/* Queue everything other threads submitted, or only drop it when the server goes down. */
+static void server_drain_submissions(hserver_t *svr, bool send)
 {
-  /* Queue packet for all clients */
-  for (int i = 0; i < MAX_CLIENTS; ++i)
+  __atomic_store_n(&svr->submission_pending, false, __ATOMIC_SEQ_CST);
+
+  hmpsc_node_t *node;
+  while ((node = hmpsc_pop(&svr->submissions)) != NULL)
   {
-    if (svr->client_list[i].socket != NO_SOCKET)
+    hserver_submission_t *submission = (hserver_submission_t *)node;
+    if (send && submission->publish)
+    {
+      server_publish_shared(svr, submission->packet);
+    }
+    else if (send && submission->id == CONN_ID_NONE)
+    {
+      server_queue_send_shared(svr, submission->packet);
+    }
+    else if (send)
     {
-      if (endpoint_queue_send(&svr->client_list[i], new_packet) != 0)
+      endpoint_t *client = conn_table_find_id(&svr->clients, submission->id);
+      if (client == NULL || endpoint_queue_shared(client, submission->packet) != 0)
       {
-#ifdef HCOMM_DEBUG_ERROR
-        printf("Error, Send queue is full, we lost this packet!\n");
-#endif
-        continue;
+        HLOG_ERROR("Error, submitted packet for client %llx dropped\n", (unsigned long long)submission->id);
       }
-#ifdef HCOM_DEBUG_VERBOSE
-      printf("Info, New packet queued for sending.\n");
-#endif
     }
+    shared_packet_release(submission->packet);
+    free(submission);
   }
-
-  return 0;
 }
 
 int server_handle_received_packet(hp_packet_t *packet)
@@ -219,92 +571,256 @@ int server_handle_received_packet(hp_packet_t *packet)
   return 0;
 }
 
+static void server_pin_thread(uint32_t shard_id)
+{
+#ifdef __linux__
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus <= 0)
+    return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(shard_id % cpus, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0)
+  {
+    HLOG_ERROR("Error, pinning shard %u to CPU %ld failed: %d\n", shard_id, shard_id % cpus, errno);
+  }
+#endif
+}
+
+static void *server_shard_thread(void *arg)
+{
+  hserver_t *shard = arg;
+  if (shard->pin_shards)
+    server_pin_thread(shard->shard_id);
+  if (shard->hugepages)
+    hp_pool_use_hugepages(true);
+
+  while (__atomic_load_n(&shard->running, __ATOMIC_ACQUIRE))
+  {
+    if (server_poll(shard, -1) < 0)
+      break;
+  }
+  server_shutdown(shard, EXIT_SUCCESS);
+  hp_pool_drain();
+  return NULL;
+}
+
+static void server_free_shards(hserver_t* svr, uint32_t count)
+{
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    if (svr->shards[i].initialized)
+      server_shutdown(&svr->shards[i], EXIT_SUCCESS);
+  }
+  free(svr->shards);
+  svr->shards = NULL;
+}
+
+/* Every shard is a complete server of its own sharing the port through SO_REUSEPORT. */
+static int server_init_shards(hserver_t* svr)
+{
+  // Unix sockets don't spread connections over SO_REUSEPORT listeners
+  if (svr->unix_path)
+  {
+    HLOG_ERROR("Error, shards can't share the unix socket %s\n", svr->unix_path);
+    return -1;
+  }
+  svr->shards = calloc(svr->shard_count, sizeof(hserver_t));
+  if (svr->shards == NULL)
+    return -1;
+
+  for (uint32_t i = 0; i < svr->shard_count; ++i)
+  {
+    hserver_t *shard = &svr->shards[i];
+    *shard = *svr;
+    shard->shard_count = 0;
+    shard->shards = NULL;
+    shard->shard_id = i;
+    shard->parent = svr;
+    shard->reuse_port = true;
+    shard->running = false;
+    if (server_init(shard) != 0)
+    {
+      server_free_shards(svr, i);
+      return -1;
+    }
+  }
+  svr->listen_sock = NO_SOCKET;
+  svr->reserve_fd = NO_SOCKET;
+  // Submissions go straight to the shards, the queue of the parent stays empty but valid
+  hmpsc_init(&svr->submissions);
+  svr->submission_pending = false;
+  svr->initialized = true;
+  return 0;
+}
+
+/* Start the metrics listener of a server set up by server_init(), tearing it down again on failure. */
+static int server_init_metrics(hserver_t* svr)
+{
+  if (svr->parent != NULL || svr->metrics_port == 0)
+    return 0;
+  if (server_metrics_start(svr) == 0)
+    return 0;
+  if (svr->shards != NULL)
+  {
+    server_free_shards(svr, svr->shard_count);
+    svr->initialized = false;
+  }
+  else
+  {
+    server_shutdown(svr, EXIT_FAILURE);
+  }
+  return -1;
+}
+
 int server_init(hserver_t* svr)
 {
+  memset(&svr->stats, 0, sizeof(svr->stats));
+  hhist_reset(&svr->rtt.hist);
+  svr->rtt.sequence = 0;
+  svr->metrics_running = false;
+  if (svr->shard_count > 0)
+  {
+    if (server_init_shards(svr) != 0)
+      return -1;
+    return server_init_metrics(svr);
+  }
+
+  if (event_loop_init(&svr->loop, svr->event_backend) != 0)
+    return -1;
+
   int result = server_start_listening(svr);
   if ( result != 0)
+  {
+      event_loop_close(&svr->loop);
       return result;
+  }
 
-  for (int i = 0; i < MAX_CLIENTS; ++i)
+  // The listening socket is told apart from the clients by its data pointer
+  if (event_loop_add(&svr->loop, svr->listen_sock, HEVENT_READ | HEVENT_ACCEPT, svr) != 0)
   {
-    svr->client_list[i].socket = NO_SOCKET;
-    create_endpoint(&svr->client_list[i]);
+      close(svr->listen_sock);
+      event_loop_close(&svr->loop);
+      return -1;
   }
+
+  conn_table_init(&svr->clients, svr->max_clients ? svr->max_clients : SERVER_DEFAULT_MAX_CLIENTS);
+  htopic_index_init(&svr->topics);
+  svr->clients.id_tag = (conn_id_t)svr->shard_id << 56;
+  hmpsc_init(&svr->submissions);
+  svr->submission_pending = false;
+  svr->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  htimer_init(&svr->accept_retry, server_accept_resume, svr);
   svr->initialized = true;
-  return 0;
+  return server_init_metrics(svr);
 }
 
-int server_periodic(hserver_t* svr)
+/* Run every shard prepared by server_init() in a thread of its own. */
+int server_start(hserver_t* svr)
 {
-    int high_sock = svr->listen_sock;
-    server_build_fd_sets(svr);
+  if (!svr->initialized || svr->shards == NULL)
+    return -1;
 
-    for (int i = 0; i < MAX_CLIENTS; ++i)
+  for (uint32_t i = 0; i < svr->shard_count; ++i)
+  {
+    hserver_t *shard = &svr->shards[i];
+    __atomic_store_n(&shard->running, true, __ATOMIC_RELEASE);
+    if (pthread_create(&shard->thread, NULL, server_shard_thread, shard) != 0)
     {
-      if (svr->client_list[i].socket > svr->listen_sock)
-          high_sock = svr->client_list[i].socket;
+      HLOG_ERROR("Error, starting shard %u failed: %d\n", i, errno);
+      shard->running = false;
+      server_stop(svr);
+      return -1;
     }
-    struct timeval select_timeout = { .tv_sec = 0, .tv_usec = 0 };
-    int result = select(high_sock + 1, &svr->read_fds, &svr->write_fds, &svr->error_fds, &select_timeout);
+  }
+  svr->running = true;
+  return 0;
+}
+
+/* Stop and join the shard threads, then close every shard. */
+void server_stop(hserver_t* svr)
+{
+  if (svr->shards == NULL)
+    return;
+  // The listener reads the shards until it stopped
+  server_metrics_stop(svr);
 
-    if (result == -1)
+  for (uint32_t i = 0; i < svr->shard_count; ++i)
+  {
+    hserver_t *shard = &svr->shards[i];
+    if (!__atomic_exchange_n(&shard->running, false, __ATOMIC_ACQ_REL))
+      continue;
+    event_loop_wake(&shard->loop);
+    pthread_join(shard->thread, NULL);
+  }
+  server_free_shards(svr, svr->shard_count);
+  svr->running = false;
+  svr->initialized = false;
+}
+
+/* Wait up to timeout_ms for socket events (-1 blocks) and service them. */
+int server_poll(hserver_t* svr, int timeout_ms)
+{
+    if (!svr->initialized || svr->shards != NULL)
+      return -1;
+
+    int count = event_loop_wait(&svr->loop, timeout_ms);
+    if (count < 0)
     {
-#ifdef HCOMM_DEBUG_ERROR
-        printf("Error, select failed: %d\n", errno);
-#endif
         server_shutdown(svr, EXIT_FAILURE);
+        return -1;
     }
-    // Select returned something
-    else if (result > 0)
-    {
-      /* All set fds should be checked. */
-      if (FD_ISSET(svr->listen_sock, &svr->read_fds))
-      {
-        server_handle_new_connection(svr);
-      }
-      if (FD_ISSET(svr->listen_sock, &svr->error_fds))
-      {
-#ifdef HCOMM_DEBUG_ERROR
-        printf("Error, error_fds on listen socket fd.\n");
-#endif
-        server_shutdown(svr, EXIT_FAILURE);
-      }
+    if (__atomic_load_n(&svr->submission_pending, __ATOMIC_ACQUIRE))
+      server_drain_submissions(svr, true);
 
-      for (int i = 0; i < MAX_CLIENTS; ++i)
+    for (int n = 0; n < count; ++n)
+    {
+      hevent_t *ev = &svr->loop.events[n];
+      if (ev->data == svr)
       {
-        if (svr->client_list[i].socket == NO_SOCKET)
-          continue;
-        
-        if (FD_ISSET(svr->client_list[i].socket, &svr->error_fds))
+        if (ev->events & HEVENT_ERROR)
         {
-#ifdef HCOMM_DEBUG_ERROR
-          printf("Error, error_fds for client fd.\n");
-#endif
-          svr->client_disconnected_callback(svr, i);
-          server_close_client_connection(&svr->client_list[i]);          
-          continue;
+          HLOG_ERROR("Error, error event on listen socket fd.\n");
+          server_shutdown(svr, EXIT_FAILURE);
+          return -1;
         }
-
-        if (FD_ISSET(svr->client_list[i].socket, &svr->read_fds))
+        if (ev->events & HEVENT_ACCEPT)
         {
-          if (receive_from_endpoint(&svr->client_list[i]) < 0)
-          {              
-              svr->client_disconnected_callback(svr, i);
-              server_close_client_connection(&svr->client_list[i]);
-              continue;
+          if (ev->result >= 0)
+          {
+            server_add_connection(svr, ev->result, NULL);
+            continue;
           }
+          // io_uring ended its accept with the failure. It takes the descriptor before it looks at the
+          // backlog and fails again at once, so it is only armed again right away after a dropped connection.
+          if (server_accept_failed(svr, -ev->result) == -2)
+            event_loop_modify(&svr->loop, svr->listen_sock, HEVENT_READ | HEVENT_ACCEPT, svr);
+          else if (!htimer_active(&svr->accept_retry))
+            htimer_add(&svr->loop.timers, &svr->accept_retry, SERVER_ACCEPT_RETRY_MS, 0);
+          continue;
         }
+        // Drain the backlog until EAGAIN, an edge is only reported once
+        while (server_handle_new_connection(svr) != -1)
+          ;
+        continue;
+      }
 
-        if (FD_ISSET(svr->client_list[i].socket, &svr->write_fds))
-        {
-          if (send_to_endpoint(&svr->client_list[i]) < 0)
-          {                          
-              svr->client_disconnected_callback(svr, i);
-              server_close_client_connection(&svr->client_list[i]);
-              continue;
-          }
-        }
+      endpoint_t *client = ev->data;
+      if (client->live_index < 0)
+        continue;
+      if (svr->idle_timeout_ms != 0 && (ev->events & HEVENT_READ))
+        htimer_rearm(&svr->loop.timers, &client->idle_timer, svr->idle_timeout_ms);
+      int result = endpoint_handle_event(client, ev);
+      if (result < 0)
+      {
+        svr->client_disconnected_callback(svr, client);
+        server_remove_client(svr, client, server_disconnect_reason(result));
       }
     }
-    return 0;
+    return count;
+}
+
+int server_periodic(hserver_t* svr)
+{
+    return server_poll(svr, 0);
 }
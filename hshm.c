@@ -0,0 +1,591 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "hcomm.h"
+
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC            (0)
+#endif
+
+/*
+ * Shared memory transport.
+ *
+ * Two processes on one host connected through a unix socket may move their frames through a pair
+ * of rings in memory both have mapped. The client offers one: it creates the region and two event
+ * descriptors and passes them with SCM_RIGHTS alongside a HP_MSG_SHM frame, then holds back what
+ * it sends until the server answered. A server taking the offer maps the region, answers through
+ * the socket and sends whatever it had queued before the answer through the socket too, the rest
+ * follows in the ring. That keeps the frames in order across the switch on both sides.
+ *
+ * Each ring is a single producer single consumer byte stream carrying the frames exactly as the
+ * socket did. Head and tail count the bytes ever written and read. A side that ran dry or out of
+ * room raises its waiting flag and looks once more, the other side rings its doorbell only when it
+ * finds the flag raised, so a busy pair exchanges frames without a single system call. Doorbells
+ * are eventfds registered with the event loop, the socket stays registered too and tells when the
+ * peer process is gone.
+ */
+
+#define HSHM_MAGIC                  (0x6873686d)
+#define HSHM_CACHE_LINE             (64)
+#define HSHM_OFFER                  (0)
+#define HSHM_ACCEPT                 (1)
+#define HSHM_REFUSE                 (2)
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t ring_size;
+    uint8_t pad[HSHM_CACHE_LINE - 8];
+} hshm_region_header_t;
+
+// Producer and consumer side on lines of their own
+typedef struct hshm_ring_t
+{
+    uint32_t head;
+    uint32_t producer_waiting;          /*!< Raised by the producer while it waits for room. */
+    uint32_t closed;                    /*!< The producer closed the connection. */
+    uint8_t producer_pad[HSHM_CACHE_LINE - 12];
+    uint32_t tail;
+    uint32_t consumer_waiting;          /*!< Raised by the consumer while it waits for bytes. */
+    uint8_t consumer_pad[HSHM_CACHE_LINE - 8];
+} hshm_ring_t;
+
+/* The region holds its header, the offering side's ring and the other one, then their bytes. */
+static size_t hshm_region_size(uint32_t ring_size)
+{
+    return sizeof(hshm_region_header_t) + 2 * sizeof(hshm_ring_t) + 2 * (size_t)ring_size;
+}
+
+static void hshm_ring_doorbell(int fd)
+{
+#ifdef __linux__
+    uint64_t one = 1;
+    // A full counter already means the peer has something to look at
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    {
+        HLOG_ERROR("Error, ringing shared memory doorbell %d failed: %d\n", fd, errno);
+    }
+#endif
+}
+
+/* Point rx and tx into the region, offering tells which ring is sent into. */
+static void hshm_layout(hshm_t *shm, bool offering)
+{
+    uint8_t *base = shm->region;
+    hshm_ring_t *rings = (hshm_ring_t *)(base + sizeof(hshm_region_header_t));
+    uint8_t *data = (uint8_t *)(rings + 2);
+    int tx = offering ? 0 : 1;
+    shm->tx = &rings[tx];
+    shm->rx = &rings[1 - tx];
+    shm->tx_data = data + (size_t)tx * shm->ring_size;
+    shm->rx_data = data + (size_t)(1 - tx) * shm->ring_size;
+    shm->tx_head = shm->tx->head;
+    shm->rx_tail = shm->rx->tail;
+}
+
+static hshm_t *hshm_alloc(hshm_state_t state)
+{
+    hshm_t *shm = calloc(1, sizeof(hshm_t));
+    if (shm == NULL)
+        return NULL;
+    shm->state = state;
+    shm->fds[0] = shm->fds[1] = shm->fds[2] = -1;
+    shm->doorbell = -1;
+    shm->peer_doorbell = -1;
+    return shm;
+}
+
+static void hshm_free(hshm_t *shm)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        if (shm->fds[i] >= 0)
+            close(shm->fds[i]);
+    }
+    if (shm->doorbell >= 0)
+        close(shm->doorbell);
+    if (shm->peer_doorbell >= 0)
+        close(shm->peer_doorbell);
+    if (shm->region != NULL)
+        munmap(shm->region, shm->region_size);
+    free(shm);
+}
+
+static int hshm_register(endpoint_t *endpoint, hshm_t *shm)
+{
+    if (event_loop_add(endpoint->loop, shm->doorbell, HEVENT_READ, endpoint) != 0)
+        return -1;
+    shm->doorbell_registered = true;
+    return 0;
+}
+
+#ifdef __linux__
+/* Create the region and doorbells of an offer, the rings start with both consumers waiting. */
+static hshm_t *hshm_create(void)
+{
+    hshm_t *shm = hshm_alloc(HSHM_OFFERED);
+    if (shm == NULL)
+        return NULL;
+    shm->ring_size = HSHM_RING_SIZE;
+    shm->region_size = hshm_region_size(shm->ring_size);
+    shm->fds[0] = memfd_create("hcomm-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    shm->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    shm->peer_doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shm->fds[0] < 0 || shm->doorbell < 0 || shm->peer_doorbell < 0 || ftruncate(shm->fds[0], shm->region_size) != 0)
+    {
+        HLOG_ERROR("Error, creating a shared memory region failed: %d\n", errno);
+        hshm_free(shm);
+        return NULL;
+    }
+    // The peer maps it as well, it must not shrink under it
+    fcntl(shm->fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+    void *region = mmap(NULL, shm->region_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fds[0], 0);
+    if (region == MAP_FAILED)
+    {
+        HLOG_ERROR("Error, mapping a shared memory region failed: %d\n", errno);
+        hshm_free(shm);
+        return NULL;
+    }
+    shm->region = region;
+    hshm_region_header_t *header = region;
+    header->magic = HSHM_MAGIC;
+    header->ring_size = shm->ring_size;
+    hshm_layout(shm, true);
+    shm->tx->consumer_waiting = 1;
+    shm->rx->consumer_waiting = 1;
+    return shm;
+}
+#endif
+
+/* Offer a connected unix socket endpoint the shared memory transport. Returns 0 once offered or
+   when no shared memory could be set up, the connection then carries on over the socket, and a
+   negative value only when the socket failed. Completion backends keep to the socket. */
+int endpoint_offer_shm(endpoint_t *endpoint)
+{
+#ifdef __linux__
+    if (endpoint->shm != NULL || endpoint->loop == NULL || endpoint->loop->backend == HEVENT_BACKEND_URING)
+        return 0;
+    hshm_t *shm = hshm_create();
+    if (shm == NULL)
+        return 0;
+    if (hshm_register(endpoint, shm) != 0)
+    {
+        hshm_free(shm);
+        return 0;
+    }
+
+    uint8_t frame[HP_PACKET_HEADER_SIZE + 1];
+    hp_packet_header *header = (hp_packet_header *)frame;
+    memset(frame, 0, sizeof(frame));
+    header->message_type = HP_MSG_SHM;
+    header->message_size = 1;
+    frame[HP_PACKET_HEADER_SIZE] = HSHM_OFFER;
+    struct iovec iov = { .iov_base = frame, .iov_len = sizeof(frame) };
+
+    // The peer gets its own doorbell second and the one of this side third
+    int fds[3] = { shm->fds[0], shm->peer_doorbell, shm->doorbell };
+    union
+    {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(fds))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t sent = sendmsg(endpoint->socket, &msg, MSG_NOSIGNAL);
+    if (sent != (ssize_t)sizeof(frame))
+    {
+        HLOG_ERROR("Error, sending the shared memory offer to %s failed: %d\n", get_endpoint_address_str(endpoint), errno);
+        endpoint->shm = shm;
+        hshm_close(endpoint);
+        // Nothing went out on a full socket, part of the frame breaks the stream
+        return sent > 0 || (errno != EAGAIN && errno != EWOULDBLOCK) ? -1 : 0;
+    }
+    // The peer holds the region now
+    close(shm->fds[0]);
+    shm->fds[0] = -1;
+    endpoint->shm = shm;
+    HLOG_VERBOSE("Info, Offered shared memory to %s.\n", get_endpoint_address_str(endpoint));
+    return 0;
+#else
+    return 0;
+#endif
+}
+
+/* recv() from a unix socket that may carry the descriptors of an offer, they are kept for its frame.
+   Descriptors coming any other time, any other number of them or cut short are closed. */
+ssize_t hshm_recvmsg(endpoint_t *endpoint, void *buffer, size_t length)
+{
+    union
+    {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct iovec iov = { .iov_base = buffer, .iov_len = length };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    ssize_t received = recvmsg(endpoint->socket, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (received <= 0)
+        return received;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        // CMSG_SPACE() rounds up, room for 3 descriptors takes a fourth
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        hshm_t *shm = NULL;
+        if (count == 3 && !(msg.msg_flags & MSG_CTRUNC) && endpoint->shm == NULL)
+            shm = hshm_alloc(HSHM_RECEIVED);
+        if (shm == NULL)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+                close(fd);
+            }
+            continue;
+        }
+        memcpy(shm->fds, CMSG_DATA(cmsg), sizeof(shm->fds));
+        endpoint->shm = shm;
+    }
+    return received;
+}
+
+/* Map the region of a received offer and check it holds what its header claims. */
+static int hshm_attach(endpoint_t *endpoint, hshm_t *shm)
+{
+    struct stat st;
+    hshm_region_header_t header;
+    if (fstat(shm->fds[0], &st) != 0 || (size_t)st.st_size < sizeof(header) || pread(shm->fds[0], &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+        return -1;
+    if (header.magic != HSHM_MAGIC || header.ring_size < HSHM_RING_MIN_SIZE || header.ring_size > HSHM_RING_MAX_SIZE ||
+        (header.ring_size & (header.ring_size - 1)) != 0 || (size_t)st.st_size < hshm_region_size(header.ring_size))
+        return -1;
+#ifdef F_SEAL_SHRINK
+    // A region that may shrink could fault this process
+    int seals = fcntl(shm->fds[0], F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK))
+        return -1;
+#endif
+    shm->ring_size = header.ring_size;
+    shm->region_size = hshm_region_size(header.ring_size);
+    void *region = mmap(NULL, shm->region_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fds[0], 0);
+    if (region == MAP_FAILED)
+        return -1;
+    shm->region = region;
+    close(shm->fds[0]);
+    shm->doorbell = shm->fds[1];
+    shm->peer_doorbell = shm->fds[2];
+    shm->fds[0] = shm->fds[1] = shm->fds[2] = -1;
+    hshm_layout(shm, false);
+    return hshm_register(endpoint, shm);
+}
+
+/* Take an offer that came with its descriptors, or refuse it. */
+static int hshm_take_offer(endpoint_t *endpoint)
+{
+    uint8_t answer = HSHM_REFUSE;
+    hshm_t *shm = endpoint->shm;
+    if (shm != NULL && shm->state == HSHM_RECEIVED)
+    {
+        if (endpoint->shared_memory && endpoint->loop != NULL && hshm_attach(endpoint, shm) == 0)
+        {
+            answer = HSHM_ACCEPT;
+        }
+        else
+        {
+            if (endpoint->shared_memory)
+                HLOG_ERROR("Error, the shared memory offered by %s is unusable\n", get_endpoint_address_str(endpoint));
+            hshm_close(endpoint);
+        }
+    }
+    if (endpoint_send_message(endpoint, HP_MSG_SHM, &answer, 1) != 0)
+        return -1;
+    if (answer == HSHM_REFUSE)
+        return 0;
+
+    // The answer ends what goes through the socket, whatever arrived in the ring before is read
+    endpoint->shm->state = HSHM_SWITCHING;
+    endpoint->shm->socket_backlog = packet_queue_count(&endpoint->send_queue);
+    hshm_ring_doorbell(endpoint->shm->doorbell);
+    HLOG_VERBOSE("Info, Took the shared memory offered by %s.\n", get_endpoint_address_str(endpoint));
+    return 0;
+}
+
+/* Handle a HP_MSG_SHM frame: an offer, or the answer to the one this side sent. */
+int hshm_dispatch(endpoint_t *endpoint, uint8_t *message, uint32_t length)
+{
+    if (length != 1)
+    {
+        HLOG_ERROR("Error, Received a shared memory frame of %u bytes from %s\n", length, get_endpoint_address_str(endpoint));
+        return -HP_EX_INVALID_MSG_SIZE;
+    }
+    if (message[0] == HSHM_OFFER)
+        return hshm_take_offer(endpoint);
+
+    hshm_t *shm = endpoint->shm;
+    if (shm == NULL || shm->state != HSHM_OFFERED)
+        return 0;
+    if (message[0] != HSHM_ACCEPT)
+    {
+        HLOG_VERBOSE("Info, %s refused shared memory.\n", get_endpoint_address_str(endpoint));
+        hshm_close(endpoint);
+        return endpoint_update_events(endpoint);
+    }
+    // Nothing follows the answer in the socket, the held packets go into the ring
+    hshm_ring_doorbell(shm->doorbell);
+    return hshm_switch(endpoint);
+}
+
+/* Move write interest from the socket to the doorbell once nothing is left to send through the
+   socket. The socket stays registered for reading, that is how the peer going away shows. */
+int hshm_switch(endpoint_t *endpoint)
+{
+    hshm_t *shm = endpoint->shm;
+    shm->state = HSHM_ACTIVE;
+    shm->socket_backlog = 0;
+    if (endpoint->loop == NULL)
+        return 0;
+    if (endpoint->registered_events != HEVENT_READ && event_loop_modify(endpoint->loop, endpoint->socket, HEVENT_READ, endpoint) != 0)
+        return -1;
+    endpoint->registered_events = HEVENT_READ;
+    return endpoint_update_events(endpoint);
+}
+
+/* Make the bytes written so far visible and wake the consumer when it waits for them. */
+static void hshm_publish(hshm_t *shm)
+{
+    __atomic_store_n(&shm->tx->head, shm->tx_head, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&shm->tx->consumer_waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(&shm->tx->consumer_waiting, 0, __ATOMIC_ACQ_REL))
+        hshm_ring_doorbell(shm->peer_doorbell);
+}
+
+/* Hand the room read so far back and wake the producer when it waits for it. */
+static void hshm_release(hshm_t *shm)
+{
+    __atomic_store_n(&shm->rx->tail, shm->rx_tail, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&shm->rx->producer_waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(&shm->rx->producer_waiting, 0, __ATOMIC_ACQ_REL))
+        hshm_ring_doorbell(shm->peer_doorbell);
+}
+
+/* Room left in the ring sent into, -1 when the peer moved the tail somewhere it can't be. */
+static int64_t hshm_tx_room(hshm_t *shm)
+{
+    uint32_t used = shm->tx_head - __atomic_load_n(&shm->tx->tail, __ATOMIC_ACQUIRE);
+    if (used > shm->ring_size)
+        return -1;
+    return shm->ring_size - used;
+}
+
+/* Like sendmsg(): copy as much of iov into the ring as fits. A short count means the ring is full
+   and the peer rings once it made room, nothing copied fails with EAGAIN. */
+ssize_t hshm_send(endpoint_t *endpoint, const struct iovec *iov, int iov_count)
+{
+    hshm_t *shm = endpoint->shm;
+    size_t sent = 0;
+    size_t offset = 0;
+    bool waiting = false;
+    int i = 0;
+    while (i < iov_count)
+    {
+        int64_t room = hshm_tx_room(shm);
+        if (room < 0)
+        {
+            errno = EIO;
+            return -1;
+        }
+        if (room == 0)
+        {
+            if (waiting)
+            {
+                shm->tx_full = true;
+                break;
+            }
+            // Show the peer what is there, ask it to ring once it made room and look once more
+            hshm_publish(shm);
+            __atomic_store_n(&shm->tx->producer_waiting, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            waiting = true;
+            continue;
+        }
+        if (waiting)
+        {
+            __atomic_store_n(&shm->tx->producer_waiting, 0, __ATOMIC_RELAXED);
+            waiting = false;
+        }
+
+        size_t length = iov[i].iov_len - offset;
+        if (length > (size_t)room)
+            length = room;
+        uint32_t position = shm->tx_head & (shm->ring_size - 1);
+        size_t first = shm->ring_size - position < length ? shm->ring_size - position : length;
+        const uint8_t *from = (const uint8_t *)iov[i].iov_base + offset;
+        memcpy(shm->tx_data + position, from, first);
+        memcpy(shm->tx_data, from + first, length - first);
+        shm->tx_head += length;
+        sent += length;
+        offset += length;
+        if (offset == iov[i].iov_len)
+        {
+            offset = 0;
+            i++;
+        }
+    }
+    if (sent == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    hshm_publish(shm);
+    return sent;
+}
+
+/* Like recv(): copy up to length bytes out of the ring. A short count means the ring ran dry and
+   the peer rings once it wrote more, nothing copied fails with EAGAIN or returns 0 once the peer
+   closed. */
+ssize_t hshm_recv(endpoint_t *endpoint, void *buffer, size_t length)
+{
+    hshm_t *shm = endpoint->shm;
+    size_t received = 0;
+    bool waiting = false;
+    while (received < length)
+    {
+        uint32_t available = __atomic_load_n(&shm->rx->head, __ATOMIC_ACQUIRE) - shm->rx_tail;
+        if (available > shm->ring_size)
+        {
+            errno = EIO;
+            return -1;
+        }
+        if (available == 0)
+        {
+            if (waiting)
+                break;
+            if (received > 0)
+                hshm_release(shm);
+            __atomic_store_n(&shm->rx->consumer_waiting, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            waiting = true;
+            continue;
+        }
+        if (waiting)
+        {
+            __atomic_store_n(&shm->rx->consumer_waiting, 0, __ATOMIC_RELAXED);
+            waiting = false;
+        }
+
+        size_t count = length - received < available ? length - received : available;
+        uint32_t position = shm->rx_tail & (shm->ring_size - 1);
+        size_t first = shm->ring_size - position < count ? shm->ring_size - position : count;
+        memcpy((uint8_t *)buffer + received, shm->rx_data + position, first);
+        memcpy((uint8_t *)buffer + received + first, shm->rx_data, count - first);
+        shm->rx_tail += count;
+        received += count;
+    }
+    if (received > 0)
+    {
+        hshm_release(shm);
+        return received;
+    }
+    if (shm->peer_closed || __atomic_load_n(&shm->rx->closed, __ATOMIC_ACQUIRE))
+        return 0;
+    errno = EAGAIN;
+    return -1;
+}
+
+/* Look at what woke the endpoint before reading the ring: the doorbell, or else the socket, which
+   only ever reports the peer going away. A ring with room again turns write interest back on. */
+int hshm_poll(endpoint_t *endpoint)
+{
+    hshm_t *shm = endpoint->shm;
+    if (shm->state != HSHM_SWITCHING && shm->state != HSHM_ACTIVE)
+        return 0;
+    uint64_t count;
+    if (read(shm->doorbell, &count, sizeof(count)) < 0)
+    {
+        uint8_t byte;
+        ssize_t result = recv(endpoint->socket, &byte, 1, MSG_DONTWAIT);
+        if (result == 0)
+        {
+            shm->peer_closed = true;
+            // The ring isn't read while throttled, nobody is left to drain the queue either
+            if (shm->reads_paused)
+                return HP_SOCKET_ZERO_READ;
+        }
+        else if (result > 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            HLOG_ERROR("Error, %s used the socket after switching to shared memory\n", get_endpoint_address_str(endpoint));
+            return HP_SOCKET_READ_ERROR;
+        }
+    }
+    if (shm->tx_full && hshm_tx_room(shm) != 0)
+    {
+        shm->tx_full = false;
+        return endpoint_update_events(endpoint);
+    }
+    return 0;
+}
+
+/* Track whether the endpoint stopped reading, when it resumes the ring may hold bytes nobody is going
+   to ring for. */
+void hshm_set_reads_paused(endpoint_t *endpoint, bool paused)
+{
+    hshm_t *shm = endpoint->shm;
+    if (shm->reads_paused && !paused && shm->doorbell_registered)
+        hshm_ring_doorbell(shm->doorbell);
+    shm->reads_paused = paused;
+}
+
+void hshm_unregister(endpoint_t *endpoint)
+{
+    hshm_t *shm = endpoint->shm;
+    if (shm->doorbell_registered && endpoint->loop != NULL)
+        event_loop_remove(endpoint->loop, shm->doorbell);
+    shm->doorbell_registered = false;
+}
+
+/* Tell the peer nothing more is coming and let go of the rings. */
+void hshm_close(endpoint_t *endpoint)
+{
+    hshm_t *shm = endpoint->shm;
+    if (shm == NULL)
+        return;
+    hshm_unregister(endpoint);
+    if (shm->region != NULL && shm->state != HSHM_OFFERED)
+    {
+        __atomic_store_n(&shm->tx->closed, 1, __ATOMIC_RELEASE);
+        hshm_ring_doorbell(shm->peer_doorbell);
+    }
+    hshm_free(shm);
+    endpoint->shm = NULL;
+}
@@ -0,0 +1,213 @@
+#include <limits.h>
+#include <time.h>
+
+#include "hcomm.h"
+
+/*
+ * Hierarchical timer wheel.
+ *
+ * Level 0 has a slot per millisecond, every level above covers HTIMER_SLOTS slots of the one below.
+ * A timer sits in the slot of its due time on the lowest level its distance fits, and moves down a
+ * level (cascades) once the wheel reaches the start of that slot, so add, cancel and expiry are O(1).
+ * A bitmap of the non empty slots per level finds the next due time without scanning, which lets
+ * the event loop sleep exactly until then and skip idle stretches in a few steps.
+ */
+
+#define HTIMER_MASK                 ((uint64_t)HTIMER_SLOTS - 1)
+#define HTIMER_SPAN                 ((uint64_t)1 << (HTIMER_LEVEL_BITS * HTIMER_LEVELS))
+
+uint64_t htimer_now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void htimer_link(htimer_wheel_t *wheel, htimer_t *timer)
+{
+    uint64_t delta = timer->expires > wheel->now ? timer->expires - wheel->now : 0;
+    uint64_t due = timer->expires;
+    if (delta >= HTIMER_SPAN)
+    {
+        // Beyond the top level, park it as far as possible and let it cascade there again
+        due = wheel->now + HTIMER_SPAN - 1;
+        delta = HTIMER_SPAN - 1;
+    }
+
+    int level = 0;
+    while (level < HTIMER_LEVELS - 1 && delta >= ((uint64_t)1 << (HTIMER_LEVEL_BITS * (level + 1))))
+        level++;
+    uint32_t index = (due >> (HTIMER_LEVEL_BITS * level)) & HTIMER_MASK;
+
+    htimer_t **head = &wheel->slots[level][index];
+    timer->next = *head;
+    if (timer->next != NULL)
+        timer->next->pprev = &timer->next;
+    timer->pprev = head;
+    *head = timer;
+    wheel->occupied[level] |= (uint64_t)1 << index;
+}
+
+static void htimer_unlink(htimer_wheel_t *wheel, htimer_t *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next != NULL)
+        timer->next->pprev = timer->pprev;
+
+    // A timer first in its slot points into the wheel, clear the slot bit once it empties
+    htimer_t **first = &wheel->slots[0][0];
+    if (timer->pprev >= first && timer->pprev < first + HTIMER_LEVELS * HTIMER_SLOTS && *timer->pprev == NULL)
+    {
+        size_t slot = timer->pprev - first;
+        wheel->occupied[slot / HTIMER_SLOTS] &= ~((uint64_t)1 << (slot % HTIMER_SLOTS));
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/* Move a whole slot out of the wheel, its timers keep linking to the local head. */
+static htimer_t *htimer_take_slot(htimer_wheel_t *wheel, int level, uint32_t index, htimer_t **list)
+{
+    *list = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    wheel->occupied[level] &= ~((uint64_t)1 << index);
+    if (*list != NULL)
+        (*list)->pprev = list;
+    return *list;
+}
+
+/* First millisecond after wheel->now at which a slot is due or cascades, 0 with no timer armed. */
+static uint64_t htimer_next_tick(const htimer_wheel_t *wheel)
+{
+    uint64_t next = 0;
+    for (int level = 0; level < HTIMER_LEVELS; ++level)
+    {
+        uint64_t bits = wheel->occupied[level];
+        if (bits == 0)
+            continue;
+        int shift = HTIMER_LEVEL_BITS * level;
+        uint32_t start = ((wheel->now >> shift) + 1) & HTIMER_MASK;
+        uint64_t rotated = (bits >> start) | (bits << ((HTIMER_SLOTS - start) & HTIMER_MASK));
+        uint64_t tick = ((wheel->now >> shift) + 1 + __builtin_ctzll(rotated)) << shift;
+        if (next == 0 || tick < next)
+            next = tick;
+    }
+    return next;
+}
+
+void htimer_wheel_init(htimer_wheel_t *wheel, uint64_t now_ms)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now_ms;
+}
+
+void htimer_init(htimer_t *timer, htimer_callback_t callback, void *data)
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->callback = callback;
+    timer->data = data;
+}
+
+/* Arm timer delay_ms from now, then every period_ms unless that is 0. Rearms an armed timer. */
+int htimer_add(htimer_wheel_t *wheel, htimer_t *timer, uint32_t delay_ms, uint32_t period_ms)
+{
+    if (timer->callback == NULL)
+        return -1;
+    htimer_cancel(wheel, timer);
+
+    uint64_t now = htimer_now_ms();
+    if (wheel->count == 0)
+        wheel->now = now;
+    // Due at the earliest on the next millisecond, the current one may already be processed
+    timer->expires = now + (delay_ms ? delay_ms : 1);
+    timer->period_ms = period_ms;
+    htimer_link(wheel, timer);
+    wheel->count++;
+    return 0;
+}
+
+/* Move an armed or expired timer to delay_ms from now, keeping its period. */
+int htimer_rearm(htimer_wheel_t *wheel, htimer_t *timer, uint32_t delay_ms)
+{
+    return htimer_add(wheel, timer, delay_ms, timer->period_ms);
+}
+
+void htimer_cancel(htimer_wheel_t *wheel, htimer_t *timer)
+{
+    if (timer->pprev == NULL)
+        return;
+    htimer_unlink(wheel, timer);
+    wheel->count--;
+}
+
+bool htimer_active(const htimer_t *timer)
+{
+    return timer->pprev != NULL;
+}
+
+/* Milliseconds until the wheel needs htimer_advance() again, -1 with no timer armed. */
+int htimer_next_timeout(const htimer_wheel_t *wheel)
+{
+    if (wheel->count == 0)
+        return -1;
+    uint64_t next = htimer_next_tick(wheel);
+    uint64_t now = htimer_now_ms();
+    if (next <= now)
+        return 0;
+    return next - now > INT_MAX ? INT_MAX : (int)(next - now);
+}
+
+/* Run every timer due up to now_ms, returns how many fired. Callbacks may add and cancel timers. */
+int htimer_advance(htimer_wheel_t *wheel, uint64_t now_ms)
+{
+    int fired = 0;
+    while (wheel->now < now_ms)
+    {
+        uint64_t tick = htimer_next_tick(wheel);
+        if (tick == 0 || tick > now_ms)
+        {
+            wheel->now = now_ms;
+            break;
+        }
+        wheel->now = tick;
+
+        // Cascade from the highest level starting at this tick so nothing lands in an emptied slot
+        int top = 0;
+        while (top < HTIMER_LEVELS - 1 && (tick & (((uint64_t)1 << (HTIMER_LEVEL_BITS * (top + 1))) - 1)) == 0)
+            top++;
+        for (int level = top; level > 0; --level)
+        {
+            htimer_t *list;
+            if (htimer_take_slot(wheel, level, (tick >> (HTIMER_LEVEL_BITS * level)) & HTIMER_MASK, &list) == NULL)
+                continue;
+            while (list != NULL)
+            {
+                htimer_t *timer = list;
+                htimer_unlink(wheel, timer);
+                htimer_link(wheel, timer);
+            }
+        }
+
+        htimer_t *list;
+        if (htimer_take_slot(wheel, 0, tick & HTIMER_MASK, &list) == NULL)
+            continue;
+        while (list != NULL)
+        {
+            htimer_t *timer = list;
+            htimer_unlink(wheel, timer);
+            wheel->count--;
+            if (timer->period_ms != 0)
+            {
+                // Rearm before the callback so it can still cancel or move the timer
+                timer->expires += timer->period_ms;
+                if (timer->expires <= tick)
+                    timer->expires = tick + timer->period_ms;
+                htimer_link(wheel, timer);
+                wheel->count++;
+            }
+            fired++;
+            timer->callback(timer);
+        }
+    }
+    return fired;
+}
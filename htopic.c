@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hcomm.h"
+
+/*
+ * Topic subscription index.
+ *
+ * Topics are levels separated by HTOPIC_SEPARATOR. A pattern may use HTOPIC_ANY_LEVEL for any one
+ * level and end in HTOPIC_ALL_LEVELS for the level above and everything below it, so "prices/#"
+ * subscribes to "prices" and every topic under it.
+ *
+ * Patterns are stored as a tree with a node per level, children sorted for binary search. Every node
+ * keeps the subscriptions of the pattern ending there, each subscription remembers its position so it
+ * is removed in O(1). Matching a topic only descends into the children equal to its next level, the
+ * one level wildcard and the all levels one, so it never looks at subscriptions of other topics.
+ * Every subscriber is also linked to its own subscriptions, which is how a closing connection drops
+ * all of them without searching.
+ */
+
+typedef struct htopic_sub_t
+{
+    struct htopic_sub_t *next;          /*!< Next subscription of the same subscriber. */
+    struct htopic_node_t *node;
+    endpoint_t *subscriber;
+    uint32_t index;                     /*!< Position in node->subs. */
+} htopic_sub_t;
+
+typedef struct htopic_node_t
+{
+    struct htopic_node_t *parent;
+    struct htopic_node_t **children;    /*!< Ordered by htopic_compare(). */
+    uint32_t child_count;
+    uint32_t child_capacity;
+    htopic_sub_t **subs;
+    uint32_t sub_count;
+    uint32_t sub_capacity;
+    uint32_t length;
+    char level[];
+} htopic_node_t;
+
+static const char htopic_any_level[] = { HTOPIC_ANY_LEVEL };
+static const char htopic_all_levels[] = { HTOPIC_ALL_LEVELS };
+
+/* Split the level starting at *pos off topic, false once every level was taken. */
+static bool htopic_next_level(const char *topic, uint32_t length, uint32_t *pos, const char **level, uint32_t *level_length)
+{
+    if (*pos > length)
+        return false;
+    const char *end = memchr(topic + *pos, HTOPIC_SEPARATOR, length - *pos);
+    *level = topic + *pos;
+    *level_length = end ? (uint32_t)(end - *level) : length - *pos;
+    *pos += *level_length + 1;
+    return true;
+}
+
+/* Whether pattern may be subscribed, a publish topic must not contain wildcards at all. */
+static bool htopic_valid(const char *topic, uint32_t length, bool pattern)
+{
+    if (length > HTOPIC_MAX_LENGTH)
+        return false;
+    uint32_t pos = 0;
+    const char *level;
+    uint32_t level_length;
+    while (htopic_next_level(topic, length, &pos, &level, &level_length))
+    {
+        bool any = memchr(level, HTOPIC_ANY_LEVEL, level_length) != NULL;
+        bool all = memchr(level, HTOPIC_ALL_LEVELS, level_length) != NULL;
+        if (!pattern && (any || all))
+            return false;
+        if ((any || all) && level_length != 1)
+            return false;
+        if (all && pos <= length)
+            return false;
+    }
+    return true;
+}
+
+static int htopic_compare(const htopic_node_t *node, const char *level, uint32_t length)
+{
+    if (node->length != length)
+        return node->length < length ? -1 : 1;
+    return memcmp(node->level, level, length);
+}
+
+/* Child of node for level, NULL with *slot set to where it belongs when there is none. */
+static htopic_node_t *htopic_find_child(const htopic_node_t *node, const char *level, uint32_t length, uint32_t *slot)
+{
+    uint32_t low = 0;
+    uint32_t high = node->child_count;
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        int order = htopic_compare(node->children[middle], level, length);
+        if (order == 0)
+            return node->children[middle];
+        if (order < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    if (slot != NULL)
+        *slot = low;
+    return NULL;
+}
+
+static htopic_node_t *htopic_node_create(htopic_node_t *parent, const char *level, uint32_t length)
+{
+    htopic_node_t *node = calloc(1, sizeof(htopic_node_t) + length);
+    if (node == NULL)
+        return NULL;
+    node->parent = parent;
+    node->length = length;
+    memcpy(node->level, level, length);
+    return node;
+}
+
+static htopic_node_t *htopic_add_child(htopic_node_t *node, const char *level, uint32_t length)
+{
+    uint32_t slot;
+    htopic_node_t *child = htopic_find_child(node, level, length, &slot);
+    if (child != NULL)
+        return child;
+    if (node->child_count == node->child_capacity)
+    {
+        uint32_t capacity = node->child_capacity ? node->child_capacity * 2 : 4;
+        htopic_node_t **children = realloc(node->children, capacity * sizeof(htopic_node_t *));
+        if (children == NULL)
+            return NULL;
+        node->children = children;
+        node->child_capacity = capacity;
+    }
+    if ((child = htopic_node_create(node, level, length)) == NULL)
+        return NULL;
+    memmove(node->children + slot + 1, node->children + slot, (node->child_count - slot) * sizeof(htopic_node_t *));
+    node->children[slot] = child;
+    node->child_count++;
+    return child;
+}
+
+/* Free node and the parents above it that hold nothing anymore, the root stays. */
+static void htopic_prune(htopic_node_t *node)
+{
+    while (node->parent != NULL && node->sub_count == 0 && node->child_count == 0)
+    {
+        htopic_node_t *parent = node->parent;
+        uint32_t slot = 0;
+        while (parent->children[slot] != node)
+            slot++;
+        memmove(parent->children + slot, parent->children + slot + 1, (parent->child_count - slot - 1) * sizeof(htopic_node_t *));
+        parent->child_count--;
+        free(node->children);
+        free(node->subs);
+        free(node);
+        node = parent;
+    }
+}
+
+/* Node of pattern, created level by level with create, otherwise NULL when nobody subscribed to it. */
+static htopic_node_t *htopic_find(htopic_index_t *index, const char *pattern, uint32_t length, bool create)
+{
+    if (index->root == NULL)
+    {
+        if (!create || (index->root = htopic_node_create(NULL, "", 0)) == NULL)
+            return NULL;
+    }
+    htopic_node_t *node = index->root;
+    uint32_t pos = 0;
+    const char *level;
+    uint32_t level_length;
+    while (node != NULL && htopic_next_level(pattern, length, &pos, &level, &level_length))
+    {
+        htopic_node_t *child = create ? htopic_add_child(node, level, level_length) : htopic_find_child(node, level, level_length, NULL);
+        if (child == NULL && create)
+            htopic_prune(node);
+        node = child;
+    }
+    return node;
+}
+
+void htopic_index_init(htopic_index_t *index)
+{
+    index->root = NULL;
+    index->subscription_count = 0;
+    index->match_seq = 0;
+}
+
+static void htopic_free_node(htopic_node_t *node)
+{
+    for (uint32_t i = 0; i < node->child_count; ++i)
+        htopic_free_node(node->children[i]);
+    for (uint32_t i = 0; i < node->sub_count; ++i)
+    {
+        node->subs[i]->subscriber->subscriptions = NULL;
+        node->subs[i]->subscriber->subscription_count = 0;
+        free(node->subs[i]);
+    }
+    free(node->children);
+    free(node->subs);
+    free(node);
+}
+
+/* Drop every subscription, the subscribers must still be around. */
+void htopic_index_destroy(htopic_index_t *index)
+{
+    if (index->root != NULL)
+        htopic_free_node(index->root);
+    htopic_index_init(index);
+}
+
+/* Subscribe to every topic pattern matches, subscribing twice to the same pattern is a no-op. */
+int htopic_subscribe(htopic_index_t *index, endpoint_t *subscriber, const char *pattern, uint32_t length)
+{
+    if (!htopic_valid(pattern, length, true) || subscriber->subscription_count >= HTOPIC_MAX_SUBSCRIPTIONS)
+        return -1;
+    htopic_node_t *node = htopic_find(index, pattern, length, true);
+    if (node == NULL)
+        return -1;
+    for (htopic_sub_t *sub = subscriber->subscriptions; sub != NULL; sub = sub->next)
+    {
+        if (sub->node == node)
+            return 0;
+    }
+
+    htopic_sub_t *sub = malloc(sizeof(htopic_sub_t));
+    if (sub != NULL && node->sub_count == node->sub_capacity)
+    {
+        uint32_t capacity = node->sub_capacity ? node->sub_capacity * 2 : 4;
+        htopic_sub_t **subs = realloc(node->subs, capacity * sizeof(htopic_sub_t *));
+        if (subs != NULL)
+        {
+            node->subs = subs;
+            node->sub_capacity = capacity;
+        }
+    }
+    if (sub == NULL || node->sub_count == node->sub_capacity)
+    {
+        free(sub);
+        htopic_prune(node);
+        return -1;
+    }
+    sub->node = node;
+    sub->subscriber = subscriber;
+    sub->index = node->sub_count;
+    node->subs[node->sub_count++] = sub;
+    sub->next = subscriber->subscriptions;
+    subscriber->subscriptions = sub;
+    subscriber->subscription_count++;
+    index->subscription_count++;
+    return 0;
+}
+
+/* Unlink sub, which the caller already took off its subscriber list. */
+static void htopic_remove(htopic_index_t *index, htopic_sub_t *sub)
+{
+    htopic_node_t *node = sub->node;
+    htopic_sub_t *moved = node->subs[--node->sub_count];
+    node->subs[sub->index] = moved;
+    moved->index = sub->index;
+    sub->subscriber->subscription_count--;
+    index->subscription_count--;
+    free(sub);
+    htopic_prune(node);
+}
+
+/* Undo htopic_subscribe() of the same pattern, -1 when there was no such subscription. */
+int htopic_unsubscribe(htopic_index_t *index, endpoint_t *subscriber, const char *pattern, uint32_t length)
+{
+    htopic_node_t *node = htopic_find(index, pattern, length, false);
+    if (node == NULL)
+        return -1;
+    for (htopic_sub_t **link = &subscriber->subscriptions; *link != NULL; link = &(*link)->next)
+    {
+        htopic_sub_t *sub = *link;
+        if (sub->node == node)
+        {
+            *link = sub->next;
+            htopic_remove(index, sub);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void htopic_unsubscribe_all(htopic_index_t *index, endpoint_t *subscriber)
+{
+    while (subscriber->subscriptions != NULL)
+    {
+        htopic_sub_t *sub = subscriber->subscriptions;
+        subscriber->subscriptions = sub->next;
+        htopic_remove(index, sub);
+    }
+}
+
+static int htopic_visit_node(htopic_index_t *index, htopic_node_t *node, htopic_visit_t visit, void *context)
+{
+    int visited = 0;
+    for (uint32_t i = 0; i < node->sub_count; ++i)
+    {
+        endpoint_t *subscriber = node->subs[i]->subscriber;
+        if (subscriber->topic_mark == index->match_seq)
+            continue;
+        subscriber->topic_mark = index->match_seq;
+        if (visit(subscriber, context) == 0)
+            visited++;
+    }
+    return visited;
+}
+
+static int htopic_match_node(htopic_index_t *index, htopic_node_t *node, const char *topic, uint32_t length, uint32_t pos, htopic_visit_t visit, void *context)
+{
+    int visited = 0;
+    htopic_node_t *child = htopic_find_child(node, htopic_all_levels, 1, NULL);
+    if (child != NULL)
+        visited += htopic_visit_node(index, child, visit, context);
+
+    const char *level;
+    uint32_t level_length;
+    if (!htopic_next_level(topic, length, &pos, &level, &level_length))
+        return visited + htopic_visit_node(index, node, visit, context);
+    if ((child = htopic_find_child(node, level, level_length, NULL)) != NULL)
+        visited += htopic_match_node(index, child, topic, length, pos, visit, context);
+    if ((child = htopic_find_child(node, htopic_any_level, 1, NULL)) != NULL)
+        visited += htopic_match_node(index, child, topic, length, pos, visit, context);
+    return visited;
+}
+
+/* Call visit once for every subscriber with a pattern matching topic, however many match. Returns
+   how many visits returned 0, or -1 for a topic with wildcards. visit must not change the index. */
+int htopic_match(htopic_index_t *index, const char *topic, uint32_t length, htopic_visit_t visit, void *context)
+{
+    if (!htopic_valid(topic, length, false))
+        return -1;
+    if (index->root == NULL)
+        return 0;
+    // Zero is what new subscribers start with
+    if (++index->match_seq == 0)
+        index->match_seq = 1;
+    return htopic_match_node(index, index->root, topic, length, 0, visit, context);
+}
+
+/* Build a HP_MSG_PUBLISH frame of message under topic, a large one when it doesn't fit a packet. */
+hp_shared_packet_t *topic_packet_create(const char *topic, const void *message, uint32_t length)
+{
+    size_t topic_length = strlen(topic);
+    if (topic_length > HTOPIC_MAX_LENGTH || length > UINT32_MAX - 1 - topic_length)
+        return NULL;
+    uint32_t total = 1 + topic_length + length;
+    hp_shared_packet_t *shared;
+    uint8_t *data;
+    if (total <= HP_MESSAGE_MAX_SIZE)
+    {
+        hp_packet_t packet;
+        memset(packet.header.raw, 0, sizeof(packet.header));
+        packet.header.message_type = HP_MSG_PUBLISH;
+        packet.header.message_size = total;
+        if ((shared = shared_packet_create(&packet)) == NULL)
+            return NULL;
+        data = shared->packet.message;
+    }
+    else
+    {
+        if ((shared = shared_packet_create_large(HP_MSG_PUBLISH, NULL, total)) == NULL)
+            return NULL;
+        data = shared->packet.raw + HP_LARGE_HEADER_SIZE;
+    }
+    data[0] = topic_length;
+    memcpy(data + 1, topic, topic_length);
+    memcpy(data + 1 + topic_length, message, length);
+    return shared;
+}
+
+/* Split the message of a HP_MSG_PUBLISH frame into topic and payload, -1 when it is malformed. */
+int topic_packet_parse(const uint8_t *message, uint32_t length, const char **topic, uint32_t *topic_length, const uint8_t **payload, uint32_t *payload_length)
+{
+    if (length < 1 || message[0] > length - 1)
+        return -1;
+    *topic = (const char *)message + 1;
+    *topic_length = message[0];
+    *payload = message + 1 + message[0];
+    *payload_length = length - 1 - message[0];
+    return 0;
+}
+
+int endpoint_subscribe(endpoint_t *endpoint, const char *pattern)
+{
+    size_t length = strlen(pattern);
+    if (!htopic_valid(pattern, length, true))
+        return -1;
+    return endpoint_send_message(endpoint, HP_MSG_SUBSCRIBE, pattern, length);
+}
+
+int endpoint_unsubscribe(endpoint_t *endpoint, const char *pattern)
+{
+    size_t length = strlen(pattern);
+    if (length > HTOPIC_MAX_LENGTH)
+        return -1;
+    return endpoint_send_message(endpoint, HP_MSG_UNSUBSCRIBE, pattern, length);
+}
+
+/* Publish message under topic to the peer, a server relays it to its subscribers when it does so. */
+int endpoint_publish(endpoint_t *endpoint, const char *topic, const void *message, uint32_t length)
+{
+    if (!htopic_valid(topic, strlen(topic), false))
+        return -1;
+    hp_shared_packet_t *shared = topic_packet_create(topic, message, length);
+    if (shared == NULL)
+        return -1;
+    int result = endpoint_queue_shared(endpoint, shared);
+    shared_packet_release(shared);
+    return result;
+}
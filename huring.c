@@ -0,0 +1,772 @@
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "hcomm.h"
+
+/*
+ * io_uring transport backend.
+ *
+ * Readiness is replaced by completions: listening sockets get a multishot accept, stream sockets a
+ * multishot recv drawing from a provided buffer ring, and queued packets leave as a chain of linked
+ * sends prepared by the endpoint. Everything prepared during one loop iteration goes to the kernel
+ * with the single io_uring_enter() of the next wait, which also waits for completions when none
+ * are at hand yet.
+ *
+ * Built when the kernel headers know about multishot recv (Linux 6.0+), otherwise every entry point
+ * fails and event_loop_init() reports the backend as unavailable.
+ */
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT) && defined(IORING_FEAT_EXT_ARG) && defined(IORING_POLL_ADD_MULTI)
+#define HCOMM_HAVE_URING
+#endif
+#endif
+#endif
+
+#ifdef HCOMM_HAVE_URING
+
+#define URING_OP_ACCEPT             (1)
+#define URING_OP_RECV               (2)
+#define URING_OP_POLL               (3)
+#define URING_OP_SEND               (4)
+#define URING_OP_CANCEL             (5)
+#define URING_OP_POLL_READ          (6)
+
+#define URING_BUFFER_GROUP          (0)
+
+typedef struct
+{
+    void *data;
+    uint32_t events;
+    uint32_t generation;
+    uint16_t sends_inflight;
+    uint8_t recv_armed;
+    uint8_t accept_armed;
+    uint8_t poll_armed;
+    uint8_t write_pending;
+} uring_slot_t;
+
+typedef struct
+{
+    int fd;
+    uint32_t generation;
+} uring_write_ready_t;
+
+/* Memory a removed socket had sends in flight from, released with the last of them. */
+typedef struct
+{
+    int fd;
+    uint32_t generation;
+    uint16_t sends_inflight;
+    void (*release)(void *arg);
+    void *arg;
+} uring_held_t;
+
+struct huring_t
+{
+    int ring_fd;
+    // Submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail;
+    unsigned sq_flushed_tail;
+    // Completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    // Mappings to release
+    void *sq_ring_ptr;
+    size_t sq_ring_size;
+    void *cq_ring_ptr;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    // Provided receive buffers, the ones handed out are given back on the next wait
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    uint8_t *buffers;
+    uint16_t buf_tail;
+    uint16_t recycle[HEVENT_MAX_EVENTS];
+    int recycle_count;
+    // Registrations, indexed by fd
+    uring_slot_t *slots;
+    int slot_count;
+    // Stream sockets that got write interest while no send was in flight
+    uring_write_ready_t *write_ready;
+    int write_ready_count;
+    int write_ready_size;
+    // Send buffers of removed sockets the kernel may still read
+    uring_held_t *held;
+    int held_count;
+    int held_size;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static uint64_t uring_user_data(int kind, int index, int fd, uint32_t generation)
+{
+    return (uint64_t)kind | ((uint64_t)(index & 0xff) << 4) | ((uint64_t)(fd & 0x0fffffff) << 12) | ((uint64_t)(generation & 0xffffff) << 40);
+}
+
+static uring_slot_t *uring_slot(struct huring_t *ring, int fd)
+{
+    if (fd < 0)
+        return NULL;
+    if (fd >= ring->slot_count)
+    {
+        int count = ring->slot_count ? ring->slot_count : 256;
+        while (count <= fd)
+            count *= 2;
+        uring_slot_t *slots = realloc(ring->slots, count * sizeof(uring_slot_t));
+        if (slots == NULL)
+            return NULL;
+        memset(slots + ring->slot_count, 0, (count - ring->slot_count) * sizeof(uring_slot_t));
+        ring->slots = slots;
+        ring->slot_count = count;
+    }
+    return &ring->slots[fd];
+}
+
+/* Hand everything prepared so far to the kernel, optionally waiting for completions. */
+static int uring_submit(struct huring_t *ring, unsigned min_complete, int timeout_ms)
+{
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sq_local_tail - ring->sq_flushed_tail;
+    ring->sq_flushed_tail = ring->sq_local_tail;
+
+    unsigned flags = 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (min_complete > 0)
+    {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (timeout_ms >= 0)
+        {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+    else if (to_submit == 0)
+    {
+        return 0;
+    }
+
+    int result = uring_enter(ring->ring_fd, to_submit, min_complete, flags, flags ? &arg : NULL, flags ? sizeof(arg) : 0);
+    if (result < 0)
+    {
+        if (errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            return 0;
+        HLOG_ERROR("Error, io_uring_enter failed: %d\n", errno);
+        return -1;
+    }
+    return result;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct huring_t *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries)
+    {
+        // Submission queue is full, push it out without waiting
+        if (uring_submit(ring, 0, 0) < 0)
+            return NULL;
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_local_tail - head >= ring->sq_entries)
+            return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+static void uring_recycle_buffer(struct huring_t *ring, uint16_t bid)
+{
+    unsigned mask = HURING_BUFFER_COUNT - 1;
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & mask];
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)bid * HURING_BUFFER_SIZE);
+    buf->len = HURING_BUFFER_SIZE;
+    buf->bid = bid;
+    ring->buf_tail++;
+}
+
+static void uring_publish_buffers(struct huring_t *ring)
+{
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int uring_arm_accept(struct huring_t *ring, int fd, uring_slot_t *slot)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = uring_user_data(URING_OP_ACCEPT, 0, fd, slot->generation);
+    slot->accept_armed = 1;
+    return 0;
+}
+
+/* Out of descriptors or memory an accept fails right away again, such a failure ends the multishot
+   accept and goes to the owner, who arms it again through uring_set() once it made room. */
+static bool uring_accept_exhausted(int res)
+{
+    return res == -EMFILE || res == -ENFILE || res == -ENOBUFS || res == -ENOMEM;
+}
+
+static int uring_arm_recv(struct huring_t *ring, int fd, uring_slot_t *slot)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = uring_user_data(URING_OP_RECV, 0, fd, slot->generation);
+    slot->recv_armed = 1;
+    return 0;
+}
+
+/* Stop the multishot recv of a socket that lost read interest, it ends with -ECANCELED. */
+static int uring_cancel_recv(struct huring_t *ring, int fd, uring_slot_t *slot)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uring_user_data(URING_OP_RECV, 0, fd, slot->generation);
+    sqe->user_data = uring_user_data(URING_OP_CANCEL, 0, fd, slot->generation);
+    return 0;
+}
+
+static int uring_arm_poll_write(struct huring_t *ring, int fd, uring_slot_t *slot)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLOUT | POLLERR | POLLHUP;
+    sqe->user_data = uring_user_data(URING_OP_POLL, 0, fd, slot->generation);
+    slot->poll_armed = 1;
+    return 0;
+}
+
+/* Multishot readiness for descriptors registered with HEVENT_POLL, their owner reads them. */
+static int uring_arm_poll_read(struct huring_t *ring, int fd, uring_slot_t *slot)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = uring_user_data(URING_OP_POLL_READ, 0, fd, slot->generation);
+    slot->poll_armed = 1;
+    return 0;
+}
+
+static int uring_push_write_ready(struct huring_t *ring, int fd, uring_slot_t *slot)
+{
+    if (ring->write_ready_count == ring->write_ready_size)
+    {
+        int size = ring->write_ready_size ? ring->write_ready_size * 2 : 64;
+        uring_write_ready_t *write_ready = realloc(ring->write_ready, size * sizeof(uring_write_ready_t));
+        if (write_ready == NULL)
+            return -1;
+        ring->write_ready = write_ready;
+        ring->write_ready_size = size;
+    }
+    ring->write_ready[ring->write_ready_count].fd = fd;
+    ring->write_ready[ring->write_ready_count].generation = slot->generation;
+    ring->write_ready_count++;
+    slot->write_pending = 1;
+    return 0;
+}
+
+int uring_init(hevent_loop_t *loop)
+{
+    struct huring_t *ring = calloc(1, sizeof(struct huring_t));
+    if (ring == NULL)
+        return -1;
+    ring->ring_fd = NO_SOCKET;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = HURING_CQ_ENTRIES;
+    ring->ring_fd = uring_setup(HURING_SQ_ENTRIES, &params);
+    if (ring->ring_fd < 0)
+    {
+        HLOG_ERROR("Error, io_uring_setup failed: %d\n", errno);
+        free(ring);
+        return -1;
+    }
+    loop->uring = ring;
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP))
+    {
+        HLOG_ERROR("Error, io_uring lacks EXT_ARG/NODROP support, kernel too old\n");
+        uring_close(loop);
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = 0;
+    }
+    ring->sq_ring_ptr = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring_ptr == MAP_FAILED)
+    {
+        ring->sq_ring_ptr = NULL;
+        uring_close(loop);
+        return -1;
+    }
+    ring->cq_ring_ptr = ring->sq_ring_ptr;
+    if (ring->cq_ring_size)
+    {
+        ring->cq_ring_ptr = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring_ptr == MAP_FAILED)
+        {
+            ring->cq_ring_ptr = NULL;
+            uring_close(loop);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        uring_close(loop);
+        return -1;
+    }
+
+    uint8_t *sq = ring->sq_ring_ptr;
+    uint8_t *cq = ring->cq_ring_ptr;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = *(unsigned *)(sq + params.sq_off.ring_entries);
+    unsigned *sq_array = (unsigned *)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < ring->sq_entries; ++i)
+        sq_array[i] = i;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->sq_flushed_tail = ring->sq_local_tail;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Provided buffer ring for multishot recv
+    ring->buf_ring_size = HURING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->buffers = malloc((size_t)HURING_BUFFER_COUNT * HURING_BUFFER_SIZE);
+    if (ring->buf_ring == MAP_FAILED || ring->buffers == NULL)
+    {
+        if (ring->buf_ring == MAP_FAILED)
+            ring->buf_ring = NULL;
+        uring_close(loop);
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = HURING_BUFFER_COUNT;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (uring_register(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+    {
+        HLOG_ERROR("Error, io_uring provided buffer ring registration failed: %d\n", errno);
+        uring_close(loop);
+        return -1;
+    }
+    for (int bid = 0; bid < HURING_BUFFER_COUNT; ++bid)
+        uring_recycle_buffer(ring, (uint16_t)bid);
+    uring_publish_buffers(ring);
+    return 0;
+}
+
+void uring_close(hevent_loop_t *loop)
+{
+    struct huring_t *ring = loop->uring;
+    if (ring == NULL)
+        return;
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring_ptr && ring->cq_ring_ptr != ring->sq_ring_ptr)
+        munmap(ring->cq_ring_ptr, ring->cq_ring_size);
+    if (ring->sq_ring_ptr)
+        munmap(ring->sq_ring_ptr, ring->sq_ring_size);
+    if (ring->ring_fd != NO_SOCKET)
+        close(ring->ring_fd);
+    if (ring->buf_ring)
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    free(ring->buffers);
+    free(ring->slots);
+    free(ring->write_ready);
+    // Closing the ring ended their sends
+    for (int i = 0; i < ring->held_count; ++i)
+        ring->held[i].release(ring->held[i].arg);
+    free(ring->held);
+    free(ring);
+    loop->uring = NULL;
+}
+
+/*
+ * Add or change a registration. HEVENT_ACCEPT arms a multishot accept, HEVENT_READ a multishot recv.
+ * HEVENT_WRITE on a stream socket only asks for a write event on the next wait, since the sends
+ * themselves queue in the kernel; without read interest (a connect in progress or throttled reads)
+ * it is a real poll. Dropping read interest cancels the multishot recv.
+ */
+int uring_set(hevent_loop_t *loop, int fd, uint32_t events, void *data)
+{
+    struct huring_t *ring = loop->uring;
+    uring_slot_t *slot = uring_slot(ring, fd);
+    if (slot == NULL)
+        return -1;
+    slot->data = data;
+    slot->events = events;
+
+    if (events & HEVENT_ACCEPT)
+    {
+        if (!slot->accept_armed)
+            return uring_arm_accept(ring, fd, slot);
+        return 0;
+    }
+    if (events & HEVENT_POLL)
+    {
+        if (!slot->poll_armed)
+            return uring_arm_poll_read(ring, fd, slot);
+        return 0;
+    }
+    if ((events & HEVENT_READ) && !slot->recv_armed)
+    {
+        if (uring_arm_recv(ring, fd, slot) != 0)
+            return -1;
+    }
+    else if (!(events & HEVENT_READ) && slot->recv_armed)
+    {
+        // Reads are throttled, the recv is armed again once read interest comes back
+        if (uring_cancel_recv(ring, fd, slot) != 0)
+            return -1;
+    }
+    if (events & HEVENT_WRITE)
+    {
+        if (!(events & HEVENT_READ))
+        {
+            if (!slot->poll_armed)
+                return uring_arm_poll_write(ring, fd, slot);
+        }
+        else if (slot->sends_inflight == 0 && !slot->write_pending)
+        {
+            return uring_push_write_ready(ring, fd, slot);
+        }
+    }
+    return 0;
+}
+
+/* Cancel everything outstanding on fd, the caller may close it right after. Sends already in flight
+   may still read their buffers until they complete, see uring_release_after_sends(). */
+int uring_remove(hevent_loop_t *loop, int fd)
+{
+    struct huring_t *ring = loop->uring;
+    uring_slot_t *slot = uring_slot(ring, fd);
+    if (slot == NULL)
+        return -1;
+    uint32_t generation = slot->generation + 1;
+    memset(slot, 0, sizeof(*slot));
+    slot->generation = generation;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = uring_user_data(URING_OP_CANCEL, 0, fd, generation);
+    return uring_submit(ring, 0, 0) < 0 ? -1 : 0;
+}
+
+/* Call release(arg) once every send in flight on fd completed, right away when there is none. For
+   the memory those sends read, which must outlive the registration removed next. */
+int uring_release_after_sends(hevent_loop_t *loop, int fd, void (*release)(void *arg), void *arg)
+{
+    struct huring_t *ring = loop->uring;
+    uring_slot_t *slot = uring_slot(ring, fd);
+    if (slot == NULL)
+        return -1;
+    if (slot->sends_inflight == 0)
+    {
+        release(arg);
+        return 0;
+    }
+    if (ring->held_count == ring->held_size)
+    {
+        int size = ring->held_size ? ring->held_size * 2 : 16;
+        uring_held_t *held = realloc(ring->held, size * sizeof(uring_held_t));
+        if (held == NULL)
+            return -1;
+        ring->held = held;
+        ring->held_size = size;
+    }
+    uring_held_t *held = &ring->held[ring->held_count++];
+    held->fd = fd;
+    held->generation = slot->generation;
+    held->sends_inflight = slot->sends_inflight;
+    held->release = release;
+    held->arg = arg;
+    return 0;
+}
+
+/* A send of a removed registration completed, the last one releases what it read from. */
+static void uring_held_sent(struct huring_t *ring, int fd, uint32_t generation)
+{
+    for (int i = 0; i < ring->held_count; ++i)
+    {
+        uring_held_t *held = &ring->held[i];
+        if (held->fd != fd || (held->generation & 0xffffff) != generation)
+            continue;
+        if (--held->sends_inflight > 0)
+            return;
+        void (*release)(void *arg) = held->release;
+        void *arg = held->arg;
+        *held = ring->held[--ring->held_count];
+        release(arg);
+        return;
+    }
+}
+
+int uring_prep_send(hevent_loop_t *loop, int fd, const void *buffer, size_t length, int index, bool link)
+{
+    struct huring_t *ring = loop->uring;
+    uring_slot_t *slot = uring_slot(ring, fd);
+    if (slot == NULL)
+        return -1;
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = (uint32_t)length;
+    // WAITALL makes the kernel retry short sends instead of breaking the link chain
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    if (link)
+        sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = uring_user_data(URING_OP_SEND, index, fd, slot->generation);
+    slot->sends_inflight++;
+    return 0;
+}
+
+/* Translate one completion into an event, returns 1 when an event was produced. */
+static int uring_complete(struct huring_t *ring, struct io_uring_cqe *cqe, hevent_t *ev)
+{
+    uint64_t user_data = cqe->user_data;
+    int kind = (int)(user_data & 0xf);
+    int index = (int)((user_data >> 4) & 0xff);
+    int fd = (int)((user_data >> 12) & 0x0fffffff);
+    uint32_t generation = (uint32_t)(user_data >> 40);
+    bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    bool has_buffer = (cqe->flags & IORING_CQE_F_BUFFER) != 0;
+    uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+    if (kind == URING_OP_CANCEL)
+        return 0;
+
+    uring_slot_t *slot = (fd < ring->slot_count) ? &ring->slots[fd] : NULL;
+    if (slot == NULL || slot->data == NULL || (slot->generation & 0xffffff) != generation)
+    {
+        // Completion for a registration that was removed meanwhile
+        if (has_buffer)
+            uring_recycle_buffer(ring, bid);
+        if (kind == URING_OP_SEND)
+            uring_held_sent(ring, fd, generation);
+        return 0;
+    }
+
+    memset(ev, 0, sizeof(*ev));
+    ev->fd = fd;
+    ev->data = slot->data;
+    ev->result = cqe->res;
+
+    switch (kind)
+    {
+    case URING_OP_ACCEPT:
+        if (!more)
+        {
+            slot->accept_armed = 0;
+            if (!uring_accept_exhausted(cqe->res))
+                uring_arm_accept(ring, fd, slot);
+        }
+        if (cqe->res < 0 && !uring_accept_exhausted(cqe->res))
+            return 0;
+        ev->events = HEVENT_ACCEPT;
+        return 1;
+    case URING_OP_RECV:
+        if (!more)
+        {
+            slot->recv_armed = 0;
+            // Read interest may have come back while a cancel was on its way
+            if ((cqe->res > 0 || cqe->res == -ENOBUFS || cqe->res == -ECANCELED) && (slot->events & HEVENT_READ))
+                uring_arm_recv(ring, fd, slot);
+        }
+        if (cqe->res == -ENOBUFS || cqe->res == -ECANCELED)
+            return 0;
+        if (cqe->res < 0)
+        {
+            ev->events = HEVENT_ERROR;
+            return 1;
+        }
+        if (cqe->res == 0)
+        {
+            ev->events = HEVENT_READ | HEVENT_HANGUP;
+            return 1;
+        }
+        if (!has_buffer)
+            return 0;
+        ev->events = HEVENT_READ;
+        ev->buffer = ring->buffers + (size_t)bid * HURING_BUFFER_SIZE;
+        ring->recycle[ring->recycle_count++] = bid;
+        return 1;
+    case URING_OP_POLL:
+        slot->poll_armed = 0;
+        ev->events = HEVENT_WRITE;
+        if (cqe->res < 0 || (cqe->res & (POLLERR | POLLHUP)))
+            ev->events |= HEVENT_ERROR;
+        return 1;
+    case URING_OP_POLL_READ:
+        if (!more)
+        {
+            slot->poll_armed = 0;
+            if (cqe->res >= 0)
+                uring_arm_poll_read(ring, fd, slot);
+        }
+        ev->events = cqe->res < 0 ? HEVENT_ERROR : HEVENT_READ;
+        return 1;
+    case URING_OP_SEND:
+        if (slot->sends_inflight > 0)
+            slot->sends_inflight--;
+        ev->events = HEVENT_SENT;
+        ev->index = (uint16_t)index;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+int uring_wait(hevent_loop_t *loop, int timeout_ms)
+{
+    struct huring_t *ring = loop->uring;
+    int count = 0;
+
+    // Everything handed out by the previous wait has been consumed by now
+    for (int i = 0; i < ring->recycle_count; ++i)
+        uring_recycle_buffer(ring, ring->recycle[i]);
+    ring->recycle_count = 0;
+    uring_publish_buffers(ring);
+
+    // Pending write interest is served without a syscall, the sends it produces ride on the next enter
+    while (ring->write_ready_count > 0 && count < HEVENT_MAX_EVENTS)
+    {
+        uring_write_ready_t ready = ring->write_ready[--ring->write_ready_count];
+        uring_slot_t *slot = &ring->slots[ready.fd];
+        if (slot->generation != ready.generation || slot->data == NULL || !slot->write_pending)
+            continue;
+        slot->write_pending = 0;
+        memset(&loop->events[count], 0, sizeof(hevent_t));
+        loop->events[count].fd = ready.fd;
+        loop->events[count].events = HEVENT_WRITE;
+        loop->events[count].data = slot->data;
+        count++;
+    }
+
+    // Sends prepared since the last wait go out now, only waiting for completions when nothing
+    // is at hand already
+    unsigned head = *ring->cq_head;
+    bool ready = count > 0 || head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (uring_submit(ring, !ready && timeout_ms != 0 ? 1 : 0, timeout_ms) < 0)
+        return -1;
+
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail && count < HEVENT_MAX_EVENTS)
+    {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        count += uring_complete(ring, cqe, &loop->events[count]);
+        head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+#else
+
+int uring_init(hevent_loop_t *loop)
+{
+    HLOG_ERROR("Error, io_uring backend not available in this build\n");
+    return -1;
+}
+
+void uring_close(hevent_loop_t *loop)
+{
+}
+
+int uring_set(hevent_loop_t *loop, int fd, uint32_t events, void *data)
+{
+    return -1;
+}
+
+int uring_remove(hevent_loop_t *loop, int fd)
+{
+    return -1;
+}
+
+int uring_prep_send(hevent_loop_t *loop, int fd, const void *buffer, size_t length, int index, bool link)
+{
+    return -1;
+}
+
+int uring_release_after_sends(hevent_loop_t *loop, int fd, void (*release)(void *arg), void *arg)
+{
+    return -1;
+}
+
+int uring_wait(hevent_loop_t *loop, int timeout_ms)
+{
+    return -1;
+}
+
+#endif